@@ -0,0 +1,290 @@
+#!/usr/bin/env python3
+#
+# Benchmark of curlhttpsrc against a local HTTP server.
+#
+# The server listens on TCP and on a Unix socket, configurations with
+# unix-socket-path go through the latter. It sends the body in fixed-size
+# chunks, optionally paced, each starting with the monotonic time it was sent
+# at. The sink reads those back, so the latency from the server to the sink is
+# measured the same way whatever the element does with the buffers in between.
+#
+#   GST_PLUGIN_PATH=src/.libs python3 bench/curlhttpsrc-bench.py
+#
+# Loopback has next to no round trip time, so the socket and curl buffer sizes
+# make little difference there. --netem adds a delay each way on lo with
+# tc netem, which needs root, for a link with a bandwidth-delay product:
+#
+#   sudo GST_PLUGIN_PATH=src/.libs python3 bench/curlhttpsrc-bench.py \
+#       --netem 20 --only adapter --only 'rcvbuf 4m'
+#
+# It amounts to `tc qdisc add dev lo root netem delay 20ms`, removed at the
+# end. The Unix socket configurations are not delayed by it. --delay instead
+# holds each response in the server, a time to first byte without a longer
+# round trip, which is what tcp-fastopen saves on. Fast open also needs
+# net.ipv4.tcp_fastopen=3 for the server to take data with the SYN.
+#
+# Every configuration of the matrix, the output modes and the transport
+# tuning, is run in turn and reported on one line: throughput, buffers pushed
+# and their mean size, mean and 99th percentile latency, CPU time of the
+# process and the lock-stats counters of the element. The medians of --runs
+# runs are reported.
+#
+
+import argparse
+import http.server
+import multiprocessing
+import os
+import resource
+import socket
+import socketserver
+import statistics
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+import gi
+gi.require_version('Gst', '1.0')
+from gi.repository import Gst  # noqa: E402
+
+STAMP = struct.Struct('<Q')
+
+# Stands for the path of the Unix socket of the server
+UNIX_SOCKET = object()
+
+# name, properties of curlhttpsrc
+MATRIX = [
+    ('adapter', {}),
+    ('direct-push', {'direct-push': True}),
+    ('direct-push 64k', {'direct-push': True, 'min-output-size': 65536,
+                         'max-output-latency': 20}),
+    # The transport tuning, each against the adapter above
+    ('curl-buffer 64k', {'curl-buffer-size': 65536}),
+    ('curl-buffer 512k', {'curl-buffer-size': 524288}),
+    ('nagle', {'tcp-nodelay': False}),
+    ('tcp-fastopen', {'tcp-fastopen': True}),
+    ('rcvbuf 256k', {'socket-rcvbuf': 262144}),
+    ('rcvbuf 4m', {'socket-rcvbuf': 4194304}),
+    ('curl-buffer 512k rcvbuf 4m', {'curl-buffer-size': 524288,
+                                    'socket-rcvbuf': 4194304}),
+    # The same requests through a Unix socket instead of loopback TCP
+    ('unix', {'unix-socket-path': UNIX_SOCKET}),
+    ('unix direct-push', {'unix-socket-path': UNIX_SOCKET,
+                          'direct-push': True}),
+]
+
+
+class BodyHandler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def do_GET(self):
+        size, chunk, rate, delay = self.server.body
+        if delay:
+            time.sleep(delay / 1000)
+        self.send_response(200)
+        self.send_header('Content-Type', 'application/octet-stream')
+        self.send_header('Content-Length', str(size))
+        self.end_headers()
+
+        filler = bytes(chunk - STAMP.size)
+        start = time.monotonic()
+        sent = 0
+        try:
+            while sent < size:
+                if rate:
+                    delay = start + sent / rate - time.monotonic()
+                    if delay > 0:
+                        time.sleep(delay)
+                data = STAMP.pack(time.monotonic_ns()) + filler
+                data = data[:size - sent]
+                self.wfile.write(data)
+                sent += len(data)
+        except (BrokenPipeError, ConnectionResetError):
+            pass
+
+    def log_message(self, format, *args):
+        pass
+
+
+class TCPServer(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+
+    def server_bind(self):
+        # Accept data with the SYN from clients with a fast open cookie
+        if hasattr(socket, 'TCP_FASTOPEN'):
+            self.socket.setsockopt(socket.IPPROTO_TCP, socket.TCP_FASTOPEN, 16)
+        super().server_bind()
+
+
+class UnixServer(socketserver.ThreadingMixIn, socketserver.UnixStreamServer):
+    daemon_threads = True
+
+
+def serve(servers):
+    for server in servers[1:]:
+        threading.Thread(target=server.serve_forever, daemon=True).start()
+    servers[0].serve_forever()
+
+
+def start_server(args):
+    tcp = TCPServer(('127.0.0.1', 0), BodyHandler)
+    unix = UnixServer(args.socket, BodyHandler)
+    for server in (tcp, unix):
+        server.body = (args.size, args.chunk, args.rate, args.delay)
+    # The listening sockets go to the child as they are
+    proc = multiprocessing.get_context('fork').Process(
+        target=serve, args=((tcp, unix),), daemon=True)
+    proc.start()
+    tcp.server_close()
+    unix.socket.close()
+    return proc, 'http://127.0.0.1:%d/body' % tcp.server_address[1]
+
+
+class Sink:
+    """Reads the send times back out of the chunks reaching the sink."""
+
+    def __init__(self, chunk):
+        self.chunk = chunk
+        self.offset = 0
+        self.partial = b''
+        self.buffers = 0
+        self.latencies = []
+
+    def handoff(self, sink, buf, pad):
+        now = time.monotonic_ns()
+        ok, info = buf.map(Gst.MapFlags.READ)
+        if not ok:
+            return
+        data = info.data
+        size = len(data)
+        try:
+            self.buffers += 1
+            pos = 0
+            if self.partial:
+                need = STAMP.size - len(self.partial)
+                self.partial += bytes(data[:need])
+                if len(self.partial) == STAMP.size:
+                    self.latencies.append(now - STAMP.unpack(self.partial)[0])
+                    self.partial = b''
+            pos = -self.offset % self.chunk
+            while pos < size:
+                stamp = bytes(data[pos:pos + STAMP.size])
+                if len(stamp) < STAMP.size:
+                    self.partial = stamp
+                else:
+                    self.latencies.append(now - STAMP.unpack(stamp)[0])
+                pos += self.chunk
+        finally:
+            buf.unmap(info)
+            self.offset += size
+
+
+def lock_stats(src):
+    stats = src.get_property('lock-stats')
+    return {f: stats.get_uint64(f)[1] for f in ('pushes', 'wakeups')}
+
+
+def netem(delay):
+    """Delay every packet on loopback, the round trip takes twice that."""
+    subprocess.run(['tc', 'qdisc', 'add', 'dev', 'lo', 'root', 'netem',
+                    'delay', '%gms' % delay], check=True)
+
+
+def netem_clear():
+    subprocess.run(['tc', 'qdisc', 'del', 'dev', 'lo', 'root'], check=False)
+
+
+def run(url, props, args):
+    pipeline = Gst.parse_launch(
+        'curlhttpsrc name=src ! fakesink name=sink sync=false '
+        'signal-handoffs=true')
+    src = pipeline.get_by_name('src')
+    src.set_property('location', url)
+    for name, value in props.items():
+        if value is UNIX_SOCKET:
+            value = args.socket
+        Gst.util_set_object_arg(src, name, str(value).lower()
+                                if isinstance(value, bool) else str(value))
+    sink = Sink(args.chunk)
+    pipeline.get_by_name('sink').connect('handoff', sink.handoff)
+
+    before = lock_stats(src)
+    usage = resource.getrusage(resource.RUSAGE_SELF)
+    start = time.monotonic()
+    pipeline.set_state(Gst.State.PLAYING)
+    msg = pipeline.get_bus().timed_pop_filtered(
+        Gst.CLOCK_TIME_NONE, Gst.MessageType.EOS | Gst.MessageType.ERROR)
+    elapsed = time.monotonic() - start
+    after = resource.getrusage(resource.RUSAGE_SELF)
+    stats = lock_stats(src)
+    pipeline.set_state(Gst.State.NULL)
+
+    if msg.type == Gst.MessageType.ERROR:
+        err, debug = msg.parse_error()
+        sys.exit('%s: %s' % (err.message, debug))
+
+    lat = sorted(sink.latencies) or [0]
+    return {
+        'MB/s': args.size / elapsed / 1e6,
+        'buffers': sink.buffers,
+        'KiB/buf': sink.offset / max(sink.buffers, 1) / 1024,
+        'lat ms': statistics.mean(lat) / 1e6,
+        'p99 ms': lat[int(len(lat) * 0.99)] / 1e6,
+        'cpu s': (after.ru_utime + after.ru_stime -
+                  usage.ru_utime - usage.ru_stime),
+        'pushes': stats['pushes'] - before['pushes'],
+        'wakeups': stats['wakeups'] - before['wakeups'],
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Benchmark curlhttpsrc against a local HTTP server')
+    parser.add_argument('--size', type=int, default=64 << 20,
+                        help='body size in bytes')
+    parser.add_argument('--chunk', type=int, default=16 << 10,
+                        help='size of the chunks written by the server')
+    parser.add_argument('--rate', type=float, default=0,
+                        help='pace of the server in bytes/s, 0 for none')
+    parser.add_argument('--delay', type=float, default=0,
+                        help='ms the server waits before each response')
+    parser.add_argument('--netem', type=float, default=0,
+                        help='ms of delay each way on loopback, needs root')
+    parser.add_argument('--runs', type=int, default=3)
+    parser.add_argument('--only', action='append',
+                        help='run only this configuration, can be repeated')
+    args = parser.parse_args()
+
+    Gst.init(None)
+    if Gst.ElementFactory.find('curlhttpsrc') is None:
+        sys.exit('curlhttpsrc not found, set GST_PLUGIN_PATH')
+
+    tmpdir = tempfile.TemporaryDirectory()
+    args.socket = os.path.join(tmpdir.name, 'server.sock')
+    server, url = start_server(args)
+    if args.netem:
+        netem(args.netem)
+    try:
+        header = None
+        for name, props in MATRIX:
+            if args.only and name not in args.only:
+                continue
+            results = [run(url, props, args) for _ in range(args.runs)]
+            if header is None:
+                header = list(results[0])
+                print('%-28s' % 'configuration' +
+                      ''.join('%10s' % h for h in header))
+            print('%-28s' % name + ''.join(
+                '%10.2f' % statistics.median(r[h] for r in results)
+                for h in header))
+    finally:
+        if args.netem:
+            netem_clear()
+        server.terminate()
+        tmpdir.cleanup()
+
+
+if __name__ == '__main__':
+    main()
@@ -68,6 +68,11 @@
 #define GSTCURL_HANDLE_DEFAULT_CURLOPT_TIMEOUT 0
 #define GSTCURL_HANDLE_DEFAULT_CURLOPT_SSL_VERIFYPEER 1
 #define GSTCURL_HANDLE_DEFAULT_CURLOPT_CAINFO ((void *)0)
+/* curl's own, CURL_MAX_WRITE_SIZE */
+#define GSTCURL_HANDLE_DEFAULT_CURLOPT_BUFFERSIZE (16 * 1024L)
+#define GSTCURL_HANDLE_DEFAULT_CURLOPT_TCP_NODELAY 1L
+#define GSTCURL_HANDLE_DEFAULT_CURLOPT_TCP_FASTOPEN 0L
+#define GSTCURL_HANDLE_DEFAULT_CURLOPT_UNIX_SOCKET_PATH ((void *)0)
 #ifdef CURL_VERSION_HTTP2
 #define GSTCURL_HANDLE_DEFAULT_CURLOPT_HTTP_VERSION 2.0
 #else
@@ -83,6 +88,41 @@
 
 /* Not a CURLOPT, is something I've implemented which curl doesn't */
 #define GSTCURL_HANDLE_DEFAULT_RETRIES -1
+/* Not CURLOPT_LOW_SPEED_*, these have a window in milliseconds */
+#define GSTCURL_HANDLE_DEFAULT_LOW_SPEED_LIMIT 0
+#define GSTCURL_HANDLE_DEFAULT_LOW_SPEED_TIME 5000
+#define GSTCURL_HANDLE_DEFAULT_HEDGE_PERCENTILE 0
+#define GSTCURL_HANDLE_DEFAULT_HEDGE_MAX_RATE 0.1
+/* Not CURLOPT_MAX_RECV_SPEED_LARGE, these are in bits per second */
+#define GSTCURL_HANDLE_DEFAULT_MAX_BITRATE 0
+#define GSTCURL_HANDLE_DEFAULT_SHARED_MAX_BITRATE 0
+#define GSTCURL_HANDLE_DEFAULT_BANDWIDTH_WEIGHT 1
+/* In milliseconds from the start of each request, 0 is none */
+#define GSTCURL_HANDLE_DEFAULT_DEADLINE 0
+#define GSTCURL_HANDLE_DEFAULT_COALESCE FALSE
+#define GSTCURL_HANDLE_DEFAULT_DIRECT_PUSH FALSE
+/* 0 hands out what is available, -1 uses the blocksize */
+#define GSTCURL_HANDLE_DEFAULT_MIN_OUTPUT_SIZE 0
+/* In milliseconds, 0 waits for a full buffer */
+#define GSTCURL_HANDLE_DEFAULT_MAX_OUTPUT_LATENCY 100
+/* In bytes, a threshold of 0 never spills */
+#define GSTCURL_HANDLE_DEFAULT_SPILL_THRESHOLD 0
+#define GSTCURL_HANDLE_DEFAULT_SPILL_MAX_SIZE (256 * 1024 * 1024)
+#define GSTCURL_HANDLE_DEFAULT_USE_BUFFERING FALSE
+/* In bytes, what 100% of buffering is */
+#define GSTCURL_HANDLE_DEFAULT_BUFFER_SIZE (2 * 1024 * 1024)
+/* In bytes, -1 keeps downloading while paused */
+#define GSTCURL_HANDLE_DEFAULT_PAUSED_LOOKAHEAD -1
+/* In milliseconds, 0 never probes the size */
+#define GSTCURL_HANDLE_DEFAULT_PROBE_TIMEOUT 0
+#define GSTCURL_HANDLE_DEFAULT_TRUST_CONTENT_TYPE FALSE
+#define GSTCURL_HANDLE_DEFAULT_DECODE_OFFLOAD FALSE
+#define GSTCURL_HANDLE_DEFAULT_TLS_SESSION_FILE NULL
+#define GSTCURL_HANDLE_DEFAULT_SSL_CA_DATA NULL
+/* In seconds, -1 keeps it forever and 0 parses it for every transfer */
+#define GSTCURL_HANDLE_DEFAULT_CA_CACHE_TIMEOUT 86400
+/* In bytes, 0 leaves the size of the system, which it tunes itself */
+#define GSTCURL_HANDLE_DEFAULT_SOCKET_RCVBUF 0
 
 /*
  * Now set acceptable ranges. Defaults can lie outside the range, in which case
@@ -101,6 +141,12 @@
 #define GSTCURL_HANDLE_MAX_CURLOPT_TIMEOUT 3600
 #define GSTCURL_HANDLE_MIN_CURLOPT_SSL_VERIFYPEER 0
 #define GSTCURL_HANDLE_MAX_CURLOPT_SSL_VERIFYPEER 1
+#define GSTCURL_HANDLE_MIN_CURLOPT_BUFFERSIZE 1024L
+#define GSTCURL_HANDLE_MAX_CURLOPT_BUFFERSIZE (512 * 1024L)
+#define GSTCURL_HANDLE_MIN_CURLOPT_TCP_NODELAY 0L
+#define GSTCURL_HANDLE_MAX_CURLOPT_TCP_NODELAY 1L
+#define GSTCURL_HANDLE_MIN_CURLOPT_TCP_FASTOPEN 0L
+#define GSTCURL_HANDLE_MAX_CURLOPT_TCP_FASTOPEN 1L
 #define GSTCURL_HANDLE_MIN_CURLOPT_HTTP_VERSION CURL_HTTP_VERSION_1_0
 #ifdef CURL_VERSION_HTTP2
 #define GSTCURL_HANDLE_MAX_CURLOPT_HTTP_VERSION CURL_HTTP_VERSION_2_0
@@ -121,5 +167,35 @@
 
 #define GSTCURL_HANDLE_MIN_RETRIES -1
 #define GSTCURL_HANDLE_MAX_RETRIES 9999
+#define GSTCURL_HANDLE_MIN_LOW_SPEED_LIMIT 0
+#define GSTCURL_HANDLE_MAX_LOW_SPEED_LIMIT G_MAXINT
+#define GSTCURL_HANDLE_MIN_LOW_SPEED_TIME 100
+#define GSTCURL_HANDLE_MAX_LOW_SPEED_TIME 600000
+#define GSTCURL_HANDLE_MIN_HEDGE_PERCENTILE 0
+#define GSTCURL_HANDLE_MAX_HEDGE_PERCENTILE 99
+#define GSTCURL_HANDLE_MIN_HEDGE_MAX_RATE 0.0
+#define GSTCURL_HANDLE_MAX_HEDGE_MAX_RATE 1.0
+#define GSTCURL_HANDLE_MIN_BANDWIDTH_WEIGHT 1
+#define GSTCURL_HANDLE_MAX_BANDWIDTH_WEIGHT 1000
+#define GSTCURL_HANDLE_MIN_MIN_OUTPUT_SIZE -1
+#define GSTCURL_HANDLE_MAX_MIN_OUTPUT_SIZE G_MAXINT
+#define GSTCURL_HANDLE_MIN_MAX_OUTPUT_LATENCY 0
+#define GSTCURL_HANDLE_MAX_MAX_OUTPUT_LATENCY 60000
+#define GSTCURL_HANDLE_MIN_SPILL_THRESHOLD 0
+#define GSTCURL_HANDLE_MAX_SPILL_THRESHOLD G_MAXINT
+#define GSTCURL_HANDLE_MIN_SPILL_MAX_SIZE (1024 * 1024)
+#define GSTCURL_HANDLE_MAX_SPILL_MAX_SIZE G_MAXINT
+#define GSTCURL_HANDLE_MIN_BUFFER_SIZE 1
+#define GSTCURL_HANDLE_MAX_BUFFER_SIZE G_MAXINT
+#define GSTCURL_HANDLE_MIN_PAUSED_LOOKAHEAD -1
+#define GSTCURL_HANDLE_MAX_PAUSED_LOOKAHEAD G_MAXINT
+#define GSTCURL_HANDLE_MIN_PROBE_TIMEOUT 0
+#define GSTCURL_HANDLE_MAX_PROBE_TIMEOUT 60000
+#define GSTCURL_HANDLE_MIN_CA_CACHE_TIMEOUT -1
+#define GSTCURL_HANDLE_MAX_CA_CACHE_TIMEOUT G_MAXINT
+#define GSTCURL_HANDLE_MIN_SOCKET_RCVBUF 0
+#define GSTCURL_HANDLE_MAX_SOCKET_RCVBUF G_MAXINT
+#define GSTCURL_HANDLE_MIN_DEADLINE 0
+#define GSTCURL_HANDLE_MAX_DEADLINE 3600000
 
 #endif /* GSTCURLDEFAULTS_H_ */
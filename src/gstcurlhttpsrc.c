@@ -142,6 +142,42 @@ GST_DEBUG_CATEGORY_STATIC (gst_curl_loop_debug);
 #define gst_curl_http_src_parent_class parent_class
 static GstPushSrcClass * parent_class = NULL;
 
+/* What the probes learned of each URI, for the next elements opening it */
+typedef struct
+{
+  guint64 size;
+  gboolean no_ranges;
+  gint64 time;
+} GstCurlHttpSrcProbeResult;
+
+static GMutex gst_curl_http_src_probe_mutex;
+static GHashTable *gst_curl_http_src_probe_results = NULL;
+
+/*
+ * The TLS sessions of every handle are kept in one share, so that a new
+ * connection to an origin resumes a session of any element. Each kind of data
+ * of the share has its lock, curl may take several of them at once.
+ */
+static GMutex gst_curl_http_src_share_mutex;
+static GMutex gst_curl_http_src_share_locks[CURL_LOCK_DATA_LAST];
+static CURLSH *gst_curl_http_src_share = NULL;
+/* The session files already loaded into the share */
+static GHashTable *gst_curl_http_src_session_files = NULL;
+
+/* What the element can decode when curl does not */
+#ifdef HAVE_BROTLI
+#define GSTCURL_ACCEPT_BR ", br"
+#else
+#define GSTCURL_ACCEPT_BR ""
+#endif
+#ifdef HAVE_ZSTD
+#define GSTCURL_ACCEPT_ZSTD ", zstd"
+#else
+#define GSTCURL_ACCEPT_ZSTD ""
+#endif
+#define GSTCURL_ACCEPT_ENCODING \
+    "Accept-Encoding: gzip, deflate" GSTCURL_ACCEPT_BR GSTCURL_ACCEPT_ZSTD
+
 /*
  * Make a source pad template to be able to kick out recv'd data
  */
@@ -150,20 +186,72 @@ static GstStaticPadTemplate srcpadtemplate = GST_STATIC_PAD_TEMPLATE ("src",
     GST_PAD_ALWAYS,
     GST_STATIC_CAPS_ANY);
 
+/*
+ * The Content-Types that say for sure what the data is, with the caps
+ * typefinding would find for it. audio/mpeg is left to typefinding, the layer
+ * is not in the type.
+ */
+static const struct
+{
+  const gchar *mime;
+  const gchar *caps;
+} gst_curl_http_src_mime_caps[] = {
+  {"video/mp2t", "video/mpegts, systemstream=(boolean)true, "
+        "packetsize=(int)188"},
+  {"video/mp4", "video/quicktime, variant=(string)iso"},
+  {"audio/mp4", "video/quicktime, variant=(string)iso"},
+  {"video/iso.segment", "video/quicktime, variant=(string)iso"},
+  {"application/dash+xml", "application/dash+xml"},
+  {"application/vnd.apple.mpegurl", "application/x-hls"},
+  {"application/x-mpegurl", "application/x-hls"},
+  {"application/vnd.ms-sstr+xml", "application/vnd.ms-sstr+xml"},
+  {"audio/aac", "audio/mpeg, mpegversion=(int)4, stream-format=(string)adts"},
+  {"audio/aacp", "audio/mpeg, mpegversion=(int)4, stream-format=(string)adts"},
+  {"audio/flac", "audio/x-flac"},
+  {"video/webm", "video/webm"},
+  {"audio/webm", "audio/webm"},
+  {"video/x-matroska", "video/x-matroska"},
+  {"video/x-flv", "video/x-flv"},
+  {"text/vtt", "application/x-subtitle-vtt"},
+  {NULL, NULL}
+};
+
 /*
  * Function Definitions
  */
 /* Gstreamer generic element functions */
 static gboolean gst_curl_http_src_negotiate_caps (GstCurlHttpSrc * src);
+static void gst_curl_http_src_post_deadline_miss (GstCurlHttpSrc * src);
 static void gst_curl_http_src_cleanup_instance(GstCurlHttpSrc *src);
+#if GST_CHECK_VERSION(1,0,0)
+static gboolean gst_curl_http_src_decide_allocation (GstBaseSrc * bsrc,
+    GstQuery * query);
+#endif
 
 static CURL *gst_curl_http_src_create_easy_handle (GstCurlHttpSrc * s);
 static size_t gst_curl_http_src_get_header (void *header, size_t size,
     size_t nmemb, void * src);
 static size_t gst_curl_http_src_get_chunks (void *chunk, size_t size,
     size_t nmemb, void * src);
+static void gst_curl_http_src_take_buffer (GstBuffer * buf, gsize size,
+    gpointer src);
 static char *gst_curl_http_src_strcasestr (const char *haystack,
     const char *needle);
+static gchar *gst_curl_http_src_header_value (const gchar * header,
+    size_t len, const gchar * name);
+static void gst_curl_http_src_cache_clear (GstCurlHttpSrc * s);
+static GstCurlHttpSrcEncoding gst_curl_http_src_encoding (const gchar * value);
+static void gst_curl_http_src_decoder_clear (GstCurlHttpSrc * s);
+static GstBuffer *gst_curl_http_src_decode (GstCurlHttpSrc * s,
+    GstCurlHttpSrcEncoding encoding, GstBuffer * buf);
+static void gst_curl_http_src_fetch_cancel (GstCurlHttpSrc * s);
+#if LIBCURL_VERSION_NUM >= 0x072000
+static int gst_curl_http_src_xferinfo (void *src, curl_off_t dltotal,
+    curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+#else
+static int gst_curl_http_src_progress (void *src, double dltotal,
+    double dlnow, double ultotal, double ulnow);
+#endif
 
 /* must be called with the context lock */
 static void
@@ -174,618 +262,3391 @@ gst_curl_http_src_reset (GstCurlHttpSrc * src)
   src->start_position = 0;
   src->stop_position = -1;
 
+  /* reset the retry logic, a new resource might be requested */
+  src->retries_remaining = src->total_retries;
+  src->retry_attempt = 0;
+  src->retry_progress = 0;
+  src->resuming = FALSE;
+  src->resume_mismatch = FALSE;
+  src->resume_validated = FALSE;
+  src->stalled = FALSE;
+  src->location_index = 0;
+  src->raced = FALSE;
+  src->no_multirange = FALSE;
+  src->no_ranges = FALSE;
+  src->have_response = FALSE;
+  src->entity_encoded = FALSE;
+  gst_curl_http_src_decoder_clear (src);
+  src->decode_error = FALSE;
+  gst_curl_http_src_cache_clear (src);
+  g_atomic_int_set (&src->adapter_level, 0);
+  GST_OBJECT_LOCK (src);
+  src->buffering_percent = -1;
+  src->buffering_time = 0;
+  src->bytes_in = src->bytes_out = 0;
+  src->avg_in = src->avg_out = 0;
+  GST_OBJECT_UNLOCK (src);
+  g_free (src->headers.etag);
+  src->headers.etag = NULL;
+  g_free (src->headers.last_modified);
+  src->headers.last_modified = NULL;
+
   /* reset the context */
   /* reset the adapter */
   if (src->context.adapter)
     gst_adapter_clear (src->context.adapter);
+  gst_curl_multi_context_source_flush (&src->context);
   /* remove the handle */
 }
 
 /*
- * From the data in the queue element s, create a CURL easy handle and populate
- * options with the URL, proxy data, login options, cookies,
+ * Count the bytes handed to the element.
+ *
+ * must be called with the context lock
  */
-static CURL *
-gst_curl_http_src_create_easy_handle (GstCurlHttpSrc * s)
+static void
+gst_curl_http_src_account (GstCurlHttpSrc * s, gsize len)
 {
-  CURL *handle;
-  gint i;
-  GSTCURL_FUNCTION_ENTRY (s);
-
-  handle = curl_easy_init ();
-  if (handle == NULL) {
-    GST_ERROR_OBJECT (s, "Couldn't init a curl easy handle!");
-    return NULL;
+  /*
+   * Data is flowing again, start over with the retries once enough of it came
+   * in. A server failing after a few bytes each time still runs out of them.
+   */
+  if (G_UNLIKELY (s->retry_attempt)) {
+    s->retry_progress += len;
+    if (s->retry_progress >= GSTCURL_RETRY_PROGRESS_MIN) {
+      s->retry_attempt = 0;
+      s->retries_remaining = s->total_retries;
+    }
   }
-  GST_INFO_OBJECT (s, "Creating a new handle for URI %s", s->uri);
 
-  /* This is mandatory and yet not default option, so if this is NULL
-   * then something very bad is going on. */
-  curl_easy_setopt (handle, CURLOPT_URL, s->uri);
-
-  gst_curl_setopt_str (s, handle, CURLOPT_USERNAME, s->username);
-  gst_curl_setopt_str (s, handle, CURLOPT_PASSWORD, s->password);
-  gst_curl_setopt_str (s, handle, CURLOPT_PROXY, s->proxy_uri);
-  gst_curl_setopt_str (s, handle, CURLOPT_NOPROXY, s->no_proxy_list);
-  gst_curl_setopt_str (s, handle, CURLOPT_PROXYUSERNAME, s->proxy_user);
-  gst_curl_setopt_str (s, handle, CURLOPT_PROXYPASSWORD, s->proxy_pass);
+  /* increment the positions */
+  if (G_LIKELY (s->start_position == s->read_position))
+    s->start_position += len;
+  s->read_position += len;
+}
 
-  for (i = 0; i < s->number_cookies; i++) {
-    gst_curl_setopt_str (s, handle, CURLOPT_COOKIELIST, s->cookies[i]);
-  }
+/*
+ * TRUE if the data goes to memory downstream asked for.
+ */
+static gboolean
+gst_curl_http_src_downstream_memory (GstCurlHttpSrc * s)
+{
+  gboolean ret = FALSE;
 
-  if (s->slist) {
-    curl_slist_free_all (s->slist);
-    s->slist = NULL;
-  }
+#if GST_CHECK_VERSION(1,0,0)
+  GST_OBJECT_LOCK (s);
+  ret = s->pool != NULL || s->allocator != NULL;
+  GST_OBJECT_UNLOCK (s);
+#endif
 
-  /* curl_slist_append dynamically allocates memory, but I need to free it */
-  for (i = 0; i < s->number_headers; i++) {
-    s->slist = curl_slist_append(s->slist, s->extra_headers[i]);
-  }
+  return ret;
+}
 
-  if (s->start_position != 0 || s->stop_position != -1) {
-    gchar *range;
+/*
+ * Wrap what the whole body got so far in a buffer, without a copy.
+ */
+static GstBuffer *
+gst_curl_http_src_whole_take (GstCurlHttpSrc * s)
+{
+  GstBuffer *buf;
 
-    /* TODO remove old Range header  */
-    if (s->stop_position != -1) {
-      range = g_strdup_printf ("Range: bytes=%" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT,
-          s->start_position, s->stop_position);
-    } else {
-      range = g_strdup_printf ("Range: bytes=%" G_GUINT64_FORMAT "-",
-          s->start_position);
-    }
+#if GST_CHECK_VERSION(1,0,0)
+  buf = gst_buffer_new_wrapped (s->whole, s->whole_filled);
+#else
+  buf = gst_buffer_new ();
+  GST_BUFFER_MALLOCDATA (buf) = s->whole;
+  GST_BUFFER_DATA (buf) = s->whole;
+  GST_BUFFER_SIZE (buf) = s->whole_filled;
+#endif
+  s->whole = NULL;
 
-    GST_DEBUG_OBJECT (s, "Adding header: '%s'", range);
+  return buf;
+}
 
-    s->slist = curl_slist_append (s->slist, range);
-    g_free (range);
-  }
+/*
+ * Note when the len bytes about to be put in the adapter arrived.
+ *
+ * must be called with the context lock
+ */
+static void
+gst_curl_http_src_arrived (GstCurlHttpSrc * s, gsize len)
+{
+  GstCurlHttpSrcArrival *arrival;
 
-  if (s->slist != NULL) {
-      curl_easy_setopt(handle, CURLOPT_HTTPHEADER, s->slist);
-  }
+  if (len == 0)
+    return;
 
-  gst_curl_setopt_str_default (s, handle, CURLOPT_USERAGENT, s->user_agent);
+  arrival = g_slice_new (GstCurlHttpSrcArrival);
+  s->adapter_in += len;
+  arrival->end = s->adapter_in;
+  arrival->time = g_get_monotonic_time ();
+  g_queue_push_tail (&s->arrivals, arrival);
+}
 
-  /*
-   * Unlike soup, this isn't a binary op, curl wants a string here. So if it's
-   * TRUE, simply set the value as an empty string as this allows both gzip and
-   * zlib compression methods.
-   */
-  if(s->accept_compressed_encodings == TRUE) {
-      curl_easy_setopt(handle, CURLOPT_ACCEPT_ENCODING, "");
-  }
-  else {
-      curl_easy_setopt(handle, CURLOPT_ACCEPT_ENCODING, "identity");
-  }
+/*
+ * When the oldest byte in the adapter arrived, whatever was taken or cleared
+ * out of it since.
+ *
+ * must be called with the context lock
+ */
+static gint64
+gst_curl_http_src_oldest (GstCurlHttpSrc * s)
+{
+  guint64 oldest = s->adapter_in -
+      gst_adapter_available (s->context.adapter);
+  GstCurlHttpSrcArrival *arrival;
 
-  gst_curl_setopt_int (s, handle, CURLOPT_FOLLOWLOCATION,
-                       s->allow_3xx_redirect);
-  gst_curl_setopt_int_default (s, handle, CURLOPT_MAXREDIRS,
-                       s->max_3xx_redirects);
-  gst_curl_setopt_int (s, handle, CURLOPT_TCP_KEEPALIVE,
-                       GSTCURL_BINARYBOOL (s->keep_alive));
-  gst_curl_setopt_int (s, handle, CURLOPT_TIMEOUT, s->timeout_secs);
-  gst_curl_setopt_int (s, handle, CURLOPT_SSL_VERIFYPEER,
-                       GSTCURL_BINARYBOOL (s->strict_ssl));
-  gst_curl_setopt_str (s, handle, CURLOPT_CAINFO, s->custom_ca_file);
+  while ((arrival = g_queue_peek_head (&s->arrivals)) &&
+      arrival->end <= oldest)
+    g_slice_free (GstCurlHttpSrcArrival, g_queue_pop_head (&s->arrivals));
 
-  switch (s->preferred_http_version) {
-    case GSTCURL_HTTP_VERSION_1_0:
-      GST_DEBUG_OBJECT (s, "Setting version as HTTP/1.0");
-      gst_curl_setopt_int (s, handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_0);
-      break;
-    case GSTCURL_HTTP_VERSION_1_1:
-      GST_DEBUG_OBJECT (s, "Setting version as HTTP/1.1");
-      gst_curl_setopt_int (s, handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
-      break;
-#ifdef CURL_VERSION_HTTP2
-    case GSTCURL_HTTP_VERSION_2_0:
-      GST_DEBUG_OBJECT (s, "Setting version as HTTP/2.0");
-      curl_easy_setopt (handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2_0);
-      break;
-#endif
-    default:
-      GST_WARNING_OBJECT (s,
-          "Supplied a bogus HTTP version, using curl default!");
-  }
+  return arrival ? arrival->time : g_get_monotonic_time ();
+}
 
-  curl_easy_setopt (handle, CURLOPT_HEADERFUNCTION,
-                    gst_curl_http_src_get_header);
-  curl_easy_setopt (handle, CURLOPT_HEADERDATA, s);
-  curl_easy_setopt (handle, CURLOPT_WRITEFUNCTION,
-                    gst_curl_http_src_get_chunks);
-  curl_easy_setopt (handle, CURLOPT_WRITEDATA, s);
-  curl_easy_setopt (handle, CURLOPT_PRIVATE, &s->context);
+/* must be called with the context lock */
+static void
+gst_curl_http_src_arrivals_clear (GstCurlHttpSrc * s)
+{
+  GstCurlHttpSrcArrival *arrival;
 
-  GSTCURL_FUNCTION_EXIT (s);
-  return handle;
+  while ((arrival = g_queue_pop_head (&s->arrivals)))
+    g_slice_free (GstCurlHttpSrcArrival, arrival);
 }
 
-#if 0
 /*
- * Check return codes
+ * The transfer ended before the whole body was received. Keep what it got,
+ * unless it was cancelled.
+ *
+ * must be called with the context lock, once the worker is done
  */
-static GstFlowReturn
-gst_curl_http_src_handle_response (GstCurlHttpSrc * src, GstBuffer ** buf)
+static void
+gst_curl_http_src_whole_flush (GstCurlHttpSrc * s)
 {
-  GstFlowReturn ret = GST_FLOW_OK;
-  glong curl_info_long;
-  gdouble curl_info_dbl;
-  gchar *redirect_url;
-  size_t lena,lenb;
-
-  GSTCURL_FUNCTION_ENTRY (src);
-
+  if (s->whole == NULL)
+    return;
 
-  if (GSTCURL_INFO_RESPONSE (curl_info_long) ||
-      GSTCURL_SUCCESS_RESPONSE (curl_info_long)) {
-    /* Everything should be fine. */
-    GST_INFO_OBJECT (src, "Get for URI %s succeeded, response code %ld",
-        src->uri, curl_info_long);
+  if (s->whole_filled == 0 || s->context.cancel) {
+    g_free (s->whole);
+    s->whole = NULL;
+    return;
   }
-  else if (GSTCURL_REDIRECT_RESPONSE (curl_info_long)) {
-    /* Some redirection response. souphttpsrc reports errors here, so I'm
-     * going to do the same. I should only see these if:
-     *  > Curl has been configured not to follow redirects
-     *  > Curl has been configured to follow redirects up to a given limit and
-     *    that limit has been exceeded. (By default it's unlimited)
-     *
-     * Either way there won't be the response that was requested so signal a
-     * flow error.
-     */
-    GST_WARNING_OBJECT (src, "Get for URI %s received redirection code %ld",
-        src->uri, curl_info_long);
-    /* Curl may have set the requested redirection URI that it was otherwise
-     * barred from following, so set this just in case the sink element wants
-     * to try again itself.
-     */
-    if (curl_easy_getinfo (src->curl_handle, CURLINFO_REDIRECT_URL,
-                           &redirect_url) == CURLE_OK) {
-      if(redirect_url != NULL) {
-        GST_INFO_OBJECT(src, "Got a redirect to %s, setting as redirect URI",
-                        src->redirect_uri);
-        src->redirect_uri = g_strdup(redirect_url);
-      }
-    }
 
-    ret = GST_FLOW_ERROR;
-    /* Redirection limit has been exceeded, don't retry as we will only retry
-     * from original URI.
-     */
-    src->retries_remaining = 0;
-  }
-  else {
+  GST_DEBUG_OBJECT (s, "Short body, %" G_GSIZE_FORMAT " of %" G_GSIZE_FORMAT
+      " bytes", s->whole_filled, s->whole_size);
+  gst_curl_http_src_account (s, s->whole_filled);
+  gst_curl_http_src_arrived (s, s->whole_filled);
+  gst_adapter_push (s->context.adapter, gst_curl_http_src_whole_take (s));
+}
 
-    if (curl_info_dbl > src->timeout_secs) {
-      GST_ERROR_OBJECT (src, "Request for URI %s timed out after %d seconds.",
-                        src->uri, src->timeout_secs);
-    }
+/*
+ * Take the next buffer the worker received, NULL if there is none yet.
+ *
+ * must be called with the context lock, which is released while decoding
+ */
+static GstBuffer *
+gst_curl_http_src_pop (GstCurlHttpSrc * s)
+{
+  GstBuffer *buf;
+  gsize len;
 
-    GST_WARNING_OBJECT (src, "Errno for CONNECT call was %ld (%s)", curl_info_long,
-                        g_strerror((gint) curl_info_long));
+  do {
+    buf = gst_curl_multi_context_source_pop (&s->context, &len);
+    if (buf == NULL)
+      return NULL;
 
-    /* Some of these responses are retry-able, others not. Set the returned
-     * state to ERROR so we crash out instead of fruitlessly attempting.
-     */
-    if (curl_info_long == ECONNREFUSED) {
-	ret = GST_FLOW_ERROR;
-    }
-    else {
-      /* Don't die, but don't continue as if everything's okay either. Let the
-       * retry logic decide next course of action. */
-      ret = GST_FLOW_CUSTOM_SUCCESS;
-      src->end_of_message = FALSE;
-    }
-  }
+    /* The positions are the ones of the encoded body, for the resumes */
+    gst_curl_http_src_account (s, len);
 
-  /*
-   * Check for any redirection that happened. If the result of
-   * CURLINFO_EFFECTIVE_URL is NULL, then the originally supplied URL was used
-   * to retrieve the content. Otherwise, a redirected URL was used, and this
-   * must be reused as part of our base URL from now on.
-   *
-   * TODO: At present, there is no easy way in curl to differentiate a
-   * temporary redirect from a permanent one.
-   */
-  if(curl_easy_getinfo(src->curl_handle, CURLINFO_EFFECTIVE_URL, &redirect_url)
-                       == CURLE_OK) {
-    lena = strlen(src->uri);
-    lenb = strlen(redirect_url);
-    if(g_ascii_strncasecmp(src->uri, redirect_url, (lena>lenb)?lenb:lena) != 0)
-    {
-      GST_INFO_OBJECT(src, "Got a redirect to %s, setting as redirect URI",
-                      redirect_url);
-      src->redirect_uri = g_strdup(redirect_url);
+    if (s->content_encoding != GSTCURL_ENCODING_IDENTITY && s->decode_offload) {
+      GstCurlHttpSrcEncoding encoding = s->content_encoding;
+
+      /* The worker and the other threads need the lock meanwhile */
+      g_mutex_unlock (&s->context.mutex);
+      buf = gst_curl_http_src_decode (s, encoding, buf);
+      g_mutex_lock (&s->context.mutex);
     }
-  }
+  } while (buf == NULL && !s->decode_error);
 
-  GSTCURL_FUNCTION_EXIT (src);
-  return ret;
+  return buf;
 }
-#endif
 
 /*
- * "Negotiate" capabilities between us and the sink.
- * I.e. tell the sink device what data to expect. We can't be told what to send
- * unless we implement "only return to me if this type" property. Potential TODO
+ * Size of the buffers handed out, 0 if any size goes.
  */
-static gboolean
+static gsize
+gst_curl_http_src_output_size (GstCurlHttpSrc * s)
+{
+  if (s->min_output_size < 0)
+    return gst_base_src_get_blocksize (GST_BASE_SRC (s));
+
+  return s->min_output_size;
+}
+
+/*
+ * Move what the worker received so far into the adapter.
+ *
+ * must be called with the context lock
+ */
+static void
+gst_curl_http_src_drain (GstCurlHttpSrc * s)
+{
+  GstBuffer *buf;
+  gsize limit = 0;
+
+  /* Leave the rest where it is, spilled or not */
+  if (s->spill_threshold)
+    limit = MAX (s->spill_threshold, gst_curl_http_src_output_size (s));
+
+  while ((!limit || gst_adapter_available (s->context.adapter) < limit) &&
+      (buf = gst_curl_http_src_pop (s))) {
+    gst_curl_http_src_arrived (s, GSTCURL_BUFFER_SIZE (buf));
+    gst_adapter_push (s->context.adapter, buf);
+  }
+}
+
+/*
+ * Fill the adapter up to a full buffer, or less when the transfer is done or
+ * the oldest byte waited long enough.
+ *
+ * must be called with the context lock
+ */
+static void
+gst_curl_http_src_fill (GstCurlHttpSrc * s)
+{
+  gsize size = gst_curl_http_src_output_size (s);
+  gsize available;
+
+  gst_curl_http_src_drain (s);
+  while (!s->context.done && !s->context.deadline_missed) {
+    available = gst_adapter_available (s->context.adapter);
+    if (available > 0 && available >= size)
+      break;
+
+    if (available == 0 || s->max_output_latency == 0) {
+      gst_curl_multi_context_source_wait (&s->context);
+    } else if (!gst_curl_multi_context_source_wait_until (&s->context,
+            gst_curl_http_src_oldest (s) +
+            s->max_output_latency * G_TIME_SPAN_MILLISECOND)) {
+      GST_LOG_OBJECT (s, "Flushing a partial buffer of %" G_GSIZE_FORMAT
+          " bytes", available);
+      gst_curl_http_src_drain (s);
+      break;
+    }
+    gst_curl_http_src_drain (s);
+  }
+}
+
+/*
+ * Take the next buffer out of the adapter, contiguous and no bigger than the
+ * output size. In direct-push mode it gets the arrival time of its first byte.
+ *
+ * must be called with the context lock
+ */
+static GstBuffer *
+gst_curl_http_src_take (GstCurlHttpSrc * s)
+{
+  gsize available = gst_adapter_available (s->context.adapter);
+  gsize size = gst_curl_http_src_output_size (s);
+  GstClockTime arrival = GST_CLOCK_TIME_NONE;
+  GstBuffer *buf;
+
+  if (size > 0 && available > size)
+    available = size;
+
+  if (s->direct_push)
+#if GST_CHECK_VERSION(1,0,0)
+    arrival = gst_adapter_prev_pts (s->context.adapter, NULL);
+#else
+    arrival = gst_adapter_prev_timestamp (s->context.adapter, NULL);
+#endif
+
+#if GST_CHECK_VERSION(1,2,0)
+  buf = gst_adapter_take_buffer_fast (s->context.adapter, available);
+#else
+  buf = gst_adapter_take_buffer (s->context.adapter, available);
+#endif
+
+  if (buf && GST_CLOCK_TIME_IS_VALID (arrival)) {
+#if GST_CHECK_VERSION(1,0,0)
+    buf = gst_buffer_make_writable (buf);
+#else
+    buf = gst_buffer_make_metadata_writable (buf);
+#endif
+    GST_BUFFER_TIMESTAMP (buf) = arrival;
+  }
+
+  return buf;
+}
+
+/*
+ * In direct-push mode, give the buffer the running time it arrived at.
+ * Called from the worker.
+ */
+static GstBuffer *
+gst_curl_http_src_stamp (GstCurlHttpSrc * s, GstBuffer * buf)
+{
+  GstClock *clock;
+
+  clock = gst_element_get_clock (GST_ELEMENT (s));
+  if (clock == NULL)
+    return buf;
+
+  /* A coalesced buffer is shared with the other elements */
+#if GST_CHECK_VERSION(1,0,0)
+  buf = gst_buffer_make_writable (buf);
+#else
+  buf = gst_buffer_make_metadata_writable (buf);
+#endif
+  GST_BUFFER_TIMESTAMP (buf) = gst_clock_get_time (clock) -
+      gst_element_get_base_time (GST_ELEMENT (s));
+  gst_object_unref (clock);
+
+  return buf;
+}
+
+/*
+ * Location 0 is the URI, the next ones are the mirrors
+ */
+static const gchar *
+gst_curl_http_src_location (GstCurlHttpSrc * s, guint index)
+{
+  return index == 0 ? s->uri : s->mirrors[index - 1];
+}
+
+/*
+ * Fail over to the next location. The validators of one server mean nothing
+ * to another one, so the resume is then only checked on the entity size.
+ */
+static void
+gst_curl_http_src_next_location (GstCurlHttpSrc * s)
+{
+  if (s->n_mirrors == 0)
+    return;
+
+  s->location_index = (s->location_index + 1) % (s->n_mirrors + 1);
+  GST_INFO_OBJECT (s, "Failing over to %s",
+      gst_curl_http_src_location (s, s->location_index));
+
+  g_free (s->headers.etag);
+  s->headers.etag = NULL;
+  g_free (s->headers.last_modified);
+  s->headers.last_modified = NULL;
+}
+
+/*
+ * Report where the data really comes from, after a redirection or when a
+ * mirror is used, so the URI query gives the right base for relative URIs.
+ */
+static void
+gst_curl_http_src_update_redirect (GstCurlHttpSrc * s)
+{
+  char *effective = NULL;
+
+  curl_easy_getinfo (gst_curl_multi_context_source_handle (&s->context),
+      CURLINFO_EFFECTIVE_URL, &effective);
+
+  g_mutex_lock (s->uri_mutex);
+  if (effective == NULL || s->uri == NULL || strcmp (effective, s->uri) == 0) {
+    g_free (s->redirect_uri);
+    s->redirect_uri = NULL;
+  } else if (s->redirect_uri == NULL || strcmp (effective, s->redirect_uri)) {
+    GST_INFO_OBJECT (s, "Got a redirect to %s, setting as redirect URI",
+        effective);
+    g_free (s->redirect_uri);
+    s->redirect_uri = g_strdup (effective);
+  }
+  g_mutex_unlock (s->uri_mutex);
+}
+
+/*
+ * Two requests with the same key get the same response, so they can share a
+ * single transfer. It is made of everything that changes what the server
+ * sends.
+ */
+static gchar *
+gst_curl_http_src_request_key (GstCurlHttpSrc * s, const gchar * location)
+{
+  GString *key;
+  struct curl_slist *header;
+  gint i;
+
+  key = g_string_new (location);
+  g_string_append_printf (key, "\n%s\n%s\n%s\n%d",
+      s->username ? s->username : "", s->password ? s->password : "",
+      s->proxy_uri ? s->proxy_uri : "", s->accept_compressed_encodings);
+  for (i = 0; i < s->number_cookies; i++)
+    g_string_append_printf (key, "\n%s", s->cookies[i]);
+  for (header = s->slist; header; header = header->next)
+    g_string_append_printf (key, "\n%s", header->data);
+
+  return g_string_free (key, FALSE);
+}
+
+/*
+ * Extract the host part of an URL. An IPv6 literal keeps its brackets, as
+ * it is written in the URL.
+ */
+static gchar *
+gst_curl_http_src_url_host (const gchar * url)
+{
+  const gchar *start, *end, *at, *colon, *bracket;
+
+  start = strstr (url, "://");
+  if (start == NULL)
+    return NULL;
+  start += 3;
+  end = start + strcspn (start, "/?#");
+
+  at = g_strrstr_len (start, end - start, "@");
+  if (at != NULL)
+    start = at + 1;
+  if (*start == '[') {
+    bracket = memchr (start, ']', end - start);
+    if (bracket == NULL)
+      return NULL;
+    return g_strndup (start, bracket + 1 - start);
+  }
+
+  colon = memchr (start, ':', end - start);
+  if (colon != NULL)
+    end = colon;
+
+  return g_strndup (start, end - start);
+}
+
+/*
+ * After a stall, look for another address of the same host if it resolves to
+ * more than one, as a CURLOPT_CONNECT_TO entry. The lookup blocks, the lock
+ * is released meanwhile so that the worker and the other threads go on.
+ *
+ * must be called with the context lock
+ */
+static void
+gst_curl_http_src_resolve_alternate (GstCurlHttpSrc * s)
+{
+#if LIBCURL_VERSION_NUM >= 0x073100
+  struct addrinfo hints, *res, *ai;
+  gchar addr[INET6_ADDRSTRLEN];
+  gchar *host, *ip, *entry = NULL;
+  glong port;
+
+  g_free (s->alternate);
+  s->alternate = NULL;
+
+  /* Through a proxy the address of the origin is not ours to choose */
+  if (s->proxy_uri != NULL || s->stalled_url == NULL || s->stalled_ip == NULL)
+    return;
+
+  /* There is no other address to pick for an IPv6 literal */
+  host = gst_curl_http_src_url_host (s->stalled_url);
+  if (host == NULL || *host == '[') {
+    g_free (host);
+    return;
+  }
+  ip = g_strdup (s->stalled_ip);
+  port = s->stalled_port;
+
+  g_mutex_unlock (&s->context.mutex);
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo (host, NULL, &hints, &res) != 0) {
+    GST_DEBUG_OBJECT (s, "Cannot resolve %s for an alternate address", host);
+    res = NULL;
+  }
+
+  for (ai = res; ai != NULL && entry == NULL; ai = ai->ai_next) {
+    gboolean v6 = ai->ai_family == AF_INET6;
+    const void *sin_addr;
+
+    if (v6)
+      sin_addr = &((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr;
+    else if (ai->ai_family == AF_INET)
+      sin_addr = &((struct sockaddr_in *) ai->ai_addr)->sin_addr;
+    else
+      continue;
+
+    if (inet_ntop (ai->ai_family, sin_addr, addr, sizeof (addr)) == NULL ||
+        strcmp (addr, ip) == 0)
+      continue;
+
+    entry = g_strdup_printf ("%s:%ld:%s%s%s:%ld", host, port,
+        v6 ? "[" : "", addr, v6 ? "]" : "", port);
+  }
+  if (res != NULL)
+    freeaddrinfo (res);
+
+  if (entry == NULL)
+    GST_DEBUG_OBJECT (s, "No alternate address for %s", host);
+  g_free (host);
+  g_free (ip);
+
+  g_mutex_lock (&s->context.mutex);
+  s->alternate = entry;
+#endif
+}
+
+/*
+ * Connect to the alternate address found after a stall. The Host header and
+ * TLS SNI are kept as curl only changes where the connection goes.
+ */
+static void
+gst_curl_http_src_connect_to_alternate (GstCurlHttpSrc * s, CURL * handle)
+{
+#if LIBCURL_VERSION_NUM >= 0x073100
+  if (s->alternate == NULL)
+    return;
+
+  GST_INFO_OBJECT (s, "Failing over from %s to %s", s->stalled_ip,
+      s->alternate);
+  s->connect_to = curl_slist_append (s->connect_to, s->alternate);
+  curl_easy_setopt (handle, CURLOPT_CONNECT_TO, s->connect_to);
+  g_free (s->alternate);
+  s->alternate = NULL;
+#endif
+}
+
+static void
+gst_curl_http_src_share_lock (CURL * handle, curl_lock_data data,
+    curl_lock_access access, void *userptr)
+{
+  g_mutex_lock (&gst_curl_http_src_share_locks[data]);
+}
+
+static void
+gst_curl_http_src_share_unlock (CURL * handle, curl_lock_data data,
+    void *userptr)
+{
+  g_mutex_unlock (&gst_curl_http_src_share_locks[data]);
+}
+
+/*
+ * The share of the TLS sessions, created on first use and kept for the life
+ * of the process. NULL if curl could not make one, the handles then keep
+ * their sessions to themselves.
+ */
+static CURLSH *
+gst_curl_http_src_share_get (void)
+{
+  g_mutex_lock (&gst_curl_http_src_share_mutex);
+  if (gst_curl_http_src_share == NULL) {
+    gst_curl_http_src_share = curl_share_init ();
+    if (gst_curl_http_src_share != NULL) {
+      curl_share_setopt (gst_curl_http_src_share, CURLSHOPT_LOCKFUNC,
+          gst_curl_http_src_share_lock);
+      curl_share_setopt (gst_curl_http_src_share, CURLSHOPT_UNLOCKFUNC,
+          gst_curl_http_src_share_unlock);
+      curl_share_setopt (gst_curl_http_src_share, CURLSHOPT_SHARE,
+          CURL_LOCK_DATA_SSL_SESSION);
+    }
+  }
+  g_mutex_unlock (&gst_curl_http_src_share_mutex);
+
+  return gst_curl_http_src_share;
+}
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+/*
+ * The session file has a line per TLS session: when it expires, in seconds
+ * since the epoch, then the salted hash curl keys it by, of the host, port
+ * and TLS settings, and the session itself, both in base64. The host names
+ * never reach the disk.
+ */
+static CURLcode
+gst_curl_http_src_sessions_export (CURL * handle, void *userptr,
+    const char *session_key, const unsigned char *shmac, size_t shmac_len,
+    const unsigned char *sdata, size_t sdata_len, curl_off_t valid_until,
+    int ietf_tls_id, const char *alpn, size_t earlydata_max)
+{
+  GString *out = userptr;
+  gchar *hash, *data;
+
+  if (shmac == NULL || valid_until <= g_get_real_time () / G_USEC_PER_SEC)
+    return CURLE_OK;
+
+  hash = g_base64_encode (shmac, shmac_len);
+  data = g_base64_encode (sdata, sdata_len);
+  g_string_append_printf (out, "%" G_GINT64_FORMAT " %s %s\n",
+      (gint64) valid_until, hash, data);
+  g_free (hash);
+  g_free (data);
+
+  return CURLE_OK;
+}
+
+/*
+ * Read the session file, only if it belongs to the user and nobody else can
+ * read or change it: the sessions in it resume connections as this user.
+ */
+static gchar *
+gst_curl_http_src_sessions_read (GstCurlHttpSrc * s)
+{
+  GString *contents;
+  struct stat st;
+  gchar chunk[4096];
+  gssize len;
+  int fd;
+
+  fd = open (s->tls_session_file, O_RDONLY | O_NOFOLLOW);
+  if (fd < 0) {
+    GST_DEBUG_OBJECT (s, "No TLS sessions to load from %s",
+        s->tls_session_file);
+    return NULL;
+  }
+  if (fstat (fd, &st) != 0 || !S_ISREG (st.st_mode) ||
+      st.st_uid != getuid () || (st.st_mode & (S_IRWXG | S_IRWXO)) != 0) {
+    GST_WARNING_OBJECT (s, "Not loading the TLS sessions of %s, it is not a "
+        "file only this user can access", s->tls_session_file);
+    close (fd);
+    return NULL;
+  }
+
+  contents = g_string_new (NULL);
+  while ((len = read (fd, chunk, sizeof (chunk))) != 0) {
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len < 0) {
+      GST_WARNING_OBJECT (s, "Cannot read %s: %s", s->tls_session_file,
+          g_strerror (errno));
+      g_string_free (contents, TRUE);
+      close (fd);
+      return NULL;
+    }
+    g_string_append_len (contents, chunk, len);
+  }
+  close (fd);
+
+  return g_string_free (contents, FALSE);
+}
+
+/*
+ * Replace the session file with a new one only the user can access. It is
+ * written next to it and renamed over, so that the file is never readable by
+ * others nor left half written.
+ */
+static gboolean
+gst_curl_http_src_sessions_write (GstCurlHttpSrc * s, const GString * out)
+{
+  gchar *tmp;
+  gsize done = 0;
+  gssize len;
+  gboolean ok;
+  int fd;
+
+  tmp = g_strdup_printf ("%s.XXXXXX", s->tls_session_file);
+  fd = g_mkstemp_full (tmp, O_WRONLY, 0600);
+  if (fd < 0) {
+    GST_WARNING_OBJECT (s, "Cannot save the TLS sessions: %s",
+        g_strerror (errno));
+    g_free (tmp);
+    return FALSE;
+  }
+
+  while (done < out->len) {
+    len = write (fd, out->str + done, out->len - done);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len < 0)
+      break;
+    done += len;
+  }
+
+  ok = done == out->len && fsync (fd) == 0;
+  ok = close (fd) == 0 && ok;
+  ok = ok && rename (tmp, s->tls_session_file) == 0;
+  if (!ok) {
+    GST_WARNING_OBJECT (s, "Cannot save the TLS sessions: %s",
+        g_strerror (errno));
+    unlink (tmp);
+  }
+  g_free (tmp);
+
+  return ok;
+}
+#endif
+
+/*
+ * Load the sessions of the session file into the share, once per file for
+ * the process. The expired ones are left out.
+ */
+static void
+gst_curl_http_src_sessions_load (GstCurlHttpSrc * s)
+{
+#if LIBCURL_VERSION_NUM >= 0x080c00
+  CURLSH *share;
+  CURL *handle;
+  gchar *contents;
+  gchar **lines, **fields;
+  guchar *hash, *data;
+  gsize hash_len, data_len;
+  gint64 now;
+  guint i, loaded = 0;
+
+  if (s->tls_session_file == NULL)
+    return;
+
+  share = gst_curl_http_src_share_get ();
+  if (share == NULL)
+    return;
+
+  g_mutex_lock (&gst_curl_http_src_share_mutex);
+  if (gst_curl_http_src_session_files == NULL)
+    gst_curl_http_src_session_files = g_hash_table_new_full (g_str_hash,
+        g_str_equal, g_free, NULL);
+  if (g_hash_table_lookup (gst_curl_http_src_session_files,
+          s->tls_session_file) != NULL) {
+    g_mutex_unlock (&gst_curl_http_src_share_mutex);
+    return;
+  }
+  g_hash_table_replace (gst_curl_http_src_session_files,
+      g_strdup (s->tls_session_file), GINT_TO_POINTER (1));
+
+  contents = gst_curl_http_src_sessions_read (s);
+  if (contents == NULL) {
+    g_mutex_unlock (&gst_curl_http_src_share_mutex);
+    return;
+  }
+
+  handle = curl_easy_init ();
+  curl_easy_setopt (handle, CURLOPT_SHARE, share);
+  now = g_get_real_time () / G_USEC_PER_SEC;
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++) {
+    fields = g_strsplit (lines[i], " ", 3);
+    if (g_strv_length (fields) == 3 &&
+        g_ascii_strtoll (fields[0], NULL, 10) > now) {
+      hash = g_base64_decode (fields[1], &hash_len);
+      data = g_base64_decode (fields[2], &data_len);
+      if (hash_len > 0 && data_len > 0 &&
+          curl_easy_ssls_import (handle, NULL, hash, hash_len, data,
+              data_len) == CURLE_OK)
+        loaded++;
+      g_free (hash);
+      g_free (data);
+    }
+    g_strfreev (fields);
+  }
+  g_strfreev (lines);
+  curl_easy_cleanup (handle);
+  g_mutex_unlock (&gst_curl_http_src_share_mutex);
+  g_free (contents);
+
+  GST_INFO_OBJECT (s, "Loaded %u TLS sessions from %s", loaded,
+      s->tls_session_file);
+#else
+  if (s->tls_session_file != NULL)
+    GST_WARNING_OBJECT (s, "This libcurl cannot export its TLS sessions, "
+        "%s is not used", s->tls_session_file);
+#endif
+}
+
+/*
+ * Write the sessions of the share to the session file, replacing it. They are
+ * the ones of every element, of any earlier run still valid too.
+ */
+static void
+gst_curl_http_src_sessions_save (GstCurlHttpSrc * s)
+{
+#if LIBCURL_VERSION_NUM >= 0x080c00
+  CURLSH *share;
+  CURL *handle;
+  GString *out;
+
+  if (s->tls_session_file == NULL)
+    return;
+
+  share = gst_curl_http_src_share_get ();
+  if (share == NULL)
+    return;
+
+  out = g_string_new (NULL);
+  g_mutex_lock (&gst_curl_http_src_share_mutex);
+  handle = curl_easy_init ();
+  curl_easy_setopt (handle, CURLOPT_SHARE, share);
+  if (curl_easy_ssls_export (handle, gst_curl_http_src_sessions_export,
+          out) == CURLE_OK)
+    gst_curl_http_src_sessions_write (s, out);
+  curl_easy_cleanup (handle);
+  g_mutex_unlock (&gst_curl_http_src_share_mutex);
+  g_string_free (out, TRUE);
+#endif
+}
+
+/*
+ * Size the receive buffer of a new socket. Fixing it turns off the tuning of
+ * the kernel, which may then not grow the window to the bandwidth-delay
+ * product, hence only when asked for.
+ *
+ * Called from the worker.
+ */
+static int
+gst_curl_http_src_sockopt (void *clientp, curl_socket_t curlfd,
+    curlsocktype purpose)
+{
+  GstCurlHttpSrc *s = clientp;
+  int size = s->socket_rcvbuf;
+
+  if (purpose == CURLSOCKTYPE_IPCXN && size > 0 &&
+      setsockopt (curlfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size)) < 0)
+    GST_WARNING_OBJECT (s, "Cannot set a receive buffer of %d bytes: %s",
+        size, g_strerror (errno));
+
+  return CURL_SOCKOPT_OK;
+}
+
+/*
+ * The Unix socket to reach the host of a location through, from the map or
+ * else the one of all the hosts. NULL to connect over the network, which an
+ * empty path in the map asks for.
+ */
+static const gchar *
+gst_curl_http_src_unix_socket (GstCurlHttpSrc * s, const gchar * location)
+{
+  const gchar *path = s->unix_socket_path;
+  gchar *host;
+  gsize len;
+  guint i;
+
+  if (s->unix_socket_map != NULL &&
+      (host = gst_curl_http_src_url_host (location)) != NULL) {
+    len = strlen (host);
+    for (i = 0; s->unix_socket_map[i] != NULL; i++) {
+      if (g_ascii_strncasecmp (s->unix_socket_map[i], host, len) == 0 &&
+          s->unix_socket_map[i][len] == '=') {
+        path = s->unix_socket_map[i] + len + 1;
+        break;
+      }
+    }
+    g_free (host);
+  }
+
+  return path != NULL && *path != '\0' ? path : NULL;
+}
+
+/*
+ * The options of every request for the resource: location, credentials,
+ * proxy, cookies and connection behaviour.
+ */
+static void
+gst_curl_http_src_setup_handle (GstCurlHttpSrc * s, CURL * handle,
+    const gchar * location)
+{
+  gint i;
+
+  /* This is mandatory and yet not default option, so if this is NULL
+   * then something very bad is going on. */
+  curl_easy_setopt (handle, CURLOPT_URL, location);
+
+  gst_curl_setopt_str (s, handle, CURLOPT_USERNAME, s->username);
+  gst_curl_setopt_str (s, handle, CURLOPT_PASSWORD, s->password);
+  gst_curl_setopt_str (s, handle, CURLOPT_PROXY, s->proxy_uri);
+  gst_curl_setopt_str (s, handle, CURLOPT_NOPROXY, s->no_proxy_list);
+  gst_curl_setopt_str (s, handle, CURLOPT_PROXYUSERNAME, s->proxy_user);
+  gst_curl_setopt_str (s, handle, CURLOPT_PROXYPASSWORD, s->proxy_pass);
+#if LIBCURL_VERSION_NUM >= 0x072800
+  /* The URL and the Host header stay the ones of the location */
+  gst_curl_setopt_str (s, handle, CURLOPT_UNIX_SOCKET_PATH,
+      gst_curl_http_src_unix_socket (s, location));
+#endif
+
+  for (i = 0; i < s->number_cookies; i++) {
+    gst_curl_setopt_str (s, handle, CURLOPT_COOKIELIST, s->cookies[i]);
+  }
+
+  gst_curl_setopt_str_default (s, handle, CURLOPT_USERAGENT, s->user_agent);
+
+  gst_curl_setopt_int (s, handle, CURLOPT_FOLLOWLOCATION,
+                       s->allow_3xx_redirect);
+  gst_curl_setopt_int_default (s, handle, CURLOPT_MAXREDIRS,
+                       s->max_3xx_redirects);
+  gst_curl_setopt_int (s, handle, CURLOPT_TCP_KEEPALIVE,
+                       GSTCURL_BINARYBOOL (s->keep_alive));
+  gst_curl_setopt_int (s, handle, CURLOPT_TIMEOUT, s->timeout_secs);
+  /* Larger callbacks, fewer of them, for the high rates */
+  gst_curl_setopt_int (s, handle, CURLOPT_BUFFERSIZE, s->curl_buffer_size);
+  gst_curl_setopt_int (s, handle, CURLOPT_TCP_NODELAY,
+                       (glong) GSTCURL_BINARYBOOL (s->tcp_nodelay));
+#if LIBCURL_VERSION_NUM >= 0x073100
+  gst_curl_setopt_int (s, handle, CURLOPT_TCP_FASTOPEN,
+                       (glong) GSTCURL_BINARYBOOL (s->tcp_fastopen));
+#endif
+  if (s->socket_rcvbuf > 0) {
+    curl_easy_setopt (handle, CURLOPT_SOCKOPTFUNCTION,
+        gst_curl_http_src_sockopt);
+    curl_easy_setopt (handle, CURLOPT_SOCKOPTDATA, s);
+  }
+  gst_curl_setopt_int (s, handle, CURLOPT_SSL_VERIFYPEER,
+                       GSTCURL_BINARYBOOL (s->strict_ssl));
+  gst_curl_setopt_str (s, handle, CURLOPT_CAINFO, s->custom_ca_file);
+#if LIBCURL_VERSION_NUM >= 0x074d00
+  if (s->custom_ca_data != NULL) {
+    struct curl_blob blob;
+
+    blob.data = s->custom_ca_data;
+    blob.len = strlen (s->custom_ca_data);
+    blob.flags = CURL_BLOB_COPY;
+    curl_easy_setopt (handle, CURLOPT_CAINFO_BLOB, &blob);
+  }
+#endif
+#if LIBCURL_VERSION_NUM >= 0x075700
+  /* Kept parsed by the multi handle, which all the transfers go through */
+  curl_easy_setopt (handle, CURLOPT_CA_CACHE_TIMEOUT,
+      (long) s->ca_cache_timeout);
+#endif
+  curl_easy_setopt (handle, CURLOPT_SHARE, gst_curl_http_src_share_get ());
+
+  switch (s->preferred_http_version) {
+    case GSTCURL_HTTP_VERSION_1_0:
+      GST_DEBUG_OBJECT (s, "Setting version as HTTP/1.0");
+      gst_curl_setopt_int (s, handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_0);
+      break;
+    case GSTCURL_HTTP_VERSION_1_1:
+      GST_DEBUG_OBJECT (s, "Setting version as HTTP/1.1");
+      gst_curl_setopt_int (s, handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+      break;
+#ifdef CURL_VERSION_HTTP2
+    case GSTCURL_HTTP_VERSION_2_0:
+      GST_DEBUG_OBJECT (s, "Setting version as HTTP/2.0");
+      curl_easy_setopt (handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2_0);
+      break;
+#endif
+    default:
+      GST_WARNING_OBJECT (s,
+          "Supplied a bogus HTTP version, using curl default!");
+  }
+}
+
+/*
+ * From the data in the queue element s, create a CURL easy handle and populate
+ * options with the URL, proxy data, login options, cookies,
+ */
+static CURL *
+gst_curl_http_src_create_easy_handle (GstCurlHttpSrc * s)
+{
+  CURL *handle;
+  const gchar *location;
+  guint n;
+  gint i;
+  GSTCURL_FUNCTION_ENTRY (s);
+
+  handle = curl_easy_init ();
+  if (handle == NULL) {
+    GST_ERROR_OBJECT (s, "Couldn't init a curl easy handle!");
+    return NULL;
+  }
+  location = gst_curl_http_src_location (s, s->location_index);
+  GST_INFO_OBJECT (s, "Creating a new handle for URI %s", location);
+
+  gst_curl_http_src_setup_handle (s, handle, location);
+
+  if (s->slist) {
+    curl_slist_free_all (s->slist);
+    s->slist = NULL;
+  }
+
+  /* curl_slist_append dynamically allocates memory, but I need to free it */
+  for (i = 0; i < s->number_headers; i++) {
+    s->slist = curl_slist_append(s->slist, s->extra_headers[i]);
+  }
+
+  if (s->start_position != 0 || s->stop_position != -1) {
+    gchar *range;
+
+    /* TODO remove old Range header  */
+    if (s->stop_position != -1) {
+      /* The end of a byte range is inclusive */
+      range = g_strdup_printf ("Range: bytes=%" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT,
+          s->start_position, s->stop_position - 1);
+    } else {
+      range = g_strdup_printf ("Range: bytes=%" G_GUINT64_FORMAT "-",
+          s->start_position);
+    }
+
+    GST_DEBUG_OBJECT (s, "Adding header: '%s'", range);
+
+    s->slist = curl_slist_append (s->slist, range);
+    g_free (range);
+
+    /* When resuming an interrupted transfer only accept the rest of the same
+     * entity. Weak ETags are not allowed on If-Range. */
+    if (s->resuming) {
+      gchar *if_range = NULL;
+
+      if (s->headers.etag && !g_str_has_prefix (s->headers.etag, "W/")) {
+        if_range = g_strdup_printf ("If-Range: %s", s->headers.etag);
+      } else if (s->headers.last_modified) {
+        if_range = g_strdup_printf ("If-Range: %s", s->headers.last_modified);
+      }
+
+      if (if_range) {
+        GST_DEBUG_OBJECT (s, "Adding header: '%s'", if_range);
+        s->slist = curl_slist_append (s->slist, if_range);
+        g_free (if_range);
+      }
+    }
+  }
+
+  /* The element decodes what it announces, curl passes it as received */
+  if (s->accept_compressed_encodings == TRUE && s->decode_offload) {
+    s->slist = curl_slist_append (s->slist, GSTCURL_ACCEPT_ENCODING);
+  }
+
+  if (s->slist != NULL) {
+      curl_easy_setopt(handle, CURLOPT_HTTPHEADER, s->slist);
+  }
+
+  /*
+   * Unlike soup, this isn't a binary op, curl wants a string here. So if it's
+   * TRUE, simply set the value as an empty string as this allows both gzip and
+   * zlib compression methods.
+   */
+  if (s->accept_compressed_encodings == TRUE && s->decode_offload) {
+      curl_easy_setopt(handle, CURLOPT_HTTP_CONTENT_DECODING, 0L);
+  }
+  else if(s->accept_compressed_encodings == TRUE) {
+      curl_easy_setopt(handle, CURLOPT_ACCEPT_ENCODING, "");
+  }
+  else {
+      curl_easy_setopt(handle, CURLOPT_ACCEPT_ENCODING, "identity");
+  }
+
+  curl_easy_setopt (handle, CURLOPT_HEADERFUNCTION,
+                    gst_curl_http_src_get_header);
+  curl_easy_setopt (handle, CURLOPT_HEADERDATA, s);
+  curl_easy_setopt (handle, CURLOPT_WRITEFUNCTION,
+                    gst_curl_http_src_get_chunks);
+  curl_easy_setopt (handle, CURLOPT_WRITEDATA, s);
+  curl_easy_setopt (handle, CURLOPT_PRIVATE, &s->context);
+
+  /* The multi context reroutes the callbacks when hedging */
+  s->request_start = s->start_position;
+  s->request_stop = s->stop_position;
+  s->body_skip = 0;
+  s->body_left = G_MAXUINT64;
+  s->range_complete = FALSE;
+
+  s->context.header_func = (curl_write_callback) gst_curl_http_src_get_header;
+  s->context.write_func = (curl_write_callback) gst_curl_http_src_get_chunks;
+  s->context.func_data = s;
+  s->context.hedge_percentile = s->hedge_percentile;
+  s->context.hedge_max_rate = s->hedge_max_rate;
+  s->context.spill_threshold = s->spill_threshold;
+  s->context.spill_max = s->spill_max_size;
+  s->context.weight = s->bandwidth_weight;
+
+  /* A retry is still bound by the deadline of the original request */
+  if (s->retry_attempt == 0) {
+    if (s->pending_deadline) {
+      s->context.deadline = s->pending_deadline;
+    } else if (s->deadline) {
+      s->context.deadline = g_get_monotonic_time () +
+          s->deadline * G_TIME_SPAN_MILLISECOND;
+    } else {
+      s->context.deadline = 0;
+    }
+    s->pending_deadline = 0;
+  }
+  s->context.deadline_missed = FALSE;
+
+  /* Share the transfer of an identical request already in flight. A resume
+   * checks the validators of this element, it cannot be shared. */
+  s->context.buffer_func = gst_curl_http_src_take_buffer;
+  g_free (s->context.key);
+  s->context.key = NULL;
+  if (s->coalesce && !s->resuming)
+    s->context.key = gst_curl_http_src_request_key (s, location);
+
+  if (s->max_bitrate > 0)
+    curl_easy_setopt (handle, CURLOPT_MAX_RECV_SPEED_LARGE,
+                      (curl_off_t) (s->max_bitrate / 8));
+
+  /* Race the first request across all the locations, the fastest is kept */
+  g_strfreev (s->context.race_urls);
+  s->context.race_urls = NULL;
+  g_strfreev (s->context.race_unix_sockets);
+  s->context.race_unix_sockets = NULL;
+  if (s->n_mirrors > 0 && !s->raced) {
+    const gchar *mirror, *path;
+
+    s->context.race_urls = g_new0 (gchar *, s->n_mirrors + 1);
+    s->context.race_unix_sockets = g_new0 (gchar *, s->n_mirrors + 1);
+    for (i = 0, n = 0; i <= s->n_mirrors; i++) {
+      if (i == s->location_index)
+        continue;
+      mirror = gst_curl_http_src_location (s, i);
+      path = gst_curl_http_src_unix_socket (s, mirror);
+      s->context.race_urls[n] = g_strdup (mirror);
+      s->context.race_unix_sockets[n++] = g_strdup (path ? path : "");
+    }
+    s->raced = TRUE;
+  }
+
+  /*
+   * Stall detection. CURLOPT_LOW_SPEED_TIME only has a granularity of seconds,
+   * so the throughput is checked on the progress callback instead.
+   */
+  s->stall_window_start = 0;
+#if LIBCURL_VERSION_NUM >= 0x072000
+  s->context.progress_func = NULL;
+#endif
+  if (s->low_speed_limit > 0) {
+    curl_easy_setopt (handle, CURLOPT_NOPROGRESS, 0L);
+#if LIBCURL_VERSION_NUM >= 0x072000
+    curl_easy_setopt (handle, CURLOPT_XFERINFOFUNCTION,
+                      gst_curl_http_src_xferinfo);
+    curl_easy_setopt (handle, CURLOPT_XFERINFODATA, s);
+    /* Followed on whichever request of a race wins */
+    s->context.progress_func = gst_curl_http_src_xferinfo;
+#else
+    curl_easy_setopt (handle, CURLOPT_PROGRESSFUNCTION,
+                      gst_curl_http_src_progress);
+    curl_easy_setopt (handle, CURLOPT_PROGRESSDATA, s);
+#endif
+  }
+
+  if (s->connect_to) {
+    curl_slist_free_all (s->connect_to);
+    s->connect_to = NULL;
+  }
+
+  /* Do not reuse the connection that stalled, and try another server */
+  if (s->stalled) {
+    curl_easy_setopt (handle, CURLOPT_FRESH_CONNECT, 1L);
+    gst_curl_http_src_connect_to_alternate (s, handle);
+    s->stalled = FALSE;
+  }
+
+  GSTCURL_FUNCTION_EXIT (s);
+  return handle;
+}
+
+#if 0
+/*
+ * Check return codes
+ */
+static GstFlowReturn
+gst_curl_http_src_handle_response (GstCurlHttpSrc * src, GstBuffer ** buf)
+{
+  GstFlowReturn ret = GST_FLOW_OK;
+  glong curl_info_long;
+  gdouble curl_info_dbl;
+  gchar *redirect_url;
+  size_t lena,lenb;
+
+  GSTCURL_FUNCTION_ENTRY (src);
+
+
+  if (GSTCURL_INFO_RESPONSE (curl_info_long) ||
+      GSTCURL_SUCCESS_RESPONSE (curl_info_long)) {
+    /* Everything should be fine. */
+    GST_INFO_OBJECT (src, "Get for URI %s succeeded, response code %ld",
+        src->uri, curl_info_long);
+  }
+  else if (GSTCURL_REDIRECT_RESPONSE (curl_info_long)) {
+    /* Some redirection response. souphttpsrc reports errors here, so I'm
+     * going to do the same. I should only see these if:
+     *  > Curl has been configured not to follow redirects
+     *  > Curl has been configured to follow redirects up to a given limit and
+     *    that limit has been exceeded. (By default it's unlimited)
+     *
+     * Either way there won't be the response that was requested so signal a
+     * flow error.
+     */
+    GST_WARNING_OBJECT (src, "Get for URI %s received redirection code %ld",
+        src->uri, curl_info_long);
+    /* Curl may have set the requested redirection URI that it was otherwise
+     * barred from following, so set this just in case the sink element wants
+     * to try again itself.
+     */
+    if (curl_easy_getinfo (src->curl_handle, CURLINFO_REDIRECT_URL,
+                           &redirect_url) == CURLE_OK) {
+      if(redirect_url != NULL) {
+        GST_INFO_OBJECT(src, "Got a redirect to %s, setting as redirect URI",
+                        src->redirect_uri);
+        src->redirect_uri = g_strdup(redirect_url);
+      }
+    }
+
+    ret = GST_FLOW_ERROR;
+    /* Redirection limit has been exceeded, don't retry as we will only retry
+     * from original URI.
+     */
+    src->retries_remaining = 0;
+  }
+  else {
+
+    if (curl_info_dbl > src->timeout_secs) {
+      GST_ERROR_OBJECT (src, "Request for URI %s timed out after %d seconds.",
+                        src->uri, src->timeout_secs);
+    }
+
+    GST_WARNING_OBJECT (src, "Errno for CONNECT call was %ld (%s)", curl_info_long,
+                        g_strerror((gint) curl_info_long));
+
+    /* Some of these responses are retry-able, others not. Set the returned
+     * state to ERROR so we crash out instead of fruitlessly attempting.
+     */
+    if (curl_info_long == ECONNREFUSED) {
+	ret = GST_FLOW_ERROR;
+    }
+    else {
+      /* Don't die, but don't continue as if everything's okay either. Let the
+       * retry logic decide next course of action. */
+      ret = GST_FLOW_CUSTOM_SUCCESS;
+      src->end_of_message = FALSE;
+    }
+  }
+
+  /*
+   * Check for any redirection that happened. If the result of
+   * CURLINFO_EFFECTIVE_URL is NULL, then the originally supplied URL was used
+   * to retrieve the content. Otherwise, a redirected URL was used, and this
+   * must be reused as part of our base URL from now on.
+   *
+   * TODO: At present, there is no easy way in curl to differentiate a
+   * temporary redirect from a permanent one.
+   */
+  if(curl_easy_getinfo(src->curl_handle, CURLINFO_EFFECTIVE_URL, &redirect_url)
+                       == CURLE_OK) {
+    lena = strlen(src->uri);
+    lenb = strlen(redirect_url);
+    if(g_ascii_strncasecmp(src->uri, redirect_url, (lena>lenb)?lenb:lena) != 0)
+    {
+      GST_INFO_OBJECT(src, "Got a redirect to %s, setting as redirect URI",
+                      redirect_url);
+      src->redirect_uri = g_strdup(redirect_url);
+    }
+  }
+
+  GSTCURL_FUNCTION_EXIT (src);
+  return ret;
+}
+#endif
+
+/*
+ * "Negotiate" capabilities between us and the sink.
+ * I.e. tell the sink device what data to expect, from the Content-Type when it
+ * maps to known caps, so typefinding is skipped. Called from the streaming
+ * thread before the first buffer of a response, without the context lock.
+ */
+static gboolean
 gst_curl_http_src_negotiate_caps (GstCurlHttpSrc * src)
 {
-#if 0
-  if (src->headers.content_type != NULL) {
-    if (src->caps) {
-      GST_INFO_OBJECT (src, "Setting cap on Content-Type of %s",
-                       src->headers.content_type);
-      src->caps = gst_caps_make_writable (src->caps);
-      gst_caps_set_simple (src->caps, "content-type", G_TYPE_STRING,
-                           src->headers.content_type, NULL);
-      if (gst_base_src_set_caps(GST_BASE_SRC (src), src->caps) != TRUE) {
-        GST_ERROR_OBJECT (src, "Setting caps failed!");
-        return FALSE;
-      }
-    }
+  GstCaps *caps;
+  gchar *mime = NULL;
+  gboolean ret = TRUE;
+  guint i;
+
+  g_mutex_lock (&src->context.mutex);
+  if (src->headers.content_type != NULL)
+    mime = g_strstrip (g_strndup (src->headers.content_type,
+            strcspn (src->headers.content_type, ";")));
+  g_mutex_unlock (&src->context.mutex);
+
+  if (mime == NULL) {
+    GST_INFO_OBJECT (src, "No caps have been set, continue.");
+    return TRUE;
+  }
+
+  for (i = 0; gst_curl_http_src_mime_caps[i].mime; i++) {
+    if (g_ascii_strcasecmp (mime, gst_curl_http_src_mime_caps[i].mime) == 0)
+      break;
+  }
+  if (gst_curl_http_src_mime_caps[i].mime == NULL) {
+    GST_DEBUG_OBJECT (src, "No caps known for Content-Type %s", mime);
+    g_free (mime);
+    return TRUE;
+  }
+
+  caps = gst_caps_from_string (gst_curl_http_src_mime_caps[i].caps);
+  if (src->caps == NULL || !gst_caps_is_equal (src->caps, caps)) {
+    GST_INFO_OBJECT (src, "Setting caps %" GST_PTR_FORMAT
+        " from Content-Type %s", caps, mime);
+    gst_caps_replace (&src->caps, caps);
+#if GST_CHECK_VERSION(1,0,0)
+    ret = gst_base_src_set_caps (GST_BASE_SRC (src), caps);
+#else
+    ret = gst_pad_set_caps (GST_BASE_SRC_PAD (src), caps);
+#endif
+    if (!ret)
+      GST_ERROR_OBJECT (src, "Setting caps failed!");
+  }
+  gst_caps_unref (caps);
+  g_free (mime);
+
+  return ret;
+}
+
+/*
+ * Take care of any memory that may be left over from the instance that's now
+ * closing before we leak it.
+ */
+static void
+gst_curl_http_src_cleanup_instance(GstCurlHttpSrc *src)
+{
+  gint i;
+  g_mutex_lock(src->uri_mutex);
+  g_free(src->uri);
+  src->uri = NULL;
+  g_free(src->redirect_uri);
+  src->redirect_uri = NULL;
+  g_strfreev(src->mirrors);
+  src->mirrors = NULL;
+  src->n_mirrors = 0;
+  g_mutex_unlock(src->uri_mutex);
+  g_mutex_clear(src->uri_mutex);
+  g_free(src->uri_mutex);
+  src->uri_mutex = NULL;
+
+  g_free(src->proxy_uri);
+  src->proxy_uri = NULL;
+  g_free(src->no_proxy_list);
+  src->no_proxy_list = NULL;
+  g_free(src->proxy_user);
+  src->proxy_user = NULL;
+  g_free(src->proxy_pass);
+  src->proxy_pass = NULL;
+  g_free(src->custom_ca_data);
+  src->custom_ca_data = NULL;
+  g_free(src->tls_session_file);
+  src->tls_session_file = NULL;
+  g_free(src->unix_socket_path);
+  src->unix_socket_path = NULL;
+  g_strfreev(src->unix_socket_map);
+  src->unix_socket_map = NULL;
+  g_free(src->prefetch_ranges);
+  src->prefetch_ranges = NULL;
+
+  for(i = 0; i < src->number_cookies; i++)
+  {
+    g_free(src->cookies[i]);
+    src->cookies[i] = NULL;
+  }
+  g_free(src->cookies);
+  src->cookies = NULL;
+
+  g_cond_clear(src->finished);
+  g_free(src->finished);
+  src->finished = NULL;
+
+  g_free(src->headers.content_type);
+  src->headers.content_type = NULL;
+  g_free(src->headers.etag);
+  src->headers.etag = NULL;
+  g_free(src->headers.last_modified);
+  src->headers.last_modified = NULL;
+
+  g_strfreev(src->context.race_urls);
+  src->context.race_urls = NULL;
+  g_strfreev(src->context.race_unix_sockets);
+  src->context.race_unix_sockets = NULL;
+  g_free(src->context.key);
+  src->context.key = NULL;
+
+  g_free(src->stalled_url);
+  src->stalled_url = NULL;
+  g_free(src->stalled_ip);
+  src->stalled_ip = NULL;
+  g_free(src->alternate);
+  src->alternate = NULL;
+  if (src->connect_to) {
+    curl_slist_free_all (src->connect_to);
+    src->connect_to = NULL;
+  }
+  g_free(src->whole);
+  src->whole = NULL;
+#if GST_CHECK_VERSION(1,0,0)
+  GST_OBJECT_LOCK (src);
+  if (src->pool) {
+    gst_object_unref (src->pool);
+    src->pool = NULL;
+  }
+  if (src->allocator) {
+    gst_object_unref (src->allocator);
+    src->allocator = NULL;
+  }
+  GST_OBJECT_UNLOCK (src);
+#endif
+
+  gst_curl_http_src_decoder_clear (src);
+
+  /* destroy the context */
+  gst_curl_http_src_fetch_cancel (src);
+  gst_curl_http_src_cache_clear (src);
+  gst_curl_multi_context_source_flush (&src->context);
+  if (src->context.adapter) {
+    g_object_unref (src->context.adapter);
+    src->context.adapter = NULL;
+  }
+  gst_curl_http_src_arrivals_clear (src);
+
+  /* Thank you Handles, and well done. Well done, mate. */
+  if (src->context.easy_handle != NULL) {
+    curl_easy_cleanup (src->context.easy_handle);
+    src->context.easy_handle = NULL;
+  }
+}
+
+/*
+ * Size of the whole entity, as the duration in bytes.
+ */
+static void
+gst_curl_http_src_set_length (GstCurlHttpSrc * s, guint64 length)
+{
+  GST_BASE_SRC_CAST (s)->segment.duration = length;
+  s->content_length = length;
+#if GST_CHECK_VERSION(1,0,0)
+  gst_element_post_message (GST_ELEMENT (s),
+      gst_message_new_duration_changed (GST_OBJECT (s)));
+#else
+  gst_element_post_message (GST_ELEMENT (s),
+      gst_message_new_duration (GST_OBJECT (s),
+          GST_FORMAT_BYTES, GST_CLOCK_TIME_NONE));
+#endif
+}
+
+/*
+ * Function to get individual headers from curl response.
+ */
+static size_t
+gst_curl_http_src_get_header (void *header, size_t size, size_t nmemb,
+    void * src)
+{
+  GstCurlHttpSrc *s = src;
+  char *substr;
+  gchar *value;
+  int i, len;
+  glong code = 0;
+
+  gst_curl_multi_context_source_fanout_header (&s->context, header,
+      size * nmemb);
+
+  /* A new response, its encoding is still to come */
+  if (size * nmemb > 5 && strncmp (header, "HTTP/", 5) == 0) {
+    s->content_encoding = GSTCURL_ENCODING_IDENTITY;
+    s->resume_validated = FALSE;
+    s->entity_length = 0;
+  }
+
+  /* An empty line ends the headers of a response */
+  if (size * nmemb <= 2 && (((char *) header)[0] == '\r' ||
+          ((char *) header)[0] == '\n')) {
+    curl_easy_getinfo (gst_curl_multi_context_source_handle (&s->context),
+        CURLINFO_RESPONSE_CODE, &code);
+    if (GSTCURL_INFO_RESPONSE (code) || GSTCURL_REDIRECT_RESPONSE (code)) {
+      /* Not the entity, the validators of this one are meaningless */
+      s->resume_mismatch = FALSE;
+      s->body_length = 0;
+      s->body_encoded = FALSE;
+      return size * nmemb;
+    }
+
+    /* An error page is not the entity, none of it reaches downstream */
+    if (!GSTCURL_SUCCESS_RESPONSE (code)) {
+      GST_WARNING_OBJECT (s, "Response %ld for URI %s, dropping its body",
+          code, s->uri);
+      return 0;
+    }
+
+    /*
+     * A server ignoring the Range, and so the If-Range, sends the whole
+     * entity. It is still the one being resumed if a validator and its size
+     * did not change, its start is skipped below.
+     */
+    if (s->resuming) {
+      if (code != 206 && (!s->resume_validated || (s->resume_length > 0 &&
+                  s->body_length > 0 && s->body_length != s->resume_length)))
+        s->resume_mismatch = TRUE;
+      if (s->resume_mismatch) {
+        GST_ERROR_OBJECT (s, "Resource %s changed while resuming at offset %"
+            G_GUINT64_FORMAT " (response code %ld)", s->uri,
+            s->start_position, code);
+        /* abort the transfer */
+        return 0;
+      }
+      GST_INFO_OBJECT (s, "Resumed transfer at offset %" G_GUINT64_FORMAT,
+          s->start_position);
+      s->resuming = FALSE;
+    }
+
+    /*
+     * Only the requested range is handed out. A server ignoring the Range
+     * sends the whole entity, what precedes the range is dropped and the
+     * transfer is closed once the range is in.
+     */
+    s->body_skip = 0;
+    if (code != 206 && s->request_start > 0) {
+      GST_INFO_OBJECT (s, "Range ignored, skipping the first %"
+          G_GUINT64_FORMAT " bytes", s->request_start);
+      s->body_skip = s->request_start;
+    }
+    s->body_left = G_MAXUINT64;
+    if (s->request_stop != -1)
+      s->body_left = s->request_stop - s->request_start;
+    if (s->body_length > 0)
+      s->body_length = MIN (s->body_length - MIN (s->body_skip,
+              s->body_length), s->body_left);
+
+    /*
+     * A small body known in advance is written in one allocation and handed
+     * out as one buffer. Shared with coalesced requests, it would reach them
+     * only once complete. The memory downstream asked for is preferred.
+     */
+    g_free (s->whole);
+    s->whole = NULL;
+    if (s->body_length > 0 && s->body_length <= GSTCURL_WHOLE_BODY_MAX &&
+        !s->body_encoded && !s->coalesce &&
+        !gst_curl_http_src_downstream_memory (s)) {
+      s->whole = g_malloc (s->body_length);
+      s->whole_size = s->body_length;
+      s->whole_filled = 0;
+    }
+
+    /*
+     * Decoded, the body is not the size the headers tell and its offsets are
+     * not the ones of the entity: the size stays unknown.
+     */
+    s->entity_encoded = s->body_encoded;
+    if (s->entity_encoded) {
+      s->content_length = 0;
+      GST_BASE_SRC_CAST (s)->segment.duration = -1;
+    } else if (s->entity_length > 0) {
+      gst_curl_http_src_set_length (s, s->entity_length);
+    }
+    s->body_length = 0;
+    s->body_encoded = FALSE;
+
+    s->have_response = TRUE;
+
+    /* The caps of a new entity are set before its first buffer */
+    if (s->trust_content_type)
+      s->caps_pending = TRUE;
+
+    /* Stay on the location that won the race */
+    if (s->context.winner && s->context.winner->tag > 0) {
+      guint index = s->context.winner->tag - 1;
+
+      if (index >= s->location_index)
+        index++;
+      s->location_index = index;
+      GST_INFO_OBJECT (s, "Fastest location is %s",
+          gst_curl_http_src_location (s, index));
+    }
+    gst_curl_http_src_update_redirect (s);
+
+    return size * nmemb;
+  }
+
+  /*
+   * Keep the validators of the entity so an interrupted transfer can be
+   * resumed knowing that the remaining bytes belong to the same resource.
+   */
+  value = gst_curl_http_src_header_value (header, size * nmemb, "ETag");
+  if (value != NULL) {
+    if (s->resuming && s->headers.etag && strcmp (s->headers.etag, value)) {
+      GST_WARNING_OBJECT (s, "ETag changed from %s to %s", s->headers.etag,
+          value);
+      s->resume_mismatch = TRUE;
+    } else if (s->resuming && s->headers.etag &&
+        !g_str_has_prefix (value, "W/")) {
+      s->resume_validated = TRUE;
+    }
+    g_free (s->headers.etag);
+    s->headers.etag = value;
+  }
+
+  value = gst_curl_http_src_header_value (header, size * nmemb,
+      "Last-Modified");
+  if (value != NULL) {
+    if (s->resuming && s->headers.last_modified &&
+        strcmp (s->headers.last_modified, value)) {
+      GST_WARNING_OBJECT (s, "Last-Modified changed from %s to %s",
+          s->headers.last_modified, value);
+      s->resume_mismatch = TRUE;
+    } else if (s->resuming && s->headers.last_modified) {
+      s->resume_validated = TRUE;
+    }
+    g_free (s->headers.last_modified);
+    s->headers.last_modified = value;
+  }
+
+  /* Decoded by curl, the body is not Content-Length long */
+  value = gst_curl_http_src_header_value (header, size * nmemb,
+      "Content-Encoding");
+  if (value != NULL) {
+    s->body_encoded = g_ascii_strcasecmp (value, "identity") != 0;
+    s->content_encoding = gst_curl_http_src_encoding (value);
+    g_free (value);
+  }
+
+  /* Another location must serve the very same entity size */
+  value = gst_curl_http_src_header_value (header, size * nmemb,
+      "Content-Range");
+  if (value != NULL) {
+    const gchar *total = strrchr (value, '/');
+
+    if (s->resuming && s->resume_length > 0 && total != NULL &&
+        total[1] != '*' &&
+        g_ascii_strtoull (total + 1, NULL, 10) != s->resume_length) {
+      GST_WARNING_OBJECT (s, "Entity size changed from %" G_GUINT64_FORMAT
+          " to %s", s->resume_length, total + 1);
+      s->resume_mismatch = TRUE;
+    }
+
+    /* The Content-Length of a bounded range says nothing of the entity */
+    if (s->request_stop != -1 && total != NULL && total[1] != '*')
+      s->entity_length = g_ascii_strtoull (total + 1, NULL, 10);
+    g_free (value);
+  }
+
+  /*
+   * All HTTP headers follow the same format.
+   *      <<Identifier>>: <<Value>>
+   *
+   * So just parse for those!
+   */
+  substr = gst_curl_http_src_strcasestr (header, "Content-Type: ");
+  if (substr != NULL) {
+    /*Length of stuff we don't need is 14 bytes */
+    substr += 14;
+    len = (size * nmemb) - 14;
+    if (s->headers.content_type != NULL) {
+      GST_DEBUG_OBJECT (s, "Content Type header already present.");
+      free (s->headers.content_type);
+    }
+    s->headers.content_type = malloc (sizeof (char) * (len + 1));
+    if (s->headers.content_type == NULL) {
+      GST_ERROR_OBJECT (s, "s->headers.content_type malloc failed!");
+    }
+    else {
+      for (i = 0; i < len; i++) {
+        /* For some reason, we get garbage characters at the end, so
+         * quick and dirty bit of stripping. We only want printing
+         * characters here. Also neatly null terminates! */
+        if ((substr[i] >= 0x20) && (substr[i] < 0x7f)) {
+          s->headers.content_type[i] = substr[i];
+        }
+        else {
+          s->headers.content_type[i] = '\0';
+        }
+      }
+      GST_INFO_OBJECT (s, "Got Content-Type of %s", s->headers.content_type);
+    }
+  }
+
+  substr = gst_curl_http_src_strcasestr (header, "Content-Length: ");
+  if (substr != NULL) {
+    guint64 clen, offset = 0;
+
+    substr += 16;
+    len = (size * nmemb) - 16;
+    clen = g_ascii_strtoull (substr, NULL, 10);
+    s->body_length = clen;
+
+    /* A partial response is the rest of the entity from where we asked */
+    curl_easy_getinfo (gst_curl_multi_context_source_handle (&s->context),
+        CURLINFO_RESPONSE_CODE, &code);
+    if (code == 206)
+      offset = s->request_start;
+
+    GST_INFO_OBJECT(src, "Content-Length was given as %" G_GUINT64_FORMAT
+        " real size %" G_GUINT64_FORMAT, clen, clen + offset);
+    if (code != 206 || s->request_stop == -1)
+      s->entity_length = clen + offset;
+  }
+
+  return size * nmemb;
+}
+
+/*
+ * Return the value of the header line if its identifier is name, with the
+ * surrounding whitespace and line ending stripped. Unlike the strcasestr
+ * approach this does not need the header to be NUL terminated.
+ */
+static gchar *
+gst_curl_http_src_header_value (const gchar * header, size_t len,
+    const gchar * name)
+{
+  size_t name_len = strlen (name);
+
+  if (len <= name_len || header[name_len] != ':' ||
+      g_ascii_strncasecmp (header, name, name_len) != 0)
+    return NULL;
+
+  return g_strstrip (g_strndup (header + name_len + 1, len - name_len - 1));
+}
+
+/*
+ * My own quick and dirty implementation of strcasestr. This is a GNU extension
+ * (i.e. not portable) and not always guaranteed to be available.
+ *
+ * I know this doesn't work if the haystack and needle are the same size. But
+ * this isn't necessarily a bad thing, as the only place we currently use this
+ * is at a point where returning nothing even if a string match occurs but the
+ * needle is the same size as the haystack actually saves us time.
+ */
+static char *
+gst_curl_http_src_strcasestr (const char *haystack, const char *needle)
+{
+  int i, j, needle_len;
+  char *location;
+
+  needle_len = (int) strlen (needle);
+  i = 0;
+  j = 0;
+  location = NULL;
+
+  while (haystack[i] != '\0') {
+    if (j == needle_len) {
+      location = (char *) haystack + (i - j);
+    }
+    if (tolower (haystack[i]) == tolower (needle[j])) {
+      j++;
+    }
+    else {
+      j = 0;
+    }
+    i++;
+  }
+
+  return location;
+}
+
+/*
+ * Copy the received data in a new buffer, from the memory downstream asked for
+ * if any. Called from the worker.
+ */
+static GstBuffer *
+gst_curl_http_src_alloc (GstCurlHttpSrc * s, const void *data, gsize len)
+{
+  GstBuffer *buf = NULL;
+#if GST_CHECK_VERSION(1,0,0)
+  GstBufferPool *pool = NULL;
+  GstAllocator *allocator = NULL;
+  GstAllocationParams params;
+
+  GST_OBJECT_LOCK (s);
+  if (s->pool && len <= s->pool_size)
+    pool = gst_object_ref (s->pool);
+  if (s->allocator)
+    allocator = gst_object_ref (s->allocator);
+  params = s->alloc_params;
+  GST_OBJECT_UNLOCK (s);
+
+  if (pool) {
+    GstBufferPoolAcquireParams acquire = { 0, };
+
+    /* The ring can hold more than the pool has, never block the worker */
+    acquire.flags = GST_BUFFER_POOL_ACQUIRE_FLAG_DONTWAIT;
+    if (gst_buffer_pool_acquire_buffer (pool, &buf, &acquire) != GST_FLOW_OK)
+      buf = NULL;
+    gst_object_unref (pool);
+  }
+  if (buf == NULL)
+    buf = gst_buffer_new_allocate (allocator, len, allocator ? &params : NULL);
+  if (allocator)
+    gst_object_unref (allocator);
+
+  gst_buffer_fill (buf, 0, data, len);
+  gst_buffer_set_size (buf, len);
+#else
+  buf = gst_buffer_new_and_alloc (len);
+  memcpy (GST_BUFFER_DATA (buf), data, len);
+#endif
+
+  return buf;
+}
+
+/*
+ * What is buffered between the network and downstream, and what it is worth.
+ *
+ * must be called with the object lock
+ */
+static gint
+gst_curl_http_src_buffering_level (GstCurlHttpSrc * s, gint64 * left)
+{
+  gsize level;
+  gint percent;
+
+  level = gst_curl_multi_context_source_level (&s->context) +
+      MAX (g_atomic_int_get (&s->adapter_level), 0);
+  percent = (gint) MIN (level * 100 / MAX (s->buffer_size, 1), 100);
+
+  /* the time to fill up at the current rate, in ms */
+  if (left) {
+    if (percent < 100 && s->avg_in > 0)
+      *left = (gint64) ((s->buffer_size - level) * 1000 / s->avg_in);
+    else
+      *left = 0;
+  }
+
+  return percent;
+}
+
+/*
+ * Account for bytes received or pushed, and post a buffering message if the
+ * level changed. Posted from the worker too, so the application hears about
+ * it while the pipeline is paused and nothing is pushed.
+ *
+ * must be called without the context lock
+ */
+static void
+gst_curl_http_src_buffering_update (GstCurlHttpSrc * s, gsize in, gsize out)
+{
+  GstMessage *msg = NULL;
+  gint64 now, elapsed, left;
+  gint percent;
+
+  if (!s->use_buffering)
+    return;
+
+  now = g_get_monotonic_time ();
+
+  GST_OBJECT_LOCK (s);
+  s->bytes_in += in;
+  s->bytes_out += out;
+  if (s->buffering_time == 0)
+    s->buffering_time = now;
+  elapsed = now - s->buffering_time;
+  if (elapsed >= GSTCURL_BUFFERING_INTERVAL_MS * G_TIME_SPAN_MILLISECOND) {
+    s->avg_in = (3 * s->avg_in +
+        (gdouble) s->bytes_in * G_USEC_PER_SEC / elapsed) / 4;
+    s->avg_out = (3 * s->avg_out +
+        (gdouble) s->bytes_out * G_USEC_PER_SEC / elapsed) / 4;
+    s->bytes_in = s->bytes_out = 0;
+    s->buffering_time = now;
+  }
+
+  percent = gst_curl_http_src_buffering_level (s, &left);
+  if (percent != s->buffering_percent) {
+    s->buffering_percent = percent;
+    msg = gst_message_new_buffering (GST_OBJECT (s), percent);
+    gst_message_set_buffering_stats (msg, GST_BUFFERING_STREAM,
+        (gint) s->avg_in, (gint) s->avg_out, left);
+  }
+  GST_OBJECT_UNLOCK (s);
+
+  if (msg) {
+    GST_LOG_OBJECT (s, "Buffering %d%%", percent);
+    gst_element_post_message (GST_ELEMENT (s), msg);
+  }
+}
+
+/*
+ * Hand a received buffer to the element, and to the requests coalesced with
+ * this one. Called from the worker.
+ */
+static void
+gst_curl_http_src_deliver (GstCurlHttpSrc * s, GstBuffer * buf, gsize len)
+{
+  if (s->direct_push)
+    buf = gst_curl_http_src_stamp (s, buf);
+
+  /* The requests coalesced with this one get the very same buffer */
+  gst_curl_multi_context_source_fanout (&s->context, buf, len);
+
+  gst_curl_multi_context_source_push (&s->context, buf);
+
+  gst_curl_http_src_buffering_update (s, len, 0);
+}
+
+/*
+ * Get chunks for currently running curl process.
+ */
+static size_t
+gst_curl_http_src_get_chunks (void *chunk, size_t size, size_t nmemb,
+    void * src)
+{
+  GstCurlHttpSrc * s = src;
+  size_t len = size * nmemb;
+
+  GST_TRACE_OBJECT (s,
+      "Received curl chunk for URI %s of size %d", s->uri,
+      (int) (size * nmemb));
+
+  /* No lock on the data path, the buffers go through the ring */
+  if (g_atomic_int_get (&s->context.cancel)) {
+    GST_DEBUG_OBJECT (s, "Cancelling the download");
+    return 0;
+  }
+
+  /* Over our share of the bandwidth, curl delivers it again on resume */
+  if (!gst_curl_multi_context_source_consume (&s->context, len)) {
+    GST_TRACE_OBJECT (s, "Out of bandwidth, pausing");
+    return CURL_WRITEFUNC_PAUSE;
+  }
+
+  /* Keep to the requested range, without copying what is out of it */
+  if (G_UNLIKELY (s->body_skip > 0)) {
+    gsize skip = MIN (s->body_skip, len);
+
+    s->body_skip -= skip;
+    chunk = (guint8 *) chunk + skip;
+    len -= skip;
+    if (len == 0)
+      return size * nmemb;
+  }
+  if (G_UNLIKELY (s->body_left != G_MAXUINT64)) {
+    if (s->body_left == 0)
+      return 0;
+    len = MIN (len, s->body_left);
+    s->body_left -= len;
+    if (s->body_left == 0) {
+      GST_DEBUG_OBJECT (s, "Requested range received, closing the transfer");
+      s->range_complete = TRUE;
+    }
+  }
+
+  if (s->whole != NULL) {
+    if (G_LIKELY (s->whole_filled + len <= s->whole_size)) {
+      memcpy (s->whole + s->whole_filled, chunk, len);
+      s->whole_filled += len;
+      if (s->whole_filled == s->whole_size)
+        gst_curl_http_src_deliver (s, gst_curl_http_src_whole_take (s),
+            s->whole_size);
+      return s->range_complete ? 0 : size * nmemb;
+    }
+
+    /* More than announced, go on chunk by chunk */
+    GST_WARNING_OBJECT (s, "Body longer than its Content-Length of %"
+        G_GSIZE_FORMAT " bytes", s->whole_size);
+    gst_curl_http_src_deliver (s, gst_curl_http_src_whole_take (s),
+        s->whole_filled);
+  }
+
+  /* pick up the data */
+  gst_curl_http_src_deliver (s, gst_curl_http_src_alloc (s, chunk, len), len);
+
+  /* Nothing more is wanted, a write error ends the transfer right away */
+  return s->range_complete ? 0 : size * nmemb;
+}
+
+/*
+ * Data of a transfer coalesced with the one of another element.
+ */
+static void
+gst_curl_http_src_take_buffer (GstBuffer * buf, gsize size, gpointer src)
+{
+  GstCurlHttpSrc *s = src;
+
+  if (g_atomic_int_get (&s->context.cancel)) {
+    gst_buffer_unref (buf);
+  } else {
+    /* The leader keeps to the same range, only note when it is in */
+    if (s->body_left != G_MAXUINT64) {
+      s->body_left -= MIN (s->body_left, size);
+      s->range_complete = s->body_left == 0;
+    }
+    if (s->direct_push)
+      buf = gst_curl_http_src_stamp (s, buf);
+    gst_curl_multi_context_source_push (&s->context, buf);
+    gst_curl_http_src_buffering_update (s, size, 0);
+  }
+}
+
+/*
+ * Abort the transfer when less than low_speed_limit bytes per second have been
+ * received over the last low_speed_time milliseconds. curl calls the progress
+ * callbacks at least once per second, even when no data arrives.
+ */
+static int
+gst_curl_http_src_check_speed (GstCurlHttpSrc * s, guint64 dlnow)
+{
+  gint64 now, elapsed;
+  guint64 rate, limit;
+  char *info;
+  CURL *handle;
+
+  /* Held back by the bandwidth sharing, not stalled */
+  if (s->context.paused) {
+    s->stall_window_start = 0;
+    return 0;
+  }
+
+  /* Connecting and waiting for the first byte are not stalls, the timeouts
+   * cover them */
+  if (dlnow == 0) {
+    s->stall_window_start = 0;
+    return 0;
+  }
+
+  now = g_get_monotonic_time ();
+  if (s->stall_window_start == 0) {
+    s->stall_window_start = now;
+    s->stall_window_bytes = dlnow;
+    return 0;
+  }
+
+  elapsed = now - s->stall_window_start;
+  if (elapsed < (gint64) s->low_speed_time * G_TIME_SPAN_MILLISECOND)
+    return 0;
+
+  /*
+   * Held back by max-bitrate, not stalled either. Curl keeps the average
+   * under the cap, half of it leaves room for its bursts.
+   */
+  limit = s->low_speed_limit;
+  if (s->max_bitrate > 0)
+    limit = MIN (limit, s->max_bitrate / 16);
+
+  rate = (dlnow - s->stall_window_bytes) * G_USEC_PER_SEC / elapsed;
+  if (rate >= limit) {
+    s->stall_window_start = now;
+    s->stall_window_bytes = dlnow;
+    return 0;
+  }
+
+  GST_WARNING_OBJECT (s, "Transfer for URI %s stalled at %" G_GUINT64_FORMAT
+      " bytes/sec, limit is %" G_GUINT64_FORMAT, s->uri, rate, limit);
+
+  /* Remember where we were connected to, to fail over somewhere else */
+  g_free (s->stalled_url);
+  s->stalled_url = NULL;
+  g_free (s->stalled_ip);
+  s->stalled_ip = NULL;
+  s->stalled_port = 0;
+  /* The transfer of the leader when coalesced */
+  handle = gst_curl_multi_context_source_handle (&s->context);
+  if (curl_easy_getinfo (handle, CURLINFO_EFFECTIVE_URL,
+          &info) == CURLE_OK && info != NULL)
+    s->stalled_url = g_strdup (info);
+  if (curl_easy_getinfo (handle, CURLINFO_PRIMARY_IP,
+          &info) == CURLE_OK && info != NULL && *info != '\0')
+    s->stalled_ip = g_strdup (info);
+  curl_easy_getinfo (handle, CURLINFO_PRIMARY_PORT, &s->stalled_port);
+  s->stalled = TRUE;
+
+  return 1;
+}
+
+#if LIBCURL_VERSION_NUM >= 0x072000
+static int
+gst_curl_http_src_xferinfo (void *src, curl_off_t dltotal, curl_off_t dlnow,
+    curl_off_t ultotal, curl_off_t ulnow)
+{
+  return gst_curl_http_src_check_speed (src, (guint64) dlnow);
+}
+#else
+static int
+gst_curl_http_src_progress (void *src, double dltotal, double dlnow,
+    double ultotal, double ulnow)
+{
+  return gst_curl_http_src_check_speed (src, (guint64) dlnow);
+}
+#endif
+
+/*
+ * Tell the application a request is predicted to end after its deadline, so it
+ * can switch to a lower bitrate before the playout actually stalls.
+ *
+ * must be called with the context lock, which is released meanwhile
+ */
+static void
+gst_curl_http_src_post_deadline_miss (GstCurlHttpSrc * src)
+{
+  GstStructure *s;
+  gint64 late = -1;
+
+  if (src->context.predicted_end != G_MAXINT64)
+    late = (src->context.predicted_end - src->context.deadline) * GST_USECOND;
+  src->context.deadline_missed = FALSE;
+
+  GST_WARNING_OBJECT (src, "Request for URI %s will miss its deadline",
+      src->uri);
+
+  s = gst_structure_new ("curlhttpsrc-deadline-miss",
+      "uri", G_TYPE_STRING, src->uri,
+      "position", G_TYPE_UINT64, src->read_position,
+      "late", G_TYPE_INT64, late, NULL);
+
+  g_mutex_unlock (&src->context.mutex);
+  gst_element_post_message (GST_ELEMENT (src),
+      gst_message_new_element (GST_OBJECT (src), s));
+  g_mutex_lock (&src->context.mutex);
+}
+
+/*----------------------------------------------------------------------------*
+ *                            The URI interface                               *
+ *----------------------------------------------------------------------------*/
+static GstURIType
+#if GST_CHECK_VERSION(1,0,0)
+gst_curl_http_src_uri_handler_get_type (GType type)
+#else
+gst_curl_http_src_uri_handler_get_type (void)
+#endif
+{
+  return GST_URI_SRC;
+}
+
+#if GST_CHECK_VERSION(1,0,0)
+static const gchar *const *
+gst_curl_http_src_uri_handler_get_protocols (GType type)
+{
+  static const gchar *protocols[] = { PROTOCOLS, NULL };
+
+  return protocols;
+}
+
+#else
+static gchar **
+gst_curl_http_src_uri_handler_get_protocols (void)
+{
+  static gchar *protocols[] = { PROTOCOLS, NULL };
+
+  return protocols;
+}
+#endif
+
+#if GST_CHECK_VERSION(1,0,0)
+static gchar *
+#else
+static const gchar *
+#endif
+gst_curl_http_src_uri_handler_get_uri (GstURIHandler * handler)
+{
+  gchar* ret;
+  GstCurlHttpSrc *source;
+
+  g_return_val_if_fail (GST_IS_URI_HANDLER (handler), FALSE);
+  source = GST_CURLHTTPSRC (handler);
+
+  GSTCURL_FUNCTION_ENTRY (source);
+
+  g_mutex_lock(source->uri_mutex);
+#if GST_CHECK_VERSION(1,0,0)
+  ret = g_strdup (source->uri);
+#else
+  ret = source->uri;
+#endif
+  g_mutex_unlock(source->uri_mutex);
+
+  GSTCURL_FUNCTION_EXIT (source);
+  return ret;
+}
+
+static gboolean
+#if GST_CHECK_VERSION(1,0,0)
+gst_curl_http_src_uri_handler_set_uri (GstURIHandler * handler,
+    const gchar * uri, GError ** error)
+#else
+gst_curl_http_src_uri_handler_set_uri (GstURIHandler * handler,
+    const gchar * uri)
+#endif
+{
+  GstCurlHttpSrc *source = GST_CURLHTTPSRC (handler);
+  GSTCURL_FUNCTION_ENTRY (source);
+
+  g_return_val_if_fail (GST_IS_URI_HANDLER (handler), FALSE);
+  g_return_val_if_fail (uri != NULL, FALSE);
+
+  g_mutex_lock(source->uri_mutex);
+
+  if (source->uri != NULL) {
+    GST_DEBUG_OBJECT (source,
+        "URI already present as %s, updating to new URI %s", source->uri, uri);
+    g_free (source->uri);
   }
-  else {
-    GST_INFO_OBJECT (src, "No caps have been set, continue.");
+
+  source->uri = g_strdup (uri);
+  if (source->uri == NULL) {
+    return FALSE;
   }
+  source->location_index = 0;
+  source->raced = FALSE;
+
+  g_mutex_unlock(source->uri_mutex);
+
+  GSTCURL_FUNCTION_EXIT (source);
+  return TRUE;
+}
+
+static void
+gst_curl_http_src_uri_handler_init (gpointer g_iface, gpointer iface_data)
+{
+  GstURIHandlerInterface *uri_iface = (GstURIHandlerInterface *) g_iface;
+
+  uri_iface->get_type = gst_curl_http_src_uri_handler_get_type;
+  uri_iface->get_protocols = gst_curl_http_src_uri_handler_get_protocols;
+  uri_iface->get_uri = gst_curl_http_src_uri_handler_get_uri;
+  uri_iface->set_uri = gst_curl_http_src_uri_handler_set_uri;
+}
+
+/*----------------------------------------------------------------------------*
+ *                              The src class                                 *
+ *----------------------------------------------------------------------------*/
+#if !GST_CHECK_VERSION(1,0,0)
+
+static gboolean
+gst_curl_http_src_interface_supported (GstImplementsInterface * iface, GType type)
+{
+  if (type == GST_TYPE_URI_HANDLER)
+    return TRUE;
+  else
+    return FALSE;
+}
+
+static void
+gst_curl_http_src_interface_init (GstImplementsInterfaceClass * klass)
+{
+  klass->supported = gst_curl_http_src_interface_supported;
+}
 #endif
+
+/*----------------------------------------------------------------------------*
+ *                        The GstPushSrc interface                            *
+ *----------------------------------------------------------------------------*/
+/*
+ * Whether the failure of the last transfer is worth another attempt. Client
+ * errors and a resource that changed under us are final.
+ */
+static gboolean
+gst_curl_http_src_is_retryable (GstCurlHttpSrc * src)
+{
+  glong code = src->context.response_code;
+
+  if (src->resume_mismatch)
+    return FALSE;
+  /* A decoded body cannot be resumed at one of its offsets */
+  if (src->entity_encoded && src->read_position > 0)
+    return FALSE;
+
+  if (code == 408 || code == 429)
+    return TRUE;
+  /* Another location might have it, but try each of them only once */
+  if (code >= 400 && code <= 499)
+    return src->retry_attempt < src->n_mirrors;
+  if (code >= 500 && code <= 599)
+    return TRUE;
+
+  switch (src->context.curl_code) {
+    case CURLE_COULDNT_RESOLVE_PROXY:
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+#if LIBCURL_VERSION_NUM >= 0x072600
+    case CURLE_HTTP2:
+#endif
+#if LIBCURL_VERSION_NUM >= 0x073100
+    case CURLE_HTTP2_STREAM:
+#endif
+      return TRUE;
+    case CURLE_ABORTED_BY_CALLBACK:
+      /* only our stall detection aborts from a callback */
+      return src->stalled;
+    default:
+      return FALSE;
+  }
+}
+
+/*
+ * Parse a "bytes a-b/total" Content-Range into its first byte and length.
+ */
+static gboolean
+gst_curl_http_src_parse_range (const gchar * value, guint64 * start,
+    guint64 * length)
+{
+  guint64 first, last;
+  gchar *end;
+
+  if (g_ascii_strncasecmp (value, "bytes ", 6) != 0)
+    return FALSE;
+
+  first = g_ascii_strtoull (value + 6, &end, 10);
+  if (end == value + 6 || *end != '-')
+    return FALSE;
+  last = g_ascii_strtoull (end + 1, NULL, 10);
+  if (last < first)
+    return FALSE;
+
+  *start = first;
+  *length = last - first + 1;
   return TRUE;
 }
 
+/* must be called with the context lock */
+static void
+gst_curl_http_src_chunk_free (GstCurlHttpSrc * s, GList * link)
+{
+  GstCurlHttpSrcChunk *chunk = link->data;
+
+  s->range_cache_size -= chunk->size;
+  g_mutex_lock (&s->cache_lock);
+  s->range_cache = g_list_delete_link (s->range_cache, link);
+  g_mutex_unlock (&s->cache_lock);
+  g_free (chunk->data);
+  g_free (chunk);
+}
+
+/* must be called with the context lock */
+static void
+gst_curl_http_src_cache_clear (GstCurlHttpSrc * s)
+{
+  while (s->range_cache)
+    gst_curl_http_src_chunk_free (s, s->range_cache);
+}
+
+/* Wake up the element waiting for the ranges, with the cache lock */
+static void
+gst_curl_http_src_cache_signal (GstCurlHttpSrc * s)
+{
+  s->cache_cookie++;
+  g_cond_broadcast (&s->cache_signal);
+}
+
 /*
- * Take care of any memory that may be left over from the instance that's now
- * closing before we leak it.
+ * Copy the bytes of a response from offset into the ranges waiting for them.
+ * A server may merge close ranges, what is between them is dropped. Called
+ * from the worker.
  */
 static void
-gst_curl_http_src_cleanup_instance(GstCurlHttpSrc *src)
+gst_curl_http_src_cache_fill (GstCurlHttpSrc * s, guint64 offset,
+    const gchar * data, gsize len)
+{
+  GList *walk;
+  gboolean filled = FALSE;
+
+  g_mutex_lock (&s->cache_lock);
+  for (walk = s->range_cache; walk; walk = walk->next) {
+    GstCurlHttpSrcChunk *chunk = walk->data;
+    guint64 from = chunk->start + chunk->filled;
+    gsize n;
+
+    if (chunk->filled == chunk->size || from < offset || from >= offset + len)
+      continue;
+
+    n = MIN (chunk->size - chunk->filled, offset + len - from);
+    memcpy (chunk->data + chunk->filled, data + (from - offset), n);
+    chunk->filled += n;
+    filled = TRUE;
+  }
+  if (filled)
+    gst_curl_http_src_cache_signal (s);
+  g_mutex_unlock (&s->cache_lock);
+}
+
+/* A range request ended, called from the worker */
+static void
+gst_curl_http_src_fetch_done (gpointer data)
+{
+  GstCurlHttpSrcFetch *fetch = data;
+
+  g_mutex_lock (&fetch->src->cache_lock);
+  gst_curl_http_src_cache_signal (fetch->src);
+  g_mutex_unlock (&fetch->src->cache_lock);
+}
+
+static void
+gst_curl_http_src_fetch_free (GstCurlHttpSrcFetch * fetch)
+{
+  if (fetch->context.easy_handle)
+    curl_easy_cleanup (fetch->context.easy_handle);
+  curl_slist_free_all (fetch->slist);
+  g_free (fetch->boundary);
+  g_string_free (fetch->line, TRUE);
+  g_mutex_clear (&fetch->context.mutex);
+  g_cond_clear (&fetch->context.signal);
+  g_free (fetch);
+}
+
+/*
+ * A complete line of a multipart body, outside of the parts data.
+ */
+static void
+gst_curl_http_src_fetch_line (GstCurlHttpSrcFetch * fetch)
 {
+  gchar *line = g_strchomp (fetch->line->str);
+  gchar *value;
+
+  if (fetch->state == GSTCURL_FETCH_DELIMITER) {
+    if (g_str_has_prefix (line, fetch->boundary)) {
+      line += strlen (fetch->boundary);
+      if (strcmp (line, "--") == 0) {
+        fetch->state = GSTCURL_FETCH_END;
+      } else {
+        fetch->state = GSTCURL_FETCH_HEADERS;
+        fetch->part_left = 0;
+      }
+    }
+  } else if (*line == '\0') {
+    /* A part without its range cannot be placed, skip it */
+    fetch->state = fetch->part_left > 0 ? GSTCURL_FETCH_BODY :
+        GSTCURL_FETCH_DELIMITER;
+  } else {
+    value = gst_curl_http_src_header_value (line, strlen (line),
+        "Content-Range");
+    if (value != NULL) {
+      if (!gst_curl_http_src_parse_range (value, &fetch->part_offset,
+              &fetch->part_left))
+        fetch->part_left = 0;
+      g_free (value);
+    }
+  }
+}
+
+static size_t
+gst_curl_http_src_fetch_header (void *header, size_t size, size_t nmemb,
+    void *data)
+{
+  GstCurlHttpSrcFetch *fetch = data;
+  size_t len = size * nmemb;
+  gchar *value, *boundary, *end;
+  glong code = 0;
+
+  if (len <= 2 && (((char *) header)[0] == '\r' ||
+          ((char *) header)[0] == '\n')) {
+    curl_easy_getinfo (fetch->context.easy_handle, CURLINFO_RESPONSE_CODE,
+        &code);
+    if (GSTCURL_INFO_RESPONSE (code) || GSTCURL_REDIRECT_RESPONSE (code)) {
+      g_free (fetch->boundary);
+      fetch->boundary = NULL;
+      fetch->part_left = 0;
+      fetch->probe_size = 0;
+      fetch->probe_no_ranges = FALSE;
+      return len;
+    }
+
+    /* The headers are all a probe wants. The whole entity for the first
+     * byte is a server ignoring ranges. */
+    if (fetch->probe) {
+      fetch->probed = code == 200 || code == 206;
+      if (code == 200)
+        fetch->probe_no_ranges = TRUE;
+      return 0;
+    }
+
+    if (code == 200) {
+      GST_INFO_OBJECT (fetch->src, "Range request answered with the whole "
+          "entity");
+      fetch->ignored = TRUE;
+      return 0;
+    }
+
+    /* Either parts with their own ranges or the single one asked for */
+    if (code == 206) {
+      if (fetch->boundary)
+        fetch->state = GSTCURL_FETCH_DELIMITER;
+      else if (fetch->part_left > 0)
+        fetch->state = GSTCURL_FETCH_BODY;
+    }
+    return len;
+  }
+
+  value = gst_curl_http_src_header_value (header, len, "Content-Type");
+  if (value != NULL) {
+    boundary = gst_curl_http_src_strcasestr (value, "boundary=");
+    if (g_ascii_strncasecmp (value, "multipart/byteranges", 20) == 0 &&
+        boundary != NULL) {
+      boundary += 9;
+      if (*boundary == '"') {
+        boundary++;
+        end = strchr (boundary, '"');
+      } else {
+        end = strchr (boundary, ';');
+      }
+      if (end)
+        *end = '\0';
+      g_free (fetch->boundary);
+      fetch->boundary = g_strconcat ("--", g_strstrip (boundary), NULL);
+    }
+    g_free (value);
+  }
+
+  value = gst_curl_http_src_header_value (header, len, "Content-Range");
+  if (value != NULL) {
+    if (!gst_curl_http_src_parse_range (value, &fetch->part_offset,
+            &fetch->part_left))
+      fetch->part_left = 0;
+    end = strrchr (value, '/');
+    if (end != NULL && end[1] != '*')
+      fetch->probe_size = g_ascii_strtoull (end + 1, NULL, 10);
+    g_free (value);
+  }
+
+  /* The whole entity, not a range of it, when Range is not supported */
+  if (fetch->probe) {
+    value = gst_curl_http_src_header_value (header, len, "Content-Length");
+    if (value != NULL) {
+      curl_easy_getinfo (fetch->context.easy_handle, CURLINFO_RESPONSE_CODE,
+          &code);
+      if (code == 200)
+        fetch->probe_size = g_ascii_strtoull (value, NULL, 10);
+      g_free (value);
+    }
+
+    value = gst_curl_http_src_header_value (header, len, "Accept-Ranges");
+    if (value != NULL) {
+      fetch->probe_no_ranges = g_ascii_strcasecmp (value, "none") == 0;
+      g_free (value);
+    }
+  }
+
+  return len;
+}
+
+/*
+ * Split a response to a range request in parts, as it arrives. The data goes
+ * straight to the ranges, only the multipart delimiters and headers are
+ * buffered.
+ */
+static size_t
+gst_curl_http_src_fetch_write (void *chunk, size_t size, size_t nmemb,
+    void *data)
+{
+  GstCurlHttpSrcFetch *fetch = data;
+  const gchar *p = chunk;
+  const gchar *eol;
+  gsize left = size * nmemb, n;
+
+  if (g_atomic_int_get (&fetch->context.cancel))
+    return 0;
+
+  if (!gst_curl_multi_context_source_consume (&fetch->context, left))
+    return CURL_WRITEFUNC_PAUSE;
+
+  while (left > 0) {
+    switch (fetch->state) {
+      case GSTCURL_FETCH_BODY:
+        n = MIN (left, fetch->part_left);
+        gst_curl_http_src_cache_fill (fetch->src, fetch->part_offset, p, n);
+        fetch->part_offset += n;
+        fetch->part_left -= n;
+        if (fetch->part_left == 0)
+          fetch->state = fetch->boundary ? GSTCURL_FETCH_DELIMITER :
+              GSTCURL_FETCH_END;
+        break;
+      case GSTCURL_FETCH_DELIMITER:
+      case GSTCURL_FETCH_HEADERS:
+        eol = memchr (p, '\n', left);
+        n = eol ? (gsize) (eol - p + 1) : left;
+        g_string_append_len (fetch->line, p, n);
+        if (fetch->line->len > GSTCURL_FETCH_LINE_MAX) {
+          GST_WARNING_OBJECT (fetch->src, "Malformed multipart response");
+          return 0;
+        }
+        if (eol) {
+          gst_curl_http_src_fetch_line (fetch);
+          g_string_truncate (fetch->line, 0);
+        }
+        break;
+      default:
+        /* Not part of what was asked for */
+        n = left;
+        break;
+    }
+    p += n;
+    left -= n;
+  }
+
+  return size * nmemb;
+}
+
+/*
+ * Request the chunks in one go, with a multipart response if more than one.
+ * Without chunks the first byte is requested to probe the entity.
+ *
+ * must be called with the context lock
+ */
+static void
+gst_curl_http_src_fetch_start (GstCurlHttpSrc * s, GList * chunks)
+{
+  GstCurlHttpSrcClass *klass;
+  GstCurlHttpSrcFetch *fetch;
+  GString *range;
+  CURL *handle;
+  GList *walk;
   gint i;
-  g_mutex_lock(src->uri_mutex);
-  g_free(src->uri);
-  src->uri = NULL;
-  g_free(src->redirect_uri);
-  src->redirect_uri = NULL;
-  g_mutex_unlock(src->uri_mutex);
-  g_mutex_clear(src->uri_mutex);
-  g_free(src->uri_mutex);
-  src->uri_mutex = NULL;
 
-  g_free(src->proxy_uri);
-  src->proxy_uri = NULL;
-  g_free(src->no_proxy_list);
-  src->no_proxy_list = NULL;
-  g_free(src->proxy_user);
-  src->proxy_user = NULL;
-  g_free(src->proxy_pass);
-  src->proxy_pass = NULL;
+  handle = curl_easy_init ();
+  if (handle == NULL) {
+    GST_ERROR_OBJECT (s, "Couldn't init a curl easy handle!");
+    return;
+  }
 
-  for(i = 0; i < src->number_cookies; i++)
-  {
-    g_free(src->cookies[i]);
-    src->cookies[i] = NULL;
+  fetch = g_new0 (GstCurlHttpSrcFetch, 1);
+  g_mutex_init (&fetch->context.mutex);
+  g_cond_init (&fetch->context.signal);
+  fetch->context.easy_handle = handle;
+  fetch->context.weight = s->bandwidth_weight;
+  fetch->context.done_func = gst_curl_http_src_fetch_done;
+  fetch->context.func_data = fetch;
+  fetch->src = s;
+  fetch->multi = chunks && chunks->next != NULL;
+  fetch->probe = chunks == NULL;
+  fetch->line = g_string_new (NULL);
+
+  range = g_string_new (fetch->probe ? "Range: bytes=0-0" : "Range: bytes=");
+  for (walk = chunks; walk; walk = walk->next) {
+    GstCurlHttpSrcChunk *chunk = walk->data;
+
+    g_string_append_printf (range, "%s%" G_GUINT64_FORMAT "-%"
+        G_GUINT64_FORMAT, walk == chunks ? "" : ",", chunk->start,
+        chunk->start + chunk->size - 1);
+    chunk->fetch = fetch;
   }
-  g_free(src->cookies);
-  src->cookies = NULL;
+  GST_DEBUG_OBJECT (s, "Fetching ahead with '%s'", range->str);
+
+  gst_curl_http_src_setup_handle (s, handle,
+      gst_curl_http_src_location (s, s->location_index));
+  for (i = 0; i < s->number_headers; i++)
+    fetch->slist = curl_slist_append (fetch->slist, s->extra_headers[i]);
+  fetch->slist = curl_slist_append (fetch->slist, range->str);
+  g_string_free (range, TRUE);
+  curl_easy_setopt (handle, CURLOPT_HTTPHEADER, fetch->slist);
+  /* The ranges of an encoded body are not the ones of the entity */
+  curl_easy_setopt (handle, CURLOPT_ACCEPT_ENCODING, "identity");
 
-  g_cond_clear(src->finished);
-  g_free(src->finished);
-  src->finished = NULL;
+  curl_easy_setopt (handle, CURLOPT_HEADERFUNCTION,
+                    gst_curl_http_src_fetch_header);
+  curl_easy_setopt (handle, CURLOPT_HEADERDATA, fetch);
+  curl_easy_setopt (handle, CURLOPT_WRITEFUNCTION,
+                    gst_curl_http_src_fetch_write);
+  curl_easy_setopt (handle, CURLOPT_WRITEDATA, fetch);
+  curl_easy_setopt (handle, CURLOPT_PRIVATE, &fetch->context);
 
-  g_free(src->headers.content_type);
-  src->headers.content_type = NULL;
+  if (fetch->probe)
+    s->probe = fetch;
+  else
+    s->fetches = g_list_prepend (s->fetches, fetch);
+
+  klass = G_TYPE_INSTANCE_GET_CLASS (s, GST_TYPE_CURL_HTTP_SRC,
+                                     GstCurlHttpSrcClass);
+  gst_curl_multi_context_add_source (&klass->multi_task_context, handle);
+}
+
+/*
+ * Free the finished requests. The ranges of a multiple range request that got
+ * the whole entity are requested again, one request each.
+ *
+ * must be called with the context lock
+ */
+static void
+gst_curl_http_src_fetch_reap (GstCurlHttpSrc * s)
+{
+  GList *walk, *next, *link, *retry;
+  GstCurlHttpSrcFetch *fetch;
+  gboolean done;
+
+  for (walk = s->fetches; walk; walk = next) {
+    next = walk->next;
+    fetch = walk->data;
+
+    g_mutex_lock (&fetch->context.mutex);
+    done = fetch->context.done;
+    g_mutex_unlock (&fetch->context.mutex);
+    if (!done)
+      continue;
+
+    s->fetches = g_list_delete_link (s->fetches, walk);
+    retry = NULL;
+    for (link = s->range_cache; link; link = link->next) {
+      GstCurlHttpSrcChunk *chunk = link->data;
+
+      if (chunk->fetch != fetch)
+        continue;
+      chunk->fetch = NULL;
+      if (fetch->ignored && fetch->multi && chunk->filled == 0)
+        retry = g_list_prepend (retry, chunk);
+    }
+
+    if (fetch->ignored && fetch->multi) {
+      GST_INFO_OBJECT (s, "No support for multiple ranges, using a request "
+          "per range");
+      s->no_multirange = TRUE;
+    }
+    gst_curl_http_src_fetch_free (fetch);
+
+    for (link = retry; link; link = link->next) {
+      GList one = { link->data, NULL, NULL };
+
+      gst_curl_http_src_fetch_start (s, &one);
+    }
+    g_list_free (retry);
+  }
+}
+
+/*
+ * Stop all the range requests and wait for the worker to let go of them.
+ */
+static void
+gst_curl_http_src_fetch_cancel (GstCurlHttpSrc * s)
+{
+  GstCurlHttpSrcClass *klass;
+  GstCurlHttpSrcFetch *fetch;
+  GList *fetches, *walk;
+
+  klass = G_TYPE_INSTANCE_GET_CLASS (s, GST_TYPE_CURL_HTTP_SRC,
+                                     GstCurlHttpSrcClass);
+
+  g_mutex_lock (&s->probe_lock);
+  g_mutex_lock (&s->context.mutex);
+  fetches = s->fetches;
+  s->fetches = NULL;
+  for (walk = s->range_cache; walk; walk = walk->next)
+    ((GstCurlHttpSrcChunk *) walk->data)->fetch = NULL;
+  if (s->probe)
+    fetches = g_list_prepend (fetches, s->probe);
+  s->probe = NULL;
+  g_mutex_unlock (&s->context.mutex);
+  g_mutex_unlock (&s->probe_lock);
+
+  for (walk = fetches; walk; walk = walk->next) {
+    fetch = walk->data;
+    g_atomic_int_set (&fetch->context.cancel, TRUE);
+    gst_curl_multi_context_remove_source (&klass->multi_task_context,
+        &fetch->context);
+  }
+
+  for (walk = fetches; walk; walk = walk->next) {
+    fetch = walk->data;
+    g_mutex_lock (&fetch->context.mutex);
+    while (!fetch->context.removed)
+      g_cond_wait (&fetch->context.signal, &fetch->context.mutex);
+    g_mutex_unlock (&fetch->context.mutex);
+    gst_curl_http_src_fetch_free (fetch);
+  }
+  g_list_free (fetches);
+}
+
+/*
+ * Take what the probe learned, for this element and the next ones opening the
+ * same URI.
+ *
+ * must be called with the context lock
+ */
+static void
+gst_curl_http_src_probe_apply (GstCurlHttpSrc * s, guint64 size,
+    gboolean no_ranges)
+{
+  s->no_ranges = no_ranges;
+  if (size > 0 && s->content_length == 0 && !s->entity_encoded) {
+    GST_INFO_OBJECT (s, "Probed size of %" G_GUINT64_FORMAT "%s", size,
+        no_ranges ? ", no range support" : "");
+    gst_curl_http_src_set_length (s, size);
+  }
+}
 
-  /* destroy the context */
-  if (src->context.adapter) {
-    g_object_unref (src->context.adapter);
-    src->context.adapter = NULL;
+/*
+ * Learn the size of the entity and whether it supports ranges from a request
+ * for its first byte, next to the first request, unless already known.
+ */
+static void
+gst_curl_http_src_probe_start (GstCurlHttpSrc * s)
+{
+  GstCurlHttpSrcProbeResult *result = NULL, cached;
+
+  if (s->probe_timeout == 0 || s->uri == NULL)
+    return;
+
+  g_mutex_lock (&gst_curl_http_src_probe_mutex);
+  if (gst_curl_http_src_probe_results)
+    result = g_hash_table_lookup (gst_curl_http_src_probe_results, s->uri);
+  if (result && g_get_monotonic_time () - result->time >
+      GSTCURL_PROBE_CACHE_TTL * G_TIME_SPAN_SECOND) {
+    g_hash_table_remove (gst_curl_http_src_probe_results, s->uri);
+    result = NULL;
   }
+  if (result)
+    cached = *result;
+  g_mutex_unlock (&gst_curl_http_src_probe_mutex);
 
-  /* Thank you Handles, and well done. Well done, mate. */
-  if (src->context.easy_handle != NULL) {
-    curl_easy_cleanup (src->context.easy_handle);
-    src->context.easy_handle = NULL;
+  g_mutex_lock (&s->context.mutex);
+  if (result) {
+    GST_DEBUG_OBJECT (s, "Size of %s already probed", s->uri);
+    gst_curl_http_src_probe_apply (s, cached.size, cached.no_ranges);
+  } else if (s->probe == NULL) {
+    s->probe_deadline = g_get_monotonic_time () +
+        s->probe_timeout * G_TIME_SPAN_MILLISECOND;
+    gst_curl_http_src_fetch_start (s, NULL);
   }
+  g_mutex_unlock (&s->context.mutex);
+}
+
+static gboolean
+gst_curl_http_src_probe_expired (gpointer key, gpointer value, gpointer now)
+{
+  GstCurlHttpSrcProbeResult *result = value;
+
+  return *(gint64 *) now - result->time >
+      GSTCURL_PROBE_CACHE_TTL * G_TIME_SPAN_SECOND;
 }
 
 /*
- * Function to get individual headers from curl response.
+ * Make room in the full cache of probe results: drop the expired ones, or
+ * else the oldest one.
+ *
+ * must be called with the probe results lock
  */
-static size_t
-gst_curl_http_src_get_header (void *header, size_t size, size_t nmemb,
-    void * src)
+static void
+gst_curl_http_src_probe_evict (gint64 now)
 {
-  GstCurlHttpSrc *s = src;
-  char *substr;
-  int i, len;
-  /*
-   * All HTTP headers follow the same format.
-   *      <<Identifier>>: <<Value>>
-   *
-   * So just parse for those!
-   */
-  substr = gst_curl_http_src_strcasestr (header, "Content-Type: ");
-  if (substr != NULL) {
-    /*Length of stuff we don't need is 14 bytes */
-    substr += 14;
-    len = (size * nmemb) - 14;
-    if (s->headers.content_type != NULL) {
-      GST_DEBUG_OBJECT (s, "Content Type header already present.");
-      free (s->headers.content_type);
-    }
-    s->headers.content_type = malloc (sizeof (char) * (len + 1));
-    if (s->headers.content_type == NULL) {
-      GST_ERROR_OBJECT (s, "s->headers.content_type malloc failed!");
-    }
-    else {
-      for (i = 0; i < len; i++) {
-        /* For some reason, we get garbage characters at the end, so
-         * quick and dirty bit of stripping. We only want printing
-         * characters here. Also neatly null terminates! */
-        if ((substr[i] >= 0x20) && (substr[i] < 0x7f)) {
-          s->headers.content_type[i] = substr[i];
-        }
-        else {
-          s->headers.content_type[i] = '\0';
-        }
-      }
-      GST_INFO_OBJECT (s, "Got Content-Type of %s", s->headers.content_type);
+  GstCurlHttpSrcProbeResult *result, *oldest = NULL;
+  gpointer key, oldest_key = NULL;
+  GHashTableIter iter;
+
+  if (g_hash_table_foreach_remove (gst_curl_http_src_probe_results,
+          gst_curl_http_src_probe_expired, &now) > 0)
+    return;
+
+  g_hash_table_iter_init (&iter, gst_curl_http_src_probe_results);
+  while (g_hash_table_iter_next (&iter, &key, (gpointer *) & result)) {
+    if (oldest == NULL || result->time < oldest->time) {
+      oldest = result;
+      oldest_key = key;
     }
   }
+  if (oldest_key)
+    g_hash_table_remove (gst_curl_http_src_probe_results, oldest_key);
+}
 
-  substr = gst_curl_http_src_strcasestr (header, "Content-Length: ");
-  if (substr != NULL) {
-    GstBaseSrc *basesrc;
-    guint64 clen;
+/*
+ * The URI failed, what was probed of it may be what changed. Only takes the
+ * probe lock, so it can be called with the context lock.
+ */
+static void
+gst_curl_http_src_probe_forget (GstCurlHttpSrc * s)
+{
+  g_mutex_lock (&gst_curl_http_src_probe_mutex);
+  if (gst_curl_http_src_probe_results && s->uri)
+    g_hash_table_remove (gst_curl_http_src_probe_results, s->uri);
+  g_mutex_unlock (&gst_curl_http_src_probe_mutex);
+}
 
-    substr += 16;
-    len = (size * nmemb) - 16;
-    clen = g_ascii_strtoull (substr, NULL, 10);
+/*
+ * Wait for the probe until its deadline, unless the size is known already,
+ * and take its results.
+ */
+static void
+gst_curl_http_src_probe_wait (GstCurlHttpSrc * s)
+{
+  GstCurlHttpSrcProbeResult *result;
+  GstCurlHttpSrcFetch *probe;
+  gboolean done;
 
-    GST_INFO_OBJECT(src, "Content-Length was given as %" G_GUINT64_FORMAT
-        " real size %" G_GUINT64_FORMAT, clen, clen + s->start_position);
-    clen += s->start_position;
-    basesrc = GST_BASE_SRC_CAST (s);
-    basesrc->segment.duration = clen;
-    s->content_length = clen;
-#if GST_CHECK_VERSION(1,0,0)
-    gst_element_post_message (GST_ELEMENT (s),
-        gst_message_new_duration_changed (GST_OBJECT (s)));
-#else
-    gst_element_post_message (GST_ELEMENT (s),
-        gst_message_new_duration (GST_OBJECT (s),
-            GST_FORMAT_BYTES, GST_CLOCK_TIME_NONE));
-#endif
+  g_mutex_lock (&s->probe_lock);
+  g_mutex_lock (&s->context.mutex);
+  probe = s->probe;
+  done = probe == NULL || s->content_length > 0;
+  g_mutex_unlock (&s->context.mutex);
+  if (done && probe == NULL) {
+    g_mutex_unlock (&s->probe_lock);
+    return;
   }
 
-  return size * nmemb;
+  /* Without the context lock, the worker may need it meanwhile */
+  g_mutex_lock (&probe->context.mutex);
+  while (!done && !probe->context.done) {
+    if (!g_cond_wait_until (&probe->context.signal, &probe->context.mutex,
+            s->probe_deadline))
+      break;
+  }
+  done = probe->context.done;
+  g_mutex_unlock (&probe->context.mutex);
+
+  if (done) {
+    g_mutex_lock (&s->context.mutex);
+    s->probe = NULL;
+    if (probe->probed) {
+      gst_curl_http_src_probe_apply (s, probe->probe_size,
+          probe->probe_no_ranges);
+      g_mutex_unlock (&s->context.mutex);
+
+      g_mutex_lock (&gst_curl_http_src_probe_mutex);
+      if (gst_curl_http_src_probe_results == NULL)
+        gst_curl_http_src_probe_results = g_hash_table_new_full (g_str_hash,
+            g_str_equal, g_free, g_free);
+      result = g_new0 (GstCurlHttpSrcProbeResult, 1);
+      result->size = probe->probe_size;
+      result->no_ranges = probe->probe_no_ranges;
+      result->time = g_get_monotonic_time ();
+      if (g_hash_table_size (gst_curl_http_src_probe_results) >=
+          GSTCURL_PROBE_CACHE_MAX &&
+          !g_hash_table_contains (gst_curl_http_src_probe_results, s->uri))
+        gst_curl_http_src_probe_evict (result->time);
+      g_hash_table_replace (gst_curl_http_src_probe_results,
+          g_strdup (s->uri), result);
+      g_mutex_unlock (&gst_curl_http_src_probe_mutex);
+    } else {
+      g_mutex_unlock (&s->context.mutex);
+    }
+    gst_curl_http_src_fetch_free (probe);
+  }
+  g_mutex_unlock (&s->probe_lock);
 }
 
 /*
- * My own quick and dirty implementation of strcasestr. This is a GNU extension
- * (i.e. not portable) and not always guaranteed to be available.
- *
- * I know this doesn't work if the haystack and needle are the same size. But
- * this isn't necessarily a bad thing, as the only place we currently use this
- * is at a point where returning nothing even if a string match occurs but the
- * needle is the same size as the haystack actually saves us time.
+ * Fetch ahead the ranges of a curlhttpsrc-ranges event, "a-b,c-d,..." with
+ * inclusive ends as in a Range header.
  */
-static char *
-gst_curl_http_src_strcasestr (const char *haystack, const char *needle)
+static void
+gst_curl_http_src_prefetch (GstCurlHttpSrc * s, const gchar * ranges)
 {
-  int i, j, needle_len;
-  char *location;
+  GstCurlHttpSrcChunk *chunk;
+  GList *chunks = NULL, *walk;
+  gchar **parts, *end;
+  guint64 start, stop;
+  guint i, n = 0;
 
-  needle_len = (int) strlen (needle);
-  i = 0;
-  j = 0;
-  location = NULL;
+  parts = g_strsplit (ranges, ",", -1);
 
-  while (haystack[i] != '\0') {
-    if (j == needle_len) {
-      location = (char *) haystack + (i - j);
+  g_mutex_lock (&s->context.mutex);
+  gst_curl_http_src_fetch_reap (s);
+  for (i = 0; parts[i] && n < GSTCURL_RANGES_MAX; i++) {
+    g_strstrip (parts[i]);
+    start = g_ascii_strtoull (parts[i], &end, 10);
+    if (end == parts[i] || *end != '-') {
+      GST_WARNING_OBJECT (s, "Ignoring malformed range '%s'", parts[i]);
+      continue;
     }
-    if (tolower (haystack[i]) == tolower (needle[j])) {
-      j++;
+    stop = g_ascii_strtoull (end + 1, NULL, 10);
+    if (s->content_length > 0)
+      stop = MIN (stop, s->content_length - 1);
+    if (stop < start || stop - start + 1 > GSTCURL_RANGE_CACHE_MAX)
+      continue;
+
+    /* Already announced, or overlapping one that was */
+    for (walk = s->range_cache; walk; walk = walk->next) {
+      chunk = walk->data;
+      if (start < chunk->start + chunk->size && chunk->start <= stop)
+        break;
     }
-    else {
-      j = 0;
+    if (walk)
+      continue;
+
+    /* Make room by dropping the oldest ranges no longer on their way */
+    walk = s->range_cache;
+    while (walk && s->range_cache_size + (stop - start + 1) >
+        GSTCURL_RANGE_CACHE_MAX) {
+      GList *next = walk->next;
+
+      if (((GstCurlHttpSrcChunk *) walk->data)->fetch == NULL)
+        gst_curl_http_src_chunk_free (s, walk);
+      walk = next;
     }
-    i++;
+    if (s->range_cache_size + (stop - start + 1) > GSTCURL_RANGE_CACHE_MAX) {
+      GST_DEBUG_OBJECT (s, "No room for range %s", parts[i]);
+      continue;
+    }
+
+    chunk = g_new0 (GstCurlHttpSrcChunk, 1);
+    chunk->start = start;
+    chunk->size = stop - start + 1;
+    chunk->data = g_malloc (chunk->size);
+    g_mutex_lock (&s->cache_lock);
+    s->range_cache = g_list_append (s->range_cache, chunk);
+    g_mutex_unlock (&s->cache_lock);
+    s->range_cache_size += chunk->size;
+    chunks = g_list_append (chunks, chunk);
+    n++;
   }
 
-  return location;
+  if (chunks && !s->no_multirange) {
+    gst_curl_http_src_fetch_start (s, chunks);
+  } else {
+    for (walk = chunks; walk; walk = walk->next) {
+      GList one = { walk->data, NULL, NULL };
+
+      gst_curl_http_src_fetch_start (s, &one);
+    }
+  }
+  g_mutex_unlock (&s->context.mutex);
+
+  g_list_free (chunks);
+  g_strfreev (parts);
 }
 
 /*
- * Get chunks for currently running curl process.
+ * Serve the start position from the announced ranges. TRUE if it is in one of
+ * them, with a buffer once its data is there.
+ *
+ * must be called with the context lock
  */
-static size_t
-gst_curl_http_src_get_chunks (void *chunk, size_t size, size_t nmemb,
-    void * src)
+static gboolean
+gst_curl_http_src_cache_lookup (GstCurlHttpSrc * s, GstBuffer ** outbuf)
 {
-  GstCurlHttpSrc * s = src;
+  GstCurlHttpSrcChunk *chunk;
   GstBuffer *buf;
-#if GST_CHECK_VERSION(1,0,0)
-  GstMapInfo info;
-#endif
-  size_t len = size * nmemb;
-  guint8 *data;
-
-  GST_TRACE_OBJECT (s,
-      "Received curl chunk for URI %s of size %d", s->uri,
-      (int) (size * nmemb));
-
-  g_mutex_lock (&s->context.mutex);
+  GList *walk;
+  gsize offset, len, filled;
+
+  gst_curl_http_src_fetch_reap (s);
+
+  for (walk = s->range_cache; walk; walk = walk->next) {
+    chunk = walk->data;
+    if (s->start_position < chunk->start ||
+        s->start_position >= chunk->start + chunk->size)
+      continue;
+
+    /* The bytes below it are not written anymore */
+    g_mutex_lock (&s->cache_lock);
+    filled = chunk->filled;
+    g_mutex_unlock (&s->cache_lock);
+
+    offset = s->start_position - chunk->start;
+    if (offset >= filled) {
+      if (chunk->fetch)
+        return TRUE;
+      /* Its request failed, read it the usual way */
+      gst_curl_http_src_chunk_free (s, walk);
+      return FALSE;
+    }
 
-  if (s->context.cancel) {
-    GST_DEBUG_OBJECT (s, "Cancelling the download");
-    g_mutex_unlock (&s->context.mutex);
-    return 0;
+    len = filled - offset;
+    if (s->stop_position != -1)
+      len = MIN (len, s->stop_position - s->start_position);
+    buf = gst_curl_http_src_alloc (s, chunk->data + offset, len);
+    GST_DEBUG_OBJECT (s, "Serving %" G_GSIZE_FORMAT " bytes at %"
+        G_GUINT64_FORMAT " from the announced ranges", len, s->start_position);
+
+    /* The pending seek is done */
+    s->context.cancel = FALSE;
+    s->read_position = s->start_position;
+    gst_curl_http_src_account (s, len);
+    if (offset + len == chunk->size)
+      gst_curl_http_src_chunk_free (s, walk);
+
+    if (s->direct_push)
+      buf = gst_curl_http_src_stamp (s, buf);
+    *outbuf = buf;
+    return TRUE;
   }
 
-  /* increment the positions */
-  if (G_LIKELY (s->start_position == s->read_position))
-    s->start_position += len;
-  s->read_position += len;
+  return FALSE;
+}
 
-  /* pick up the data */
-#if GST_CHECK_VERSION(1,0,0)
-  buf = gst_buffer_new_allocate (NULL, len, NULL);
-  gst_buffer_map (buf, &info, GST_MAP_READWRITE);
-  data = info.data;
-#else
-  buf = gst_buffer_new_and_alloc (len);
-  data = GST_BUFFER_DATA (buf);
+/*
+ * The encoding of a Content-Encoding value.
+ */
+static GstCurlHttpSrcEncoding
+gst_curl_http_src_encoding (const gchar * value)
+{
+  if (g_ascii_strcasecmp (value, "identity") == 0)
+    return GSTCURL_ENCODING_IDENTITY;
+  if (g_ascii_strcasecmp (value, "gzip") == 0 ||
+      g_ascii_strcasecmp (value, "x-gzip") == 0)
+    return GSTCURL_ENCODING_GZIP;
+  if (g_ascii_strcasecmp (value, "deflate") == 0)
+    return GSTCURL_ENCODING_DEFLATE;
+  if (g_ascii_strcasecmp (value, "br") == 0)
+    return GSTCURL_ENCODING_BR;
+  if (g_ascii_strcasecmp (value, "zstd") == 0)
+    return GSTCURL_ENCODING_ZSTD;
+  return GSTCURL_ENCODING_UNKNOWN;
+}
+
+static void
+gst_curl_http_src_decoder_clear (GstCurlHttpSrc * s)
+{
+  switch (s->decoder_encoding) {
+#ifdef HAVE_ZLIB
+    case GSTCURL_ENCODING_GZIP:
+    case GSTCURL_ENCODING_DEFLATE:
+      inflateEnd (&s->zstream);
+      break;
 #endif
-  memcpy (data, chunk, len);
-#if GST_CHECK_VERSION(1,0,0)
-  gst_buffer_unmap (buf, &info);
+#ifdef HAVE_BROTLI
+    case GSTCURL_ENCODING_BR:
+      BrotliDecoderDestroyInstance (s->brotli);
+      s->brotli = NULL;
+      break;
+#endif
+#ifdef HAVE_ZSTD
+    case GSTCURL_ENCODING_ZSTD:
+      ZSTD_freeDStream (s->zstd);
+      s->zstd = NULL;
+      break;
 #endif
+    default:
+      break;
+  }
+  s->decoder_encoding = GSTCURL_ENCODING_IDENTITY;
+}
 
-  gst_adapter_push (s->context.adapter, buf);
-  g_cond_signal (&s->context.signal);
-  g_mutex_unlock (&s->context.mutex);
+static gboolean
+gst_curl_http_src_decoder_init (GstCurlHttpSrc * s,
+    GstCurlHttpSrcEncoding encoding)
+{
+  gst_curl_http_src_decoder_clear (s);
+
+  switch (encoding) {
+#ifdef HAVE_ZLIB
+    case GSTCURL_ENCODING_GZIP:
+    case GSTCURL_ENCODING_DEFLATE:
+      /* zlib or gzip, told apart by their header */
+      memset (&s->zstream, 0, sizeof (s->zstream));
+      if (inflateInit2 (&s->zstream, MAX_WBITS + 32) != Z_OK)
+        return FALSE;
+      s->zstream_raw = FALSE;
+      break;
+#endif
+#ifdef HAVE_BROTLI
+    case GSTCURL_ENCODING_BR:
+      s->brotli = BrotliDecoderCreateInstance (NULL, NULL, NULL);
+      if (s->brotli == NULL)
+        return FALSE;
+      break;
+#endif
+#ifdef HAVE_ZSTD
+    case GSTCURL_ENCODING_ZSTD:
+      s->zstd = ZSTD_createDStream ();
+      if (s->zstd == NULL || ZSTD_isError (ZSTD_initDStream (s->zstd))) {
+        ZSTD_freeDStream (s->zstd);
+        s->zstd = NULL;
+        return FALSE;
+      }
+      break;
+#endif
+    default:
+      GST_ERROR_OBJECT (s, "No decoder for the content encoding of %s",
+          s->uri);
+      return FALSE;
+  }
+  s->decoder_encoding = encoding;
 
-  return len;
+  return TRUE;
 }
 
-/*----------------------------------------------------------------------------*
- *                            The URI interface                               *
- *----------------------------------------------------------------------------*/
-static GstURIType
-#if GST_CHECK_VERSION(1,0,0)
-gst_curl_http_src_uri_handler_get_type (GType type)
-#else
-gst_curl_http_src_uri_handler_get_type (void)
-#endif
+#ifdef HAVE_ZLIB
+static gboolean
+gst_curl_http_src_inflate (GstCurlHttpSrc * s, const guint8 * in, gsize size,
+    GByteArray * out)
 {
-  return GST_URI_SRC;
+  z_stream *zs = &s->zstream;
+  gboolean first = zs->total_in == 0;
+  guint done;
+  gint ret;
+
+  zs->next_in = (Bytef *) in;
+  zs->avail_in = size;
+  do {
+    done = out->len;
+    g_byte_array_set_size (out, done + GSTCURL_DECODE_CHUNK);
+    zs->next_out = out->data + done;
+    zs->avail_out = GSTCURL_DECODE_CHUNK;
+    ret = inflate (zs, Z_NO_FLUSH);
+    g_byte_array_set_size (out, done + GSTCURL_DECODE_CHUNK - zs->avail_out);
+
+    /* Some servers send a raw deflate stream for deflate */
+    if (ret == Z_DATA_ERROR && first && !s->zstream_raw &&
+        s->decoder_encoding == GSTCURL_ENCODING_DEFLATE) {
+      inflateEnd (zs);
+      memset (zs, 0, sizeof (*zs));
+      if (inflateInit2 (zs, -MAX_WBITS) != Z_OK) {
+        s->decoder_encoding = GSTCURL_ENCODING_IDENTITY;
+        return FALSE;
+      }
+      s->zstream_raw = TRUE;
+      zs->next_in = (Bytef *) in;
+      zs->avail_in = size;
+      continue;
+    }
+
+    if (ret == Z_STREAM_END) {
+      /* A gzip body may be several members in a row */
+      if (zs->avail_in == 0 || inflateReset (zs) != Z_OK)
+        break;
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      GST_WARNING_OBJECT (s, "Inflating failed: %s",
+          zs->msg ? zs->msg : "unknown error");
+      return FALSE;
+    }
+  } while (zs->avail_in > 0 || zs->avail_out == 0);
+
+  return TRUE;
 }
+#endif
 
-#if GST_CHECK_VERSION(1,0,0)
-static const gchar *const *
-gst_curl_http_src_uri_handler_get_protocols (GType type)
+#ifdef HAVE_BROTLI
+static gboolean
+gst_curl_http_src_unbrotli (GstCurlHttpSrc * s, const guint8 * in, gsize size,
+    GByteArray * out)
 {
-  static const gchar *protocols[] = { PROTOCOLS, NULL };
+  BrotliDecoderResult ret;
+  const uint8_t *next_in = in;
+  size_t avail_in = size, avail_out;
+  uint8_t *next_out;
+  guint done;
+
+  do {
+    done = out->len;
+    g_byte_array_set_size (out, done + GSTCURL_DECODE_CHUNK);
+    next_out = out->data + done;
+    avail_out = GSTCURL_DECODE_CHUNK;
+    ret = BrotliDecoderDecompressStream (s->brotli, &avail_in, &next_in,
+        &avail_out, &next_out, NULL);
+    g_byte_array_set_size (out, done + GSTCURL_DECODE_CHUNK - avail_out);
+    if (ret == BROTLI_DECODER_RESULT_ERROR) {
+      GST_WARNING_OBJECT (s, "Brotli decoding failed: %s",
+          BrotliDecoderErrorString (BrotliDecoderGetErrorCode (s->brotli)));
+      return FALSE;
+    }
+  } while (ret == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT);
 
-  return protocols;
+  return TRUE;
 }
+#endif
 
-#else
-static gchar **
-gst_curl_http_src_uri_handler_get_protocols (void)
+#ifdef HAVE_ZSTD
+static gboolean
+gst_curl_http_src_unzstd (GstCurlHttpSrc * s, const guint8 * in, gsize size,
+    GByteArray * out)
 {
-  static gchar *protocols[] = { PROTOCOLS, NULL };
+  ZSTD_inBuffer input = { in, size, 0 };
+  ZSTD_outBuffer output;
+  size_t ret;
+  guint done;
+
+  do {
+    done = out->len;
+    g_byte_array_set_size (out, done + GSTCURL_DECODE_CHUNK);
+    output.dst = out->data + done;
+    output.size = GSTCURL_DECODE_CHUNK;
+    output.pos = 0;
+    ret = ZSTD_decompressStream (s->zstd, &output, &input);
+    g_byte_array_set_size (out, done + output.pos);
+    if (ZSTD_isError (ret)) {
+      GST_WARNING_OBJECT (s, "Zstandard decoding failed: %s",
+          ZSTD_getErrorName (ret));
+      return FALSE;
+    }
+  } while (input.pos < input.size || output.pos == output.size);
 
-  return protocols;
+  return TRUE;
 }
 #endif
 
+/*
+ * Decode a buffer of the body on the streaming thread, taking it. Returns NULL
+ * when it gave nothing yet, or on error with decode_error set.
+ *
+ * must be called from the streaming thread, without the context lock
+ */
+static GstBuffer *
+gst_curl_http_src_decode (GstCurlHttpSrc * s, GstCurlHttpSrcEncoding encoding,
+    GstBuffer * buf)
+{
+  GByteArray *out;
+  const guint8 *in;
+  gsize size;
+  gboolean ok = FALSE;
+  guint len;
 #if GST_CHECK_VERSION(1,0,0)
-static gchar *
+  GstMapInfo map;
+#endif
+
+  if (s->decoder_encoding != encoding &&
+      !gst_curl_http_src_decoder_init (s, encoding)) {
+    gst_buffer_unref (buf);
+    s->decode_error = TRUE;
+    return NULL;
+  }
+
+#if GST_CHECK_VERSION(1,0,0)
+  gst_buffer_map (buf, &map, GST_MAP_READ);
+  in = map.data;
+  size = map.size;
 #else
-static const gchar *
+  in = GST_BUFFER_DATA (buf);
+  size = GST_BUFFER_SIZE (buf);
 #endif
-gst_curl_http_src_uri_handler_get_uri (GstURIHandler * handler)
-{
-  gchar* ret;
-  GstCurlHttpSrc *source;
 
-  g_return_val_if_fail (GST_IS_URI_HANDLER (handler), FALSE);
-  source = GST_CURLHTTPSRC (handler);
+  out = g_byte_array_new ();
+  switch (s->decoder_encoding) {
+#ifdef HAVE_ZLIB
+    case GSTCURL_ENCODING_GZIP:
+    case GSTCURL_ENCODING_DEFLATE:
+      ok = gst_curl_http_src_inflate (s, in, size, out);
+      break;
+#endif
+#ifdef HAVE_BROTLI
+    case GSTCURL_ENCODING_BR:
+      ok = gst_curl_http_src_unbrotli (s, in, size, out);
+      break;
+#endif
+#ifdef HAVE_ZSTD
+    case GSTCURL_ENCODING_ZSTD:
+      ok = gst_curl_http_src_unzstd (s, in, size, out);
+      break;
+#endif
+    default:
+      break;
+  }
 
-  GSTCURL_FUNCTION_ENTRY (source);
+#if GST_CHECK_VERSION(1,0,0)
+  gst_buffer_unmap (buf, &map);
+#endif
+  gst_buffer_unref (buf);
+
+  if (!ok || out->len == 0) {
+    s->decode_error = !ok;
+    g_byte_array_free (out, TRUE);
+    return NULL;
+  }
 
-  g_mutex_lock(source->uri_mutex);
+  len = out->len;
 #if GST_CHECK_VERSION(1,0,0)
-  ret = g_strdup (source->uri);
+  buf = gst_buffer_new_wrapped (g_byte_array_free (out, FALSE), len);
 #else
-  ret = source->uri;
+  buf = gst_buffer_new ();
+  GST_BUFFER_MALLOCDATA (buf) = g_byte_array_free (out, FALSE);
+  GST_BUFFER_DATA (buf) = GST_BUFFER_MALLOCDATA (buf);
+  GST_BUFFER_SIZE (buf) = len;
 #endif
-  g_mutex_unlock(source->uri_mutex);
 
-  GSTCURL_FUNCTION_EXIT (source);
-  return ret;
+  return buf;
 }
 
+/*
+ * Wait with an exponential backoff before resuming a failed transfer. Returns
+ * FALSE if no retry must be done, either because they are exhausted, the
+ * error is not recoverable or the element has been cancelled meanwhile.
+ *
+ * must be called with the context lock
+ */
 static gboolean
-#if GST_CHECK_VERSION(1,0,0)
-gst_curl_http_src_uri_handler_set_uri (GstURIHandler * handler,
-    const gchar * uri, GError ** error)
-#else
-gst_curl_http_src_uri_handler_set_uri (GstURIHandler * handler,
-    const gchar * uri)
-#endif
+gst_curl_http_src_wait_retry (GstCurlHttpSrc * src)
 {
-  GstCurlHttpSrc *source = GST_CURLHTTPSRC (handler);
-  GSTCURL_FUNCTION_ENTRY (source);
-
-  g_return_val_if_fail (GST_IS_URI_HANDLER (handler), FALSE);
-  g_return_val_if_fail (uri != NULL, FALSE);
-
-  g_mutex_lock(source->uri_mutex);
-
-  if (source->uri != NULL) {
-    GST_DEBUG_OBJECT (source,
-        "URI already present as %s, updating to new URI %s", source->uri, uri);
-    g_free (source->uri);
-  }
+  gint64 end_time;
+  guint delay;
 
-  source->uri = g_strdup (uri);
-  if (source->uri == NULL) {
+  if (src->retries_remaining == 0 || !gst_curl_http_src_is_retryable (src))
     return FALSE;
-  }
-
-  g_mutex_unlock(source->uri_mutex);
-
-  GSTCURL_FUNCTION_EXIT (source);
-  return TRUE;
-}
 
-static void
-gst_curl_http_src_uri_handler_init (gpointer g_iface, gpointer iface_data)
-{
-  GstURIHandlerInterface *uri_iface = (GstURIHandlerInterface *) g_iface;
+  if (src->retries_remaining > 0)
+    src->retries_remaining--;
 
-  uri_iface->get_type = gst_curl_http_src_uri_handler_get_type;
-  uri_iface->get_protocols = gst_curl_http_src_uri_handler_get_protocols;
-  uri_iface->get_uri = gst_curl_http_src_uri_handler_get_uri;
-  uri_iface->set_uri = gst_curl_http_src_uri_handler_set_uri;
-}
+  delay = GSTCURL_RETRY_BACKOFF_MIN_MS << MIN (src->retry_attempt, 8);
+  delay = MIN (delay, GSTCURL_RETRY_BACKOFF_MAX_MS);
+  src->retry_attempt++;
+  src->retry_progress = 0;
 
-/*----------------------------------------------------------------------------*
- *                              The src class                                 *
- *----------------------------------------------------------------------------*/
-#if !GST_CHECK_VERSION(1,0,0)
+  GST_WARNING_OBJECT (src, "Transfer for URI %s failed (%s, response %ld), "
+      "resuming at %" G_GUINT64_FORMAT " in %u ms, %d retries left", src->uri,
+      curl_easy_strerror (src->context.curl_code), src->context.response_code,
+      src->read_position, delay, src->retries_remaining);
 
-static gboolean
-gst_curl_http_src_interface_supported (GstImplementsInterface * iface, GType type)
-{
-  if (type == GST_TYPE_URI_HANDLER)
-    return TRUE;
-  else
-    return FALSE;
-}
+  end_time = g_get_monotonic_time () + delay * G_TIME_SPAN_MILLISECOND;
+  while (!src->context.cancel) {
+    if (!g_cond_wait_until (&src->context.signal, &src->context.mutex,
+            end_time))
+      break;
+  }
 
-static void
-gst_curl_http_src_interface_init (GstImplementsInterfaceClass * klass)
-{
-  klass->supported = gst_curl_http_src_interface_supported;
+  return !src->context.cancel;
 }
-#endif
 
-/*----------------------------------------------------------------------------*
- *                        The GstPushSrc interface                            *
- *----------------------------------------------------------------------------*/
 static GstFlowReturn
 gst_curl_http_src_create (GstPushSrc * psrc, GstBuffer ** outbuf)
 {
   GstCurlHttpSrc *src = GST_CURLHTTPSRC (psrc);
   GstCurlHttpSrcClass *klass;
   GstFlowReturn ret = GST_FLOW_OK;
+  GstBuffer *buf;
+  gboolean caps_pending;
 
   klass = G_TYPE_INSTANCE_GET_CLASS (src, GST_TYPE_CURL_HTTP_SRC,
                                      GstCurlHttpSrcClass);
@@ -795,18 +3656,92 @@ gst_curl_http_src_create (GstPushSrc * psrc, GstBuffer ** outbuf)
   g_mutex_lock (&src->context.mutex);
 
 start:
+  /* Nothing left of the segment, no need to ask for it */
+  if (!src->context.easy_handle && src->stop_position != -1 &&
+      src->start_position >= src->stop_position) {
+    GST_DEBUG_OBJECT (src, "Segment end reached for URI %s.", src->uri);
+    ret = GST_FLOW_EOS;
+    goto done;
+  }
+
+  /* Announced ranges are served without a request of their own */
+  if (!src->context.easy_handle && src->range_cache) {
+    guint cookie;
+
+    buf = NULL;
+    while (TRUE) {
+      g_mutex_lock (&src->cache_lock);
+      cookie = src->cache_cookie;
+      g_mutex_unlock (&src->cache_lock);
+      if (!gst_curl_http_src_cache_lookup (src, &buf) || buf != NULL)
+        break;
+
+      /* Until more of it came in or its request ended */
+      g_mutex_unlock (&src->context.mutex);
+      g_mutex_lock (&src->cache_lock);
+      while (src->cache_cookie == cookie)
+        g_cond_wait (&src->cache_signal, &src->cache_lock);
+      g_mutex_unlock (&src->cache_lock);
+      g_mutex_lock (&src->context.mutex);
+    }
+    if (buf != NULL) {
+      *outbuf = buf;
+      goto done;
+    }
+  }
+
   /* create the handle if we dont have one already */
   if (!src->context.easy_handle) {
+    /* A resume goes on with the same encoded stream */
+    if (!src->resuming)
+      gst_curl_http_src_decoder_clear (src);
+    src->decode_error = FALSE;
+    if (src->stalled)
+      gst_curl_http_src_resolve_alternate (src);
     src->context.easy_handle = gst_curl_http_src_create_easy_handle (src);
     gst_curl_multi_context_add_source (&klass->multi_task_context, src->context.easy_handle);
   }
 
-  /* check that we have data or we have finished */
-  while (!gst_adapter_available_fast (src->context.adapter) && !src->context.done) {
-    g_cond_wait (&src->context.signal, &src->context.mutex);
+wait:
+  if (src->direct_push && gst_curl_http_src_output_size (src) == 0 &&
+      !gst_adapter_available_fast (src->context.adapter)) {
+    /* Straight from the worker, one buffer per wakeup */
+    buf = gst_curl_http_src_pop (src);
+    while (buf == NULL && !src->context.done
+        && !src->context.deadline_missed) {
+      gst_curl_multi_context_source_wait (&src->context);
+      buf = gst_curl_http_src_pop (src);
+    }
+    if (buf != NULL) {
+      if (!src->context.cancel) {
+        *outbuf = buf;
+        goto done;
+      }
+      gst_buffer_unref (buf);
+      goto wait;
+    }
+  } else {
+    /* check that we have a full buffer or we have finished */
+    gst_curl_http_src_fill (src);
+  }
+
+  if (G_UNLIKELY (src->decode_error)) {
+    GST_ERROR_OBJECT (src, "Cannot decode the body of %s", src->uri);
+    src->context.cancel = TRUE;
+    gst_curl_multi_context_remove_source (&klass->multi_task_context,
+        &src->context);
+    ret = GST_FLOW_ERROR;
+    goto done;
+  }
+
+  if (G_UNLIKELY (src->context.deadline_missed)) {
+    gst_curl_http_src_post_deadline_miss (src);
+    goto wait;
   }
 
+check:
   if (src->context.done) {
+    gst_curl_http_src_whole_flush (src);
 
     /* If the task has been cancelled return unless a seek was performed */
     if (src->context.cancel) {
@@ -827,23 +3762,71 @@ start:
       goto done;
     }
 
+    /* Closed by us once the requested range was in, not a failure */
+    if (src->context.status == GST_CURL_MULTI_CONTEXT_SOURCE_STATUS_ERROR &&
+        src->range_complete) {
+      GST_DEBUG_OBJECT (src, "Range complete for URI %s.", src->uri);
+      src->context.status = GST_CURL_MULTI_CONTEXT_SOURCE_STATUS_OK;
+    }
+
     if (src->context.status == GST_CURL_MULTI_CONTEXT_SOURCE_STATUS_ERROR) {
+      /*
+       * Whatever arrived before the failure is still good, push it first.
+       * Unless it is not the entity but the body of an error response.
+       */
+      if (src->context.response_code != 0 &&
+          !GSTCURL_SUCCESS_RESPONSE (src->context.response_code)) {
+        gst_adapter_clear (src->context.adapter);
+      } else if (gst_adapter_available_fast (src->context.adapter)) {
+        *outbuf = gst_curl_http_src_take (src);
+        goto done;
+      }
+
       GST_DEBUG_OBJECT (src, "Error received for URI %s.", src->uri);
       src->context.done = FALSE;
+      gst_curl_http_src_probe_forget (src);
 
       curl_easy_cleanup (src->context.easy_handle);
       src->context.easy_handle = NULL;
 
+      /* Dropped while we kept it paused, not a failure of the server */
+      if (g_atomic_int_get (&src->context.suspended) &&
+          gst_curl_http_src_is_retryable (src)) {
+        GST_INFO_OBJECT (src, "Connection lost while paused, reissuing at %"
+            G_GUINT64_FORMAT, src->read_position);
+        g_atomic_int_set (&src->context.suspended, 0);
+        src->start_position = src->read_position;
+        src->resuming = src->start_position > 0;
+        src->resume_length = src->content_length;
+        goto start;
+      }
+
+      if (gst_curl_http_src_wait_retry (src)) {
+        /* Continue exactly where the adapter was fed up to */
+        src->start_position = src->read_position;
+        src->resuming = src->start_position > 0;
+        src->resume_length = src->content_length;
+        gst_curl_http_src_next_location (src);
+        goto start;
+      }
+
+      if (src->context.cancel) {
+        /* Interrupted while waiting, handle it like any other cancel */
+        src->context.done = TRUE;
+        goto check;
+      }
+
       ret = GST_FLOW_ERROR;
     } else if (src->context.status == GST_CURL_MULTI_CONTEXT_SOURCE_STATUS_OK) {
       /* It is possible that the handle is done and we have data */
       if (gst_adapter_available_fast (src->context.adapter)) {
-        *outbuf = gst_adapter_take_buffer (src->context.adapter,
-          gst_adapter_available (src->context.adapter));
+        *outbuf = gst_curl_http_src_take (src);
       } else {
         GST_DEBUG_OBJECT (src, "Full body received, signalling EOS for URI %s.",
             src->uri);
         src->context.done = FALSE;
+        src->retry_attempt = 0;
+        src->retries_remaining = src->total_retries;
 
         curl_easy_cleanup (src->context.easy_handle);
         src->context.easy_handle = NULL;
@@ -851,13 +3834,23 @@ start:
       }
     }
   } else {
-    *outbuf = gst_adapter_take_buffer (src->context.adapter,
-        gst_adapter_available (src->context.adapter));
+    *outbuf = gst_curl_http_src_take (src);
   }
 
 done:
+  g_atomic_int_set (&src->adapter_level,
+      gst_adapter_available (src->context.adapter));
+  caps_pending = ret == GST_FLOW_OK && *outbuf && src->caps_pending;
+  if (caps_pending)
+    src->caps_pending = FALSE;
   g_mutex_unlock (&src->context.mutex);
 
+  if (caps_pending)
+    gst_curl_http_src_negotiate_caps (src);
+
+  if (ret == GST_FLOW_OK && *outbuf)
+    gst_curl_http_src_buffering_update (src, 0, GSTCURL_BUFFER_SIZE (*outbuf));
+
   GSTCURL_FUNCTION_EXIT (src);
 
   return ret;
@@ -871,31 +3864,38 @@ static gboolean gst_curl_http_src_is_seekable (GstBaseSrc * bsrc)
   GstCurlHttpSrc *src;
 
   src = GST_CURLHTTPSRC (bsrc);
-  if (src->content_length > 0) {
-    return TRUE;
-  } else {
+  gst_curl_http_src_probe_wait (src);
+  if (src->no_ranges || src->entity_encoded)
     return FALSE;
-  }
+
+  /* Before the first response a range can be asked for all the same */
+  return src->content_length > 0 || !src->have_response;
 }
 
 static gboolean gst_curl_http_src_do_seek (GstBaseSrc * bsrc,
     GstSegment * segment)
 {
   GstCurlHttpSrc *src;
+  GstCurlHttpSrcClass *klass;
 
   src = GST_CURLHTTPSRC (bsrc);
+  klass = G_TYPE_INSTANCE_GET_CLASS (src, GST_TYPE_CURL_HTTP_SRC,
+                                     GstCurlHttpSrcClass);
 
   GST_DEBUG_OBJECT (src, "do_seek(%" G_GUINT64_FORMAT ")", segment->start);
 
   g_mutex_lock (&src->context.mutex);
   if (src->read_position == segment->start &&
-      src->start_position == segment->start) {
+      src->start_position == segment->start &&
+      src->stop_position == (guint64) segment->stop) {
     GST_DEBUG_OBJECT (src, "Seek to current position and no seek pending");
     g_mutex_unlock (&src->context.mutex);
     return TRUE;
   }
 
-  if (src->content_length <= 0) {
+  /* Without a size yet, the range is asked for as is */
+  if ((src->content_length == 0 && (src->have_response || src->no_ranges)) ||
+      src->entity_encoded) {
     GST_WARNING_OBJECT (src, "Not seekable");
     g_mutex_unlock (&src->context.mutex);
     return FALSE;
@@ -907,17 +3907,128 @@ static gboolean gst_curl_http_src_do_seek (GstBaseSrc * bsrc,
     return FALSE;
   }
 
-  if (segment->start >= src->content_length) {
+  if (src->content_length > 0 && segment->start >= src->content_length) {
     GST_WARNING_OBJECT (src, "Seeking behind end of file, will go to EOS soon");
   }
 
   src->start_position = segment->start;
   src->stop_position = segment->stop;
   src->context.cancel = TRUE;
+  if (src->context.easy_handle)
+    gst_curl_multi_context_remove_source (&klass->multi_task_context,
+        &src->context);
+  g_cond_signal (&src->context.signal);
+  g_mutex_unlock (&src->context.mutex);
+
+  return TRUE;
+}
+
+/*
+ * Answer from what sits between the network and downstream: the range is from
+ * the next byte to push to the last one received.
+ */
+static gboolean
+gst_curl_http_src_query_buffering (GstCurlHttpSrc * src, GstQuery * query)
+{
+  GstFormat format;
+  gint64 start, stop, left, total = -1;
+  gint percent, avg_in, avg_out;
+
+  g_mutex_lock (&src->context.mutex);
+  start = src->read_position - gst_adapter_available (src->context.adapter);
+  stop = src->read_position +
+      gst_curl_multi_context_source_level (&src->context);
   g_mutex_unlock (&src->context.mutex);
 
+  GST_OBJECT_LOCK (src);
+  percent = gst_curl_http_src_buffering_level (src, &left);
+  avg_in = (gint) src->avg_in;
+  avg_out = (gint) src->avg_out;
+  if (src->content_length > 0 && src->avg_in > 0)
+    total = (gint64) ((src->content_length - MIN (stop,
+                (gint64) src->content_length)) * 1000 / src->avg_in);
+  GST_OBJECT_UNLOCK (src);
+
+  gst_query_set_buffering_percent (query, percent < 100, percent);
+  gst_query_set_buffering_stats (query, GST_BUFFERING_STREAM, avg_in,
+      avg_out, left);
+
+  gst_query_parse_buffering_range (query, &format, NULL, NULL, NULL);
+  if (format == GST_FORMAT_PERCENT && src->content_length > 0) {
+    start = gst_util_uint64_scale (start, GST_FORMAT_PERCENT_MAX,
+        src->content_length);
+    stop = gst_util_uint64_scale (stop, GST_FORMAT_PERCENT_MAX,
+        src->content_length);
+  } else {
+    format = GST_FORMAT_BYTES;
+  }
+  gst_query_set_buffering_range (query, format, start, stop, total);
+
+  return TRUE;
+}
+
+#if GST_CHECK_VERSION(1,0,0)
+/*
+ * Fill the buffers from the pool or allocator downstream proposed, so the
+ * data is copied once, straight into its final memory. The pool the base
+ * class makes up on its own is no better than a plain allocation.
+ */
+static gboolean
+gst_curl_http_src_decide_allocation (GstBaseSrc * bsrc, GstQuery * query)
+{
+  GstCurlHttpSrc *src = GST_CURLHTTPSRC (bsrc);
+  GstBufferPool *pool = NULL, *old_pool;
+  GstAllocator *allocator = NULL, *old_allocator;
+  GstAllocationParams params;
+  GstStructure *config;
+  gboolean has_pool = FALSE, has_allocator;
+  guint size = 0;
+
+  if (gst_query_get_n_allocation_pools (query) > 0) {
+    gst_query_parse_nth_allocation_pool (query, 0, &pool, NULL, NULL, NULL);
+    if (pool) {
+      has_pool = TRUE;
+      gst_object_unref (pool);
+      pool = NULL;
+    }
+  }
+  has_allocator = gst_query_get_n_allocation_params (query) > 0;
+
+  if (!GST_BASE_SRC_CLASS (parent_class)->decide_allocation (bsrc, query))
+    return FALSE;
+
+  gst_allocation_params_init (&params);
+  if (has_allocator)
+    gst_base_src_get_allocator (bsrc, &allocator, &params);
+  if (has_pool) {
+    pool = gst_base_src_get_buffer_pool (bsrc);
+    if (pool) {
+      config = gst_buffer_pool_get_config (pool);
+      gst_buffer_pool_config_get_params (config, NULL, &size, NULL, NULL);
+      gst_structure_free (config);
+    }
+  }
+
+  GST_DEBUG_OBJECT (src, "Downstream pool %" GST_PTR_FORMAT " of %u bytes, "
+      "allocator %" GST_PTR_FORMAT, pool, size, allocator);
+
+  GST_OBJECT_LOCK (src);
+  old_pool = src->pool;
+  old_allocator = src->allocator;
+  src->pool = pool;
+  src->pool_size = size;
+  src->allocator = allocator;
+  src->alloc_params = params;
+  GST_OBJECT_UNLOCK (src);
+
+  if (old_pool)
+    gst_object_unref (old_pool);
+  if (old_allocator)
+    gst_object_unref (old_allocator);
+
   return TRUE;
 }
+#endif
 
 static gboolean
 gst_curl_http_src_query (GstBaseSrc * bsrc, GstQuery * query)
@@ -936,6 +4047,13 @@ gst_curl_http_src_query (GstBaseSrc * bsrc, GstQuery * query)
 #endif
       ret = TRUE;
       break;
+    case GST_QUERY_BUFFERING:
+      if (!src->use_buffering) {
+        ret = GST_BASE_SRC_CLASS (parent_class)->query (bsrc, query);
+        break;
+      }
+      ret = gst_curl_http_src_query_buffering (src, query);
+      break;
     default:
       ret = GST_BASE_SRC_CLASS (parent_class)->query (bsrc, query);
       break;
@@ -945,11 +4063,63 @@ gst_curl_http_src_query (GstBaseSrc * bsrc, GstQuery * query)
   return ret;
 }
 
+/*
+ * A "curlhttpsrc-deadline" custom upstream event sets the deadline in ms from
+ * now of the running request, or of the next one if there is none. A
+ * "curlhttpsrc-ranges" one announces the ranges about to be read.
+ */
+static gboolean
+gst_curl_http_src_event (GstBaseSrc * bsrc, GstEvent * event)
+{
+  GstCurlHttpSrc *src = GST_CURLHTTPSRC (bsrc);
+  GstCurlHttpSrcClass *klass;
+  const GstStructure *s;
+  const gchar *ranges;
+  gint64 deadline = 0;
+  gboolean running;
+  guint ms;
+
+  if (GST_EVENT_TYPE (event) != GST_EVENT_CUSTOM_UPSTREAM)
+    return GST_BASE_SRC_CLASS (parent_class)->event (bsrc, event);
+
+  s = gst_event_get_structure (event);
+  if (s != NULL && gst_structure_has_name (s, "curlhttpsrc-ranges") &&
+      (ranges = gst_structure_get_string (s, "ranges")) != NULL) {
+    GST_DEBUG_OBJECT (src, "Got ranges %s", ranges);
+    gst_curl_http_src_prefetch (src, ranges);
+    return TRUE;
+  }
+
+  if (s == NULL || !gst_structure_has_name (s, "curlhttpsrc-deadline") ||
+      !gst_structure_get_uint (s, "deadline", &ms))
+    return GST_BASE_SRC_CLASS (parent_class)->event (bsrc, event);
+
+  if (ms)
+    deadline = g_get_monotonic_time () + ms * G_TIME_SPAN_MILLISECOND;
+  GST_DEBUG_OBJECT (src, "Got a deadline in %u ms", ms);
+
+  g_mutex_lock (&src->context.mutex);
+  running = src->context.easy_handle != NULL && !src->context.done;
+  if (!running)
+    src->pending_deadline = deadline;
+  g_mutex_unlock (&src->context.mutex);
+
+  if (running) {
+    klass = G_TYPE_INSTANCE_GET_CLASS (src, GST_TYPE_CURL_HTTP_SRC,
+                                       GstCurlHttpSrcClass);
+    gst_curl_multi_context_set_deadline (&klass->multi_task_context,
+        &src->context, deadline);
+  }
+
+  return TRUE;
+}
+
 static gboolean
 gst_curl_http_src_get_content_length (GstBaseSrc * bsrc, guint64 * size)
 {
   GstCurlHttpSrc *src = GST_CURLHTTPSRC (bsrc);
 
+  gst_curl_http_src_probe_wait (src);
   if (src->content_length > 0) {
     *size = src->content_length;
     GST_DEBUG_OBJECT (src,
@@ -980,17 +4150,41 @@ gst_curl_http_src_change_state (GstElement * element, GstStateChange transition)
   switch (transition) {
     case GST_STATE_CHANGE_NULL_TO_READY:
       gst_curl_multi_context_ref (&klass->multi_task_context);
+      gst_curl_http_src_sessions_load (source);
       break;
     case GST_STATE_CHANGE_READY_TO_NULL:
       /* The pipeline has ended, so signal any running request to end. */
       gst_curl_multi_context_unref (&klass->multi_task_context);
       break;
+    case GST_STATE_CHANGE_READY_TO_PAUSED:
+      /* Answered by the time the size is asked for, at best */
+      gst_curl_http_src_probe_start (source);
+      break;
+    case GST_STATE_CHANGE_PLAYING_TO_PAUSED:
+      /* Only what is needed to play again right away is downloaded */
+      if (source->paused_lookahead >= 0) {
+        source->context.suspend_lookahead = source->paused_lookahead;
+        g_atomic_int_set (&source->context.suspend, 1);
+      }
+      break;
+    case GST_STATE_CHANGE_PAUSED_TO_PLAYING:
+      /* The worker resumes the transfer on its next round */
+      g_atomic_int_set (&source->context.suspend, 0);
+      break;
     case GST_STATE_CHANGE_PAUSED_TO_READY:
+      g_atomic_int_set (&source->context.suspend, 0);
+      gst_curl_http_src_fetch_cancel (source);
       g_mutex_lock (&source->context.mutex);
       source->context.cancel = TRUE;
+      if (source->context.easy_handle)
+        gst_curl_multi_context_remove_source (&klass->multi_task_context,
+            &source->context);
+      g_cond_signal (&source->context.signal);
       /* reset the element */
       gst_curl_http_src_reset (source);
       g_mutex_unlock (&source->context.mutex);
+      /* For the next run of the process to resume them */
+      gst_curl_http_src_sessions_save (source);
       break;
     default:
       break;
@@ -1020,6 +4214,26 @@ gst_curl_http_src_set_property (GObject * object, guint prop_id,
         g_free (source->uri);
       }
       source->uri = g_value_dup_string (value);
+      source->location_index = 0;
+      source->raced = FALSE;
+      break;
+    case PROP_MIRRORS:
+      g_mutex_lock (source->uri_mutex);
+      g_strfreev (source->mirrors);
+      source->mirrors = g_strdupv (g_value_get_boxed (value));
+      if (source->mirrors != NULL) {
+        source->n_mirrors = g_strv_length (source->mirrors);
+        /* The first request is raced on one handle per location */
+        if (source->n_mirrors >= GST_CURL_MULTI_CONTEXT_MAX_LEGS)
+          GST_WARNING_OBJECT (source, "Only %d of the %u locations are raced, "
+              "the others are only failed over to",
+              GST_CURL_MULTI_CONTEXT_MAX_LEGS, source->n_mirrors + 1);
+      } else {
+        source->n_mirrors = 0;
+      }
+      source->location_index = 0;
+      source->raced = FALSE;
+      g_mutex_unlock (source->uri_mutex);
       break;
     case PROP_USERNAME:
       if (source->username != NULL) {
@@ -1094,6 +4308,7 @@ gst_curl_http_src_set_property (GObject * object, guint prop_id,
       break;
     case PROP_RETRIES:
       source->total_retries = g_value_get_int (value);
+      source->retries_remaining = source->total_retries;
       break;
     case PROP_CONNECTIONMAXTIME:
       source->max_connection_time = g_value_get_uint (value);
@@ -1107,6 +4322,123 @@ gst_curl_http_src_set_property (GObject * object, guint prop_id,
     case PROP_MAXCONCURRENT_GLOBAL:
       source->max_conns_global = g_value_get_uint (value);
       break;
+    case PROP_LOW_SPEED_LIMIT:
+      source->low_speed_limit = g_value_get_uint (value);
+      break;
+    case PROP_LOW_SPEED_TIME:
+      source->low_speed_time = g_value_get_uint (value);
+      break;
+    case PROP_HEDGE_PERCENTILE:
+      source->hedge_percentile = g_value_get_uint (value);
+      break;
+    case PROP_HEDGE_MAX_RATE:
+      source->hedge_max_rate = g_value_get_double (value);
+      break;
+    case PROP_MAX_BITRATE:
+      source->max_bitrate = g_value_get_uint64 (value);
+      break;
+    case PROP_SHARED_MAX_BITRATE:
+      {
+        GstCurlHttpSrcClass *klass = G_TYPE_INSTANCE_GET_CLASS (source,
+            GST_TYPE_CURL_HTTP_SRC, GstCurlHttpSrcClass);
+
+        gst_curl_multi_context_set_max_rate (&klass->multi_task_context,
+            g_value_get_uint64 (value) / 8);
+      }
+      break;
+    case PROP_BANDWIDTH_WEIGHT:
+      source->bandwidth_weight = g_value_get_uint (value);
+      break;
+    case PROP_DEADLINE:
+      source->deadline = g_value_get_uint (value);
+      break;
+    case PROP_COALESCE:
+      source->coalesce = g_value_get_boolean (value);
+      break;
+    case PROP_DIRECT_PUSH:
+      source->direct_push = g_value_get_boolean (value);
+      break;
+    case PROP_MIN_OUTPUT_SIZE:
+      source->min_output_size = g_value_get_int (value);
+      break;
+    case PROP_MAX_OUTPUT_LATENCY:
+      source->max_output_latency = g_value_get_uint (value);
+      break;
+    case PROP_SPILL_THRESHOLD:
+      source->spill_threshold = g_value_get_uint (value);
+      break;
+    case PROP_SPILL_MAX_SIZE:
+      source->spill_max_size = g_value_get_uint (value);
+      break;
+    case PROP_USE_BUFFERING:
+      source->use_buffering = g_value_get_boolean (value);
+      break;
+    case PROP_BUFFER_SIZE:
+      source->buffer_size = g_value_get_uint (value);
+      break;
+    case PROP_PAUSED_LOOKAHEAD:
+      source->paused_lookahead = g_value_get_int (value);
+      break;
+    case PROP_PROBE_TIMEOUT:
+      source->probe_timeout = g_value_get_uint (value);
+      break;
+    case PROP_TRUST_CONTENT_TYPE:
+      source->trust_content_type = g_value_get_boolean (value);
+      break;
+    case PROP_DECODE_OFFLOAD:
+      source->decode_offload = g_value_get_boolean (value);
+#ifndef HAVE_ZLIB
+      /* gzip and deflate must be announced, curl decodes them instead */
+      if (source->decode_offload) {
+        GST_WARNING_OBJECT (source, "Built without zlib, curl decodes");
+        source->decode_offload = FALSE;
+      }
+#endif
+      break;
+    case PROP_TLS_SESSION_FILE:
+      g_free (source->tls_session_file);
+      source->tls_session_file = g_value_dup_string (value);
+      break;
+    case PROP_SSL_CA_DATA:
+      g_free (source->custom_ca_data);
+      source->custom_ca_data = g_value_dup_string (value);
+      break;
+    case PROP_CA_CACHE_TIMEOUT:
+      source->ca_cache_timeout = g_value_get_int (value);
+      break;
+    case PROP_CURL_BUFFER_SIZE:
+      source->curl_buffer_size = g_value_get_int (value);
+      break;
+    case PROP_TCP_NODELAY:
+      source->tcp_nodelay = g_value_get_boolean (value);
+      break;
+    case PROP_TCP_FASTOPEN:
+      source->tcp_fastopen = g_value_get_boolean (value);
+      break;
+    case PROP_SOCKET_RCVBUF:
+      source->socket_rcvbuf = g_value_get_int (value);
+      break;
+    case PROP_UNIX_SOCKET_PATH:
+      g_free (source->unix_socket_path);
+      source->unix_socket_path = g_value_dup_string (value);
+      break;
+    case PROP_UNIX_SOCKET_MAP:
+      g_strfreev (source->unix_socket_map);
+      source->unix_socket_map = g_strdupv (g_value_get_boxed (value));
+      break;
+    case PROP_PREFETCH_RANGES:
+      g_free (source->prefetch_ranges);
+      source->prefetch_ranges = g_value_dup_string (value);
+      if (source->prefetch_ranges == NULL)
+        break;
+      if (GST_STATE (source) >= GST_STATE_READY) {
+        GST_DEBUG_OBJECT (source, "Prefetching %s", source->prefetch_ranges);
+        gst_curl_http_src_prefetch (source, source->prefetch_ranges);
+      } else {
+        GST_WARNING_OBJECT (source, "Ranges announced before the element "
+            "started are not fetched");
+      }
+      break;
     case PROP_HTTPVERSION:
       f = g_value_get_float (value);
       if (f == 1.0) {
@@ -1139,6 +4471,9 @@ gst_curl_http_src_get_property (GObject * object, guint prop_id,
     case PROP_URI:
       g_value_set_string (value, source->uri);
       break;
+    case PROP_MIRRORS:
+      g_value_set_boxed (value, source->mirrors);
+      break;
     case PROP_USERNAME:
       g_value_set_string (value, source->username);
       break;
@@ -1199,6 +4534,120 @@ gst_curl_http_src_get_property (GObject * object, guint prop_id,
     case PROP_MAXCONCURRENT_GLOBAL:
       g_value_set_uint (value, source->max_conns_global);
       break;
+    case PROP_LOW_SPEED_LIMIT:
+      g_value_set_uint (value, source->low_speed_limit);
+      break;
+    case PROP_LOW_SPEED_TIME:
+      g_value_set_uint (value, source->low_speed_time);
+      break;
+    case PROP_HEDGE_PERCENTILE:
+      g_value_set_uint (value, source->hedge_percentile);
+      break;
+    case PROP_HEDGE_MAX_RATE:
+      g_value_set_double (value, source->hedge_max_rate);
+      break;
+    case PROP_MAX_BITRATE:
+      g_value_set_uint64 (value, source->max_bitrate);
+      break;
+    case PROP_SHARED_MAX_BITRATE:
+      {
+        GstCurlHttpSrcClass *klass = G_TYPE_INSTANCE_GET_CLASS (source,
+            GST_TYPE_CURL_HTTP_SRC, GstCurlHttpSrcClass);
+
+        g_value_set_uint64 (value,
+            gst_curl_multi_context_get_max_rate (&klass->multi_task_context) * 8);
+      }
+      break;
+    case PROP_BANDWIDTH_WEIGHT:
+      g_value_set_uint (value, source->bandwidth_weight);
+      break;
+    case PROP_DEADLINE:
+      g_value_set_uint (value, source->deadline);
+      break;
+    case PROP_COALESCE:
+      g_value_set_boolean (value, source->coalesce);
+      break;
+    case PROP_DIRECT_PUSH:
+      g_value_set_boolean (value, source->direct_push);
+      break;
+    case PROP_MIN_OUTPUT_SIZE:
+      g_value_set_int (value, source->min_output_size);
+      break;
+    case PROP_MAX_OUTPUT_LATENCY:
+      g_value_set_uint (value, source->max_output_latency);
+      break;
+    case PROP_SPILL_THRESHOLD:
+      g_value_set_uint (value, source->spill_threshold);
+      break;
+    case PROP_SPILL_MAX_SIZE:
+      g_value_set_uint (value, source->spill_max_size);
+      break;
+    case PROP_USE_BUFFERING:
+      g_value_set_boolean (value, source->use_buffering);
+      break;
+    case PROP_BUFFER_SIZE:
+      g_value_set_uint (value, source->buffer_size);
+      break;
+    case PROP_PAUSED_LOOKAHEAD:
+      g_value_set_int (value, source->paused_lookahead);
+      break;
+    case PROP_PROBE_TIMEOUT:
+      g_value_set_uint (value, source->probe_timeout);
+      break;
+    case PROP_TRUST_CONTENT_TYPE:
+      g_value_set_boolean (value, source->trust_content_type);
+      break;
+    case PROP_DECODE_OFFLOAD:
+      g_value_set_boolean (value, source->decode_offload);
+      break;
+    case PROP_TLS_SESSION_FILE:
+      g_value_set_string (value, source->tls_session_file);
+      break;
+    case PROP_SSL_CA_DATA:
+      g_value_set_string (value, source->custom_ca_data);
+      break;
+    case PROP_CA_CACHE_TIMEOUT:
+      g_value_set_int (value, source->ca_cache_timeout);
+      break;
+    case PROP_CURL_BUFFER_SIZE:
+      g_value_set_int (value, source->curl_buffer_size);
+      break;
+    case PROP_TCP_NODELAY:
+      g_value_set_boolean (value, source->tcp_nodelay);
+      break;
+    case PROP_TCP_FASTOPEN:
+      g_value_set_boolean (value, source->tcp_fastopen);
+      break;
+    case PROP_SOCKET_RCVBUF:
+      g_value_set_int (value, source->socket_rcvbuf);
+      break;
+    case PROP_UNIX_SOCKET_PATH:
+      g_value_set_string (value, source->unix_socket_path);
+      break;
+    case PROP_UNIX_SOCKET_MAP:
+      g_value_set_boxed (value, source->unix_socket_map);
+      break;
+    case PROP_PREFETCH_RANGES:
+      g_value_set_string (value, source->prefetch_ranges);
+      break;
+    case PROP_LOCK_STATS:
+      {
+        GstCurlHttpSrcClass *klass = G_TYPE_INSTANCE_GET_CLASS (source,
+            GST_TYPE_CURL_HTTP_SRC, GstCurlHttpSrcClass);
+
+        g_value_take_boxed (value,
+            gst_curl_multi_context_get_lock_stats (&klass->multi_task_context));
+      }
+      break;
+    case PROP_HEDGE_STATS:
+      {
+        GstCurlHttpSrcClass *klass = G_TYPE_INSTANCE_GET_CLASS (source,
+            GST_TYPE_CURL_HTTP_SRC, GstCurlHttpSrcClass);
+
+        g_value_take_boxed (value,
+            gst_curl_multi_context_get_hedge_stats (&klass->multi_task_context));
+      }
+      break;
     case PROP_HTTPVERSION:
       switch (source->preferred_http_version) {
         case GSTCURL_HTTP_VERSION_1_0:
@@ -1265,6 +4714,38 @@ gst_curl_http_src_init (GstCurlHttpSrc * source)
   source->custom_ca_file = NULL;
   source->preferred_http_version = pref_http_ver;
   source->total_retries = GSTCURL_HANDLE_DEFAULT_RETRIES;
+  source->low_speed_limit = GSTCURL_HANDLE_DEFAULT_LOW_SPEED_LIMIT;
+  source->low_speed_time = GSTCURL_HANDLE_DEFAULT_LOW_SPEED_TIME;
+  source->hedge_percentile = GSTCURL_HANDLE_DEFAULT_HEDGE_PERCENTILE;
+  source->hedge_max_rate = GSTCURL_HANDLE_DEFAULT_HEDGE_MAX_RATE;
+  source->max_bitrate = GSTCURL_HANDLE_DEFAULT_MAX_BITRATE;
+  source->bandwidth_weight = GSTCURL_HANDLE_DEFAULT_BANDWIDTH_WEIGHT;
+  source->deadline = GSTCURL_HANDLE_DEFAULT_DEADLINE;
+  source->coalesce = GSTCURL_HANDLE_DEFAULT_COALESCE;
+  source->direct_push = GSTCURL_HANDLE_DEFAULT_DIRECT_PUSH;
+  source->min_output_size = GSTCURL_HANDLE_DEFAULT_MIN_OUTPUT_SIZE;
+  source->max_output_latency = GSTCURL_HANDLE_DEFAULT_MAX_OUTPUT_LATENCY;
+  source->spill_threshold = GSTCURL_HANDLE_DEFAULT_SPILL_THRESHOLD;
+  source->spill_max_size = GSTCURL_HANDLE_DEFAULT_SPILL_MAX_SIZE;
+  source->use_buffering = GSTCURL_HANDLE_DEFAULT_USE_BUFFERING;
+  source->buffer_size = GSTCURL_HANDLE_DEFAULT_BUFFER_SIZE;
+  source->buffering_percent = -1;
+  source->paused_lookahead = GSTCURL_HANDLE_DEFAULT_PAUSED_LOOKAHEAD;
+  source->probe_timeout = GSTCURL_HANDLE_DEFAULT_PROBE_TIMEOUT;
+  source->trust_content_type = GSTCURL_HANDLE_DEFAULT_TRUST_CONTENT_TYPE;
+  source->decode_offload = GSTCURL_HANDLE_DEFAULT_DECODE_OFFLOAD;
+  source->tls_session_file = GSTCURL_HANDLE_DEFAULT_TLS_SESSION_FILE;
+  source->custom_ca_data = GSTCURL_HANDLE_DEFAULT_SSL_CA_DATA;
+  source->ca_cache_timeout = GSTCURL_HANDLE_DEFAULT_CA_CACHE_TIMEOUT;
+  source->curl_buffer_size = GSTCURL_HANDLE_DEFAULT_CURLOPT_BUFFERSIZE;
+  source->tcp_nodelay = GSTCURL_HANDLE_DEFAULT_CURLOPT_TCP_NODELAY;
+  source->tcp_fastopen = GSTCURL_HANDLE_DEFAULT_CURLOPT_TCP_FASTOPEN;
+  source->socket_rcvbuf = GSTCURL_HANDLE_DEFAULT_SOCKET_RCVBUF;
+  source->unix_socket_path = GSTCURL_HANDLE_DEFAULT_CURLOPT_UNIX_SOCKET_PATH;
+  source->unix_socket_map = NULL;
+  g_mutex_init (&source->probe_lock);
+  g_mutex_init (&source->cache_lock);
+  g_cond_init (&source->cache_signal);
 
   gst_caps_replace(&source->caps, NULL);
 #if GST_CHECK_VERSION(1,0,0)
@@ -1283,6 +4764,7 @@ gst_curl_http_src_init (GstCurlHttpSrc * source)
   g_mutex_init (&source->context.mutex);
   g_cond_init (&source->context.signal);
   source->context.adapter = gst_adapter_new ();
+  g_queue_init (&source->arrivals);
 
   gst_curl_http_src_reset (source);
 
@@ -1311,12 +4793,17 @@ gst_curl_http_src_class_init (GstCurlHttpSrcClass * klass)
       GST_DEBUG_FUNCPTR (gst_curl_http_src_change_state);
   gstpushsrc_class->create = GST_DEBUG_FUNCPTR (gst_curl_http_src_create);
   gstbasesrc_class->query = GST_DEBUG_FUNCPTR (gst_curl_http_src_query);
+  gstbasesrc_class->event = GST_DEBUG_FUNCPTR (gst_curl_http_src_event);
   gstbasesrc_class->get_size =
       GST_DEBUG_FUNCPTR (gst_curl_http_src_get_content_length);
   gstbasesrc_class->is_seekable =
       GST_DEBUG_FUNCPTR (gst_curl_http_src_is_seekable);
   gstbasesrc_class->do_seek =
       GST_DEBUG_FUNCPTR (gst_curl_http_src_do_seek);
+#if GST_CHECK_VERSION(1,0,0)
+  gstbasesrc_class->decide_allocation =
+      GST_DEBUG_FUNCPTR (gst_curl_http_src_decide_allocation);
+#endif
 
   gst_element_class_add_pad_template (gstelement_class,
       gst_static_pad_template_get (&srcpadtemplate));
@@ -1345,6 +4832,12 @@ gst_curl_http_src_class_init (GstCurlHttpSrcClass * klass)
           GSTCURL_HANDLE_DEFAULT_CURLOPT_URL,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+  g_object_class_install_property (gobject_class, PROP_MIRRORS,
+      g_param_spec_boxed ("mirrors", "Mirrors",
+          "Alternate locations of the same resource. The first request is "
+          "raced across all of them and failures resume on the next one",
+          G_TYPE_STRV, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
   g_object_class_install_property (gobject_class, PROP_USERNAME,
       g_param_spec_string ("user-id", "user-id",
           "HTTP location URI user id for authentication",
@@ -1429,7 +4922,8 @@ gst_curl_http_src_class_init (GstCurlHttpSrcClass * klass)
 
   g_object_class_install_property (gobject_class, PROP_RETRIES,
       g_param_spec_int ("retries", "Retries",
-          "Maximum number of retries until giving up (-1=infinite)",
+          "Maximum number of retries with Range resume until giving up "
+          "(-1=infinite)",
           GSTCURL_HANDLE_MIN_RETRIES, GSTCURL_HANDLE_MAX_RETRIES,
           GSTCURL_HANDLE_DEFAULT_RETRIES, G_PARAM_READWRITE));
 
@@ -1461,6 +4955,211 @@ gst_curl_http_src_class_init (GstCurlHttpSrcClass * klass)
           GSTCURL_MIN_CONNECTIONS_GLOBAL, GSTCURL_MAX_CONNECTIONS_GLOBAL,
           GSTCURL_DEFAULT_CONNECTIONS_GLOBAL,
           G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_LOW_SPEED_LIMIT,
+      g_param_spec_uint ("low-speed-limit", "Low-Speed-Limit",
+          "Throughput in bytes/sec below which a transfer is considered "
+          "stalled and resumed on a new connection (0 = disabled)",
+          GSTCURL_HANDLE_MIN_LOW_SPEED_LIMIT, GSTCURL_HANDLE_MAX_LOW_SPEED_LIMIT,
+          GSTCURL_HANDLE_DEFAULT_LOW_SPEED_LIMIT, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_LOW_SPEED_TIME,
+      g_param_spec_uint ("low-speed-time", "Low-Speed-Time",
+          "Window in milliseconds over which low-speed-limit is measured",
+          GSTCURL_HANDLE_MIN_LOW_SPEED_TIME, GSTCURL_HANDLE_MAX_LOW_SPEED_TIME,
+          GSTCURL_HANDLE_DEFAULT_LOW_SPEED_TIME, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_HEDGE_PERCENTILE,
+      g_param_spec_uint ("hedge-percentile", "Hedge-Percentile",
+          "Issue a duplicate request when the first byte takes longer than "
+          "this percentile of the recent ones (0 = disabled)",
+          GSTCURL_HANDLE_MIN_HEDGE_PERCENTILE,
+          GSTCURL_HANDLE_MAX_HEDGE_PERCENTILE,
+          GSTCURL_HANDLE_DEFAULT_HEDGE_PERCENTILE, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_HEDGE_MAX_RATE,
+      g_param_spec_double ("hedge-max-rate", "Hedge-Max-Rate",
+          "Maximum ratio of hedged requests over the hedgeable ones",
+          GSTCURL_HANDLE_MIN_HEDGE_MAX_RATE, GSTCURL_HANDLE_MAX_HEDGE_MAX_RATE,
+          GSTCURL_HANDLE_DEFAULT_HEDGE_MAX_RATE, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_HEDGE_STATS,
+      g_param_spec_boxed ("hedge-stats", "Hedge-Stats",
+          "Hedging counters of the shared multi context",
+          GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_BITRATE,
+      g_param_spec_uint64 ("max-bitrate", "Max-Bitrate",
+          "Maximum receive rate of this element in bits/sec (0 = unlimited)",
+          0, G_MAXUINT64, GSTCURL_HANDLE_DEFAULT_MAX_BITRATE,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_SHARED_MAX_BITRATE,
+      g_param_spec_uint64 ("shared-max-bitrate", "Shared-Max-Bitrate",
+          "Maximum receive rate in bits/sec shared by all the elements of "
+          "the process, split by bandwidth-weight (0 = unlimited)",
+          0, G_MAXUINT64, GSTCURL_HANDLE_DEFAULT_SHARED_MAX_BITRATE,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_BANDWIDTH_WEIGHT,
+      g_param_spec_uint ("bandwidth-weight", "Bandwidth-Weight",
+          "Share of shared-max-bitrate guaranteed to this element, relative "
+          "to the weights of the other running elements",
+          GSTCURL_HANDLE_MIN_BANDWIDTH_WEIGHT,
+          GSTCURL_HANDLE_MAX_BANDWIDTH_WEIGHT,
+          GSTCURL_HANDLE_DEFAULT_BANDWIDTH_WEIGHT, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_DEADLINE,
+      g_param_spec_uint ("deadline", "Deadline",
+          "Time in ms from the start of a request by which it must be done. "
+          "Requests are served earliest deadline first (0 = none)",
+          GSTCURL_HANDLE_MIN_DEADLINE, GSTCURL_HANDLE_MAX_DEADLINE,
+          GSTCURL_HANDLE_DEFAULT_DEADLINE, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_COALESCE,
+      g_param_spec_boolean ("coalesce", "Coalesce",
+          "Share one transfer between identical requests in flight in the "
+          "process", GSTCURL_HANDLE_DEFAULT_COALESCE, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_LOCK_STATS,
+      g_param_spec_boxed ("lock-stats", "Lock-Stats",
+          "Lock contention counters of the shared multi context",
+          GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_DIRECT_PUSH,
+      g_param_spec_boolean ("direct-push", "Direct-Push",
+          "Push the buffers as received, timestamped on arrival, instead of "
+          "gathering them", GSTCURL_HANDLE_DEFAULT_DIRECT_PUSH,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_MIN_OUTPUT_SIZE,
+      g_param_spec_int ("min-output-size", "Min-Output-Size",
+          "Size of the buffers pushed, smaller only at the end or after "
+          "max-output-latency (0 = what is available, -1 = blocksize)",
+          GSTCURL_HANDLE_MIN_MIN_OUTPUT_SIZE, GSTCURL_HANDLE_MAX_MIN_OUTPUT_SIZE,
+          GSTCURL_HANDLE_DEFAULT_MIN_OUTPUT_SIZE, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_OUTPUT_LATENCY,
+      g_param_spec_uint ("max-output-latency", "Max-Output-Latency",
+          "Time in ms after which a partial buffer is pushed anyway "
+          "(0 = never)", GSTCURL_HANDLE_MIN_MAX_OUTPUT_LATENCY,
+          GSTCURL_HANDLE_MAX_MAX_OUTPUT_LATENCY,
+          GSTCURL_HANDLE_DEFAULT_MAX_OUTPUT_LATENCY, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_SPILL_THRESHOLD,
+      g_param_spec_uint ("spill-threshold", "Spill-Threshold",
+          "Bytes received ahead of downstream kept in memory, the rest goes "
+          "to a temporary file (0 = never spill)",
+          GSTCURL_HANDLE_MIN_SPILL_THRESHOLD, GSTCURL_HANDLE_MAX_SPILL_THRESHOLD,
+          GSTCURL_HANDLE_DEFAULT_SPILL_THRESHOLD, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_SPILL_MAX_SIZE,
+      g_param_spec_uint ("spill-max-size", "Spill-Max-Size",
+          "Size in bytes of the temporary file, the download is paused while "
+          "it is full", GSTCURL_HANDLE_MIN_SPILL_MAX_SIZE,
+          GSTCURL_HANDLE_MAX_SPILL_MAX_SIZE,
+          GSTCURL_HANDLE_DEFAULT_SPILL_MAX_SIZE, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_USE_BUFFERING,
+      g_param_spec_boolean ("use-buffering", "Use-Buffering",
+          "Post buffering messages and answer the buffering query from the "
+          "data received ahead of downstream",
+          GSTCURL_HANDLE_DEFAULT_USE_BUFFERING, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_BUFFER_SIZE,
+      g_param_spec_uint ("buffer-size", "Buffer-Size",
+          "Bytes received ahead of downstream for 100% of buffering",
+          GSTCURL_HANDLE_MIN_BUFFER_SIZE, GSTCURL_HANDLE_MAX_BUFFER_SIZE,
+          GSTCURL_HANDLE_DEFAULT_BUFFER_SIZE, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_PAUSED_LOOKAHEAD,
+      g_param_spec_int ("paused-lookahead", "Paused-Lookahead",
+          "Bytes downloaded ahead while PAUSED before the transfer is paused "
+          "until PLAYING (-1 = keep downloading)",
+          GSTCURL_HANDLE_MIN_PAUSED_LOOKAHEAD,
+          GSTCURL_HANDLE_MAX_PAUSED_LOOKAHEAD,
+          GSTCURL_HANDLE_DEFAULT_PAUSED_LOOKAHEAD, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_PROBE_TIMEOUT,
+      g_param_spec_uint ("probe-timeout", "Probe-Timeout",
+          "Time in ms the size and seekability queries wait for the size "
+          "probed at startup (0 = no probe)",
+          GSTCURL_HANDLE_MIN_PROBE_TIMEOUT, GSTCURL_HANDLE_MAX_PROBE_TIMEOUT,
+          GSTCURL_HANDLE_DEFAULT_PROBE_TIMEOUT, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_TRUST_CONTENT_TYPE,
+      g_param_spec_boolean ("trust-content-type", "Trust-Content-Type",
+          "Set the caps from the Content-Type of the response before the "
+          "first buffer when it maps to known caps, skipping typefinding",
+          GSTCURL_HANDLE_DEFAULT_TRUST_CONTENT_TYPE, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_DECODE_OFFLOAD,
+      g_param_spec_boolean ("decode-offload", "Decode-Offload",
+          "With compress, receive the body as encoded and decode it on the "
+          "streaming thread instead of the shared network thread",
+          GSTCURL_HANDLE_DEFAULT_DECODE_OFFLOAD, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_TLS_SESSION_FILE,
+      g_param_spec_string ("tls-session-file", "TLS-Session-File",
+          "File the TLS sessions are saved to and loaded from, to resume them "
+          "after a restart of the process",
+          GSTCURL_HANDLE_DEFAULT_TLS_SESSION_FILE, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_SSL_CA_DATA,
+      g_param_spec_string ("ssl-ca-data", "SSL-CA-Data",
+          "Certificate authorities in PEM, instead of a file",
+          GSTCURL_HANDLE_DEFAULT_SSL_CA_DATA, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_CA_CACHE_TIMEOUT,
+      g_param_spec_int ("ca-cache-timeout", "CA-Cache-Timeout",
+          "Seconds the parsed certificate authorities are kept for all the "
+          "transfers, -1 for ever and 0 to parse them for each",
+          GSTCURL_HANDLE_MIN_CA_CACHE_TIMEOUT,
+          GSTCURL_HANDLE_MAX_CA_CACHE_TIMEOUT,
+          GSTCURL_HANDLE_DEFAULT_CA_CACHE_TIMEOUT, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_CURL_BUFFER_SIZE,
+      g_param_spec_int ("curl-buffer-size", "Curl-Buffer-Size",
+          "Size in bytes of the receive buffer of curl, the most data handed "
+          "per callback",
+          GSTCURL_HANDLE_MIN_CURLOPT_BUFFERSIZE,
+          GSTCURL_HANDLE_MAX_CURLOPT_BUFFERSIZE,
+          GSTCURL_HANDLE_DEFAULT_CURLOPT_BUFFERSIZE, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_TCP_NODELAY,
+      g_param_spec_boolean ("tcp-nodelay", "TCP-NoDelay",
+          "Disable the Nagle algorithm on the connections",
+          GSTCURL_HANDLE_DEFAULT_CURLOPT_TCP_NODELAY, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_TCP_FASTOPEN,
+      g_param_spec_boolean ("tcp-fastopen", "TCP-FastOpen",
+          "Send the request with the SYN to the servers allowing it",
+          GSTCURL_HANDLE_DEFAULT_CURLOPT_TCP_FASTOPEN, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_SOCKET_RCVBUF,
+      g_param_spec_int ("socket-rcvbuf", "Socket-RcvBuf",
+          "Receive buffer size in bytes of the sockets, which bounds the "
+          "TCP window (0 = tuned by the system)",
+          GSTCURL_HANDLE_MIN_SOCKET_RCVBUF, GSTCURL_HANDLE_MAX_SOCKET_RCVBUF,
+          GSTCURL_HANDLE_DEFAULT_SOCKET_RCVBUF, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_UNIX_SOCKET_PATH,
+      g_param_spec_string ("unix-socket-path", "Unix-Socket-Path",
+          "Unix domain socket to connect through instead of the network, "
+          "the requests keep their URL and Host",
+          GSTCURL_HANDLE_DEFAULT_CURLOPT_UNIX_SOCKET_PATH, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_UNIX_SOCKET_MAP,
+      g_param_spec_boxed ("unix-socket-map", "Unix-Socket-Map",
+          "Unix domain sockets per host, as host=path, overriding "
+          "unix-socket-path. An empty path connects over the network",
+          G_TYPE_STRV, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PREFETCH_RANGES,
+      g_param_spec_string ("prefetch-ranges", "Prefetch-Ranges",
+          "Announce the ranges about to be read, \"a-b,c-d,...\" with "
+          "inclusive ends, like the curlhttpsrc-ranges event",
+          NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 #ifdef CURL_VERSION_HTTP2
   if (gst_curl_http_src_curl_capabilities->features && CURL_VERSION_HTTP2) {
     GST_INFO_OBJECT (klass, "Our curl version (%s) supports HTTP2!",
@@ -1493,6 +5192,9 @@ gst_curl_http_src_class_init (GstCurlHttpSrcClass * klass)
 
   g_mutex_init(&klass->multi_task_context.mutex);
   g_cond_init(&klass->multi_task_context.signal);
+  /* No wake up pipe until the first element refs the worker */
+  klass->multi_task_context.wakeup[0] = -1;
+  klass->multi_task_context.wakeup[1] = -1;
 #if GST_CHECK_VERSION(1,0,0)
   g_rec_mutex_init(&klass->multi_task_context.task_rec_mutex);
 #else
@@ -61,9 +61,25 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <arpa/inet.h>
 #include <curl/curl.h>
 #include <gst/base/gstpushsrc.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_BROTLI
+#include <brotli/decode.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "gstcurlmulticontext.h"
 
@@ -94,6 +110,20 @@ G_BEGIN_DECLS
 #define GSTCURL_DEFAULT_CONNECTIONS_SERVER 5
 #define GSTCURL_DEFAULT_CONNECTIONS_PROXY 30
 #define GSTCURL_DEFAULT_CONNECTIONS_GLOBAL 255
+#define GSTCURL_RETRY_BACKOFF_MIN_MS 250
+#define GSTCURL_RETRY_BACKOFF_MAX_MS 16000
+/* Bytes a resumed transfer must bring before the retries start over */
+#define GSTCURL_RETRY_PROGRESS_MIN (256 * 1024)
+#define GSTCURL_WHOLE_BODY_MAX (256 * 1024)
+#define GSTCURL_BUFFERING_INTERVAL_MS 100
+#define GSTCURL_RANGES_MAX 16
+#define GSTCURL_RANGE_CACHE_MAX (8 * 1024 * 1024)
+#define GSTCURL_FETCH_LINE_MAX 1024
+#define GSTCURL_PROBE_CACHE_MAX 256
+/* In seconds, how long what a probe learned is trusted */
+#define GSTCURL_PROBE_CACHE_TTL 60
+/* Output of a decoder grows by this much at a time */
+#define GSTCURL_DECODE_CHUNK (64 * 1024)
 #define GSTCURL_INFO_RESPONSE(x) ((x >= 100) && (x <= 199))
 #define GSTCURL_SUCCESS_RESPONSE(x) ((x >= 200) && (x <=299))
 #define GSTCURL_REDIRECT_RESPONSE(x) ((x >= 300) && (x <= 399))
@@ -108,6 +138,68 @@ G_BEGIN_DECLS
 typedef struct _GstCurlHttpSrc GstCurlHttpSrc;
 typedef struct _GstCurlHttpSrcClass GstCurlHttpSrcClass;
 typedef struct _GstCurlHttpSrcQueueElement GstCurlHttpSrcQueueElement;
+typedef struct _GstCurlHttpSrcFetch GstCurlHttpSrcFetch;
+
+/* The content encodings the element decodes itself */
+typedef enum
+{
+  GSTCURL_ENCODING_IDENTITY,
+  GSTCURL_ENCODING_GZIP,
+  GSTCURL_ENCODING_DEFLATE,
+  GSTCURL_ENCODING_BR,
+  GSTCURL_ENCODING_ZSTD,
+  GSTCURL_ENCODING_UNKNOWN
+} GstCurlHttpSrcEncoding;
+typedef struct _GstCurlHttpSrcChunk GstCurlHttpSrcChunk;
+typedef struct _GstCurlHttpSrcArrival GstCurlHttpSrcArrival;
+
+/* A range announced ahead of the reads, filled from its start */
+struct _GstCurlHttpSrcChunk
+{
+  guint64 start;
+  gsize size;
+  gsize filled;
+  guint8 *data;
+  /* the request filling it, NULL once that one is done */
+  GstCurlHttpSrcFetch *fetch;
+};
+
+/* When the bytes put in the adapter up to end arrived */
+struct _GstCurlHttpSrcArrival
+{
+  guint64 end;
+  gint64 time;
+};
+
+/* A request for one or several ranges, outside of the element data flow */
+struct _GstCurlHttpSrcFetch
+{
+  GstCurlMultiContextSource context;
+  GstCurlHttpSrc *src;
+  struct curl_slist *slist;
+  gboolean multi;
+  /* the server sent the whole entity instead */
+  gboolean ignored;
+  /* only there for the size and range support of the entity */
+  gboolean probe;
+  gboolean probed;
+  guint64 probe_size;
+  gboolean probe_no_ranges;
+
+  /* multipart/byteranges parsing */
+  enum
+  {
+    GSTCURL_FETCH_NONE,
+    GSTCURL_FETCH_DELIMITER,
+    GSTCURL_FETCH_HEADERS,
+    GSTCURL_FETCH_BODY,
+    GSTCURL_FETCH_END
+  } state;
+  gchar *boundary;
+  GString *line;
+  guint64 part_offset;
+  guint64 part_left;
+};
 
 struct _GstCurlHttpSrcClass
 {
@@ -133,6 +225,10 @@ struct _GstCurlHttpSrc
   /* Type         Name                                      Curl Option */
   gchar *uri;                   /* CURLOPT_URL */
   gchar *redirect_uri;		/* CURLINFO_REDIRECT_URL */
+  gchar **mirrors;              /* Alternate locations of uri */
+  guint n_mirrors;
+  guint location_index;         /* 0 is uri, n is mirrors[n - 1] */
+  gboolean raced;               /* locations already raced for this stream */
   gchar *username;              /* CURLOPT_USERNAME */
   gchar *password;              /* CURLOPT_PASSWORD */
   gchar *proxy_uri;             /* CURLOPT_PROXY */
@@ -154,11 +250,111 @@ struct _GstCurlHttpSrc
   glong max_3xx_redirects;      /* CURLOPT_MAXREDIRS */
   gboolean keep_alive;          /* CURLOPT_TCP_KEEPALIVE */
   gint timeout_secs;            /* CURLOPT_TIMEOUT */
+  glong curl_buffer_size;       /* CURLOPT_BUFFERSIZE */
+  gboolean tcp_nodelay;         /* CURLOPT_TCP_NODELAY */
+  gboolean tcp_fastopen;        /* CURLOPT_TCP_FASTOPEN */
+  gint socket_rcvbuf;           /* SO_RCVBUF */
+  gchar *unix_socket_path;      /* CURLOPT_UNIX_SOCKET_PATH */
+  gchar **unix_socket_map;      /* host=path, overriding it per host */
   gboolean strict_ssl;		/* CURLOPT_SSL_VERIFYPEER */
   gchar* custom_ca_file;	/* CURLOPT_CAINFO */
+  gchar *custom_ca_data;        /* CURLOPT_CAINFO_BLOB */
+  gint ca_cache_timeout;        /* CURLOPT_CA_CACHE_TIMEOUT */
+  gchar *tls_session_file;      /* TLS sessions kept across restarts */
 
   gint total_retries;
   gint retries_remaining;
+  guint retry_attempt;          /* consecutive failures, for the backoff */
+  guint64 retry_progress;       /* bytes received since the last failure */
+  gboolean resuming;            /* validate the next response against the
+                                   stored ETag/Last-Modified */
+  gboolean resume_mismatch;     /* resource changed under a resume */
+  gboolean resume_validated;    /* a validator of the response matched */
+  guint64 resume_length;        /* entity size expected on the resume */
+
+  /* Stall detection */
+  guint low_speed_limit;        /* bytes/sec, 0 disables it */
+  guint low_speed_time;         /* window in milliseconds */
+  gint64 stall_window_start;
+  guint64 stall_window_bytes;
+  gboolean stalled;             /* last transfer aborted for being too slow */
+  gchar *stalled_url;           /* CURLINFO_EFFECTIVE_URL of it */
+  gchar *stalled_ip;            /* CURLINFO_PRIMARY_IP of it */
+  glong stalled_port;           /* CURLINFO_PRIMARY_PORT of it */
+  struct curl_slist *connect_to; /* CURLOPT_CONNECT_TO */
+  gchar *alternate;             /* the entry of it to fail over to */
+
+  /* Hedged requests, see gstcurlmulticontext.c */
+  guint hedge_percentile;
+  gdouble hedge_max_rate;
+
+  /* Bandwidth limits, in bits per second */
+  guint64 max_bitrate;          /* CURLOPT_MAX_RECV_SPEED_LARGE */
+  guint bandwidth_weight;       /* share of the multi context cap */
+
+  /* Deadline scheduling */
+  guint deadline;               /* ms from the start of each request */
+  gint64 pending_deadline;      /* from an event, for the next request */
+
+  gboolean coalesce;            /* share identical requests in flight */
+  gboolean direct_push;         /* buffers go out as received, no adapter */
+  gint min_output_size;         /* bytes per buffer, -1 is the blocksize */
+  guint max_output_latency;     /* ms before a partial buffer goes out */
+  guint64 adapter_in;           /* bytes ever put in the adapter */
+  GQueue arrivals;              /* GstCurlHttpSrcArrival, oldest first */
+  guint spill_threshold;        /* bytes kept in memory before spilling */
+  guint spill_max_size;         /* size of the spill file */
+
+  /* Buffering messages, the rates under the object lock */
+  gboolean use_buffering;
+  guint buffer_size;            /* bytes for 100% */
+  gint adapter_level;           /* bytes in the adapter, atomic */
+  gint buffering_percent;       /* last posted, -1 for none */
+  gint64 buffering_time;        /* start of the rate window */
+  guint64 bytes_in;             /* received in the window */
+  guint64 bytes_out;            /* pushed in the window */
+  gdouble avg_in;               /* bytes per second */
+  gdouble avg_out;
+
+  gint paused_lookahead;        /* bytes ahead before pausing, -1 never */
+  gboolean trust_content_type;  /* caps from the Content-Type */
+  gboolean caps_pending;        /* a new response, caps to set */
+
+  /*
+   * Content decoding on the streaming thread, the worker only moves the
+   * encoded bytes. The encoding of the response is set by the worker before
+   * its body, the decoder is only touched by the streaming thread.
+   */
+  gboolean decode_offload;
+  GstCurlHttpSrcEncoding content_encoding;
+  GstCurlHttpSrcEncoding decoder_encoding;
+  gboolean decode_error;
+#ifdef HAVE_ZLIB
+  z_stream zstream;
+  gboolean zstream_raw;
+#endif
+#ifdef HAVE_BROTLI
+  BrotliDecoderState *brotli;
+#endif
+#ifdef HAVE_ZSTD
+  ZSTD_DStream *zstd;
+#endif
+
+  /* A small body of known length is received in one allocation */
+  gsize body_length;            /* Content-Length of the response */
+  gboolean body_encoded;        /* that length is not the one we receive */
+  guint64 entity_length;        /* size of the entity it tells, 0 if unknown */
+  guint8 *whole;                /* the body, whole_size bytes */
+  gsize whole_size;
+  gsize whole_filled;
+
+#if GST_CHECK_VERSION(1,0,0)
+  /* Memory downstream asked for, under the object lock */
+  GstBufferPool *pool;          /* of pool_size bytes buffers */
+  guint pool_size;
+  GstAllocator *allocator;
+  GstAllocationParams alloc_params;
+#endif
 
   /*TODO As the following are all multi options, move these to curl task */
   guint max_connection_time;    /* */
@@ -195,16 +391,54 @@ struct _GstCurlHttpSrc
    * Seek information
    */
   guint64 start_position;
-  guint64 stop_position;
+  guint64 stop_position;       /* exclusive, -1 for the end */
+  /* bounds of the request in flight and what is left of its body, the last
+   * three are only touched by the worker once it is added */
+  guint64 request_start;
+  guint64 request_stop;
+  guint64 body_skip;
+  guint64 body_left;
+  gboolean range_complete;
+
+  /*
+   * Ranges announced by a curlhttpsrc-ranges event, fetched together in a
+   * multipart/byteranges request, or one request each in parallel once the
+   * server showed it does not support it. Seeks into them are served here.
+   */
+  GList *range_cache;
+  gsize range_cache_size;
+  GList *fetches;
+  gboolean no_multirange;
+  gchar *prefetch_ranges;
+  /* the worker fills the ranges with this lock only, never the context
+   * lock. The element changes the list and reads the filled sizes with it
+   * too, and waits for cache_cookie to change on the signal. */
+  GMutex cache_lock;
+  GCond cache_signal;
+  guint cache_cookie;
+
+  /*
+   * Size and range support probed at startup alongside the first request,
+   * waited for up to probe_timeout by the seekability and size queries.
+   */
+  guint probe_timeout;
+  GMutex probe_lock;
+  GstCurlHttpSrcFetch *probe;
+  gint64 probe_deadline;
+  gboolean no_ranges;
 
   /*
    * Response message
    */
   guint64 content_length;
+  gboolean have_response;       /* a response of the entity arrived */
+  gboolean entity_encoded;      /* and its body is decoded, of unknown size */
   guint64 read_position;
   struct
   {
     gchar *content_type;
+    gchar *etag;
+    gchar *last_modified;
   } headers;
 
   GstCaps *caps;
@@ -235,6 +469,39 @@ enum
   PROP_MAXCONCURRENT_PROXY,
   PROP_MAXCONCURRENT_GLOBAL,
   PROP_HTTPVERSION,
+  PROP_LOW_SPEED_LIMIT,
+  PROP_LOW_SPEED_TIME,
+  PROP_HEDGE_PERCENTILE,
+  PROP_HEDGE_MAX_RATE,
+  PROP_HEDGE_STATS,
+  PROP_MIRRORS,
+  PROP_MAX_BITRATE,
+  PROP_SHARED_MAX_BITRATE,
+  PROP_BANDWIDTH_WEIGHT,
+  PROP_DEADLINE,
+  PROP_COALESCE,
+  PROP_LOCK_STATS,
+  PROP_DIRECT_PUSH,
+  PROP_MIN_OUTPUT_SIZE,
+  PROP_MAX_OUTPUT_LATENCY,
+  PROP_SPILL_THRESHOLD,
+  PROP_SPILL_MAX_SIZE,
+  PROP_USE_BUFFERING,
+  PROP_BUFFER_SIZE,
+  PROP_PAUSED_LOOKAHEAD,
+  PROP_PROBE_TIMEOUT,
+  PROP_TRUST_CONTENT_TYPE,
+  PROP_DECODE_OFFLOAD,
+  PROP_TLS_SESSION_FILE,
+  PROP_SSL_CA_DATA,
+  PROP_CA_CACHE_TIMEOUT,
+  PROP_CURL_BUFFER_SIZE,
+  PROP_TCP_NODELAY,
+  PROP_TCP_FASTOPEN,
+  PROP_SOCKET_RCVBUF,
+  PROP_UNIX_SOCKET_PATH,
+  PROP_UNIX_SOCKET_MAP,
+  PROP_PREFETCH_RANGES,
   PROP_MAX
 };
 
@@ -2,31 +2,1178 @@
 #  include <config.h>
 #endif
 
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+
 #include "gstcurlmulticontext.h"
 
-GST_DEBUG_CATEGORY_EXTERN (gst_curl_multi_context_debug);
-#define GST_CAT_DEFAULT gst_curl_multi_context_debug
+GST_DEBUG_CATEGORY_EXTERN (gst_curl_multi_context_debug);
+#define GST_CAT_DEFAULT gst_curl_multi_context_debug
+
+#define GSTCURL_CLIENT_ERR_RESPONSE(x) ((x >= 400) && (x <= 499))
+#define GSTCURL_SERVER_ERR_RESPONSE(x) ((x >= 500) && (x <= 599))
+
+typedef enum _GstCurlMultiContextCommandType GstCurlMultiContextCommandType;
+typedef struct _GstCurlMultiContextCommand GstCurlMultiContextCommand;
+
+enum _GstCurlMultiContextCommandType
+{
+  GST_CURL_MULTI_CONTEXT_COMMAND_ADD,
+  GST_CURL_MULTI_CONTEXT_COMMAND_REMOVE,
+  GST_CURL_MULTI_CONTEXT_COMMAND_DEADLINE,
+  GST_CURL_MULTI_CONTEXT_COMMAND_MAX_RATE,
+};
+
+struct _GstCurlMultiContextCommand
+{
+  GstCurlMultiContextCommand *next;
+  GstCurlMultiContextCommandType type;
+  GstCurlMultiContextSource *source;
+  CURL *handle;
+  gint64 value;
+};
+
+/*
+ * Legs: a source that hedges or races mirrors has its callbacks routed
+ * through one leg per concurrent request. The first leg to receive anything
+ * wins, the element reads from its handle and the other legs are dropped.
+ *
+ * Hedging: if the first byte takes longer than a percentile of the recent
+ * time to first byte, a duplicate request is issued on a fresh connection.
+ * Racing: the request is issued to every alternate URL from the start.
+ */
+static gint
+gst_curl_multi_context_compare_ttfb (gconstpointer a, gconstpointer b)
+{
+  gint64 ta = *(const gint64 *) a;
+  gint64 tb = *(const gint64 *) b;
+
+  return (ta > tb) - (ta < tb);
+}
+
+/* must be called with the context lock */
+static gint64
+gst_curl_multi_context_ttfb_percentile (GstCurlMultiContext * thiz,
+    guint percentile)
+{
+  gint64 sorted[GST_CURL_MULTI_CONTEXT_TTFB_SAMPLES];
+
+  if (thiz->ttfb_count < GST_CURL_MULTI_CONTEXT_TTFB_MIN_SAMPLES)
+    return -1;
+
+  memcpy (sorted, thiz->ttfb, thiz->ttfb_count * sizeof (gint64));
+  qsort (sorted, thiz->ttfb_count, sizeof (gint64),
+      gst_curl_multi_context_compare_ttfb);
+
+  return sorted[(thiz->ttfb_count - 1) * percentile / 100];
+}
+
+/*
+ * Make the element read from another handle of the source.
+ *
+ * must be called from the worker
+ */
+static void
+gst_curl_multi_context_switch_leg (GstCurlMultiContextSource * source,
+    GstCurlMultiContextLeg * leg)
+{
+  g_mutex_lock (&source->mutex);
+  source->easy_handle = leg->handle;
+  g_mutex_unlock (&source->mutex);
+}
+
+/*
+ * Called from the curl callbacks, hence from the worker.
+ */
+static gboolean
+gst_curl_multi_context_leg_wins (GstCurlMultiContextLeg * leg)
+{
+  GstCurlMultiContextSource *source = leg->source;
+  GstCurlMultiContext *thiz = source->context;
+
+  if (source->winner)
+    return source->winner == leg;
+
+  source->winner = leg;
+
+  /*
+   * The samples are also read by the stats. Only the ones of the primary
+   * location, the time of the mirrors is not what the hedging is about.
+   */
+  if (leg->tag == 0) {
+    g_mutex_lock (&thiz->mutex);
+    thiz->ttfb[thiz->ttfb_next] = g_get_monotonic_time () - source->added_time;
+    thiz->ttfb_next =
+        (thiz->ttfb_next + 1) % GST_CURL_MULTI_CONTEXT_TTFB_SAMPLES;
+    if (thiz->ttfb_count < GST_CURL_MULTI_CONTEXT_TTFB_SAMPLES)
+      thiz->ttfb_count++;
+    if (leg->handle != source->easy_handle)
+      thiz->hedges_won++;
+    g_mutex_unlock (&thiz->mutex);
+  }
+
+  if (leg->handle != source->easy_handle) {
+    GST_DEBUG ("Request %u won the race", leg->tag);
+    gst_curl_multi_context_switch_leg (source, leg);
+  }
+
+  return TRUE;
+}
+
+static void
+gst_curl_multi_context_leg_clear (GstCurlMultiContextLeg * leg)
+{
+  GString *line;
+
+  while ((line = g_queue_pop_head (&leg->headers)))
+    g_string_free (line, TRUE);
+  leg->status = 0;
+}
+
+/*
+ * Hand the header lines held back to the element once the leg won. Returns
+ * FALSE if the element refused one.
+ */
+static gboolean
+gst_curl_multi_context_leg_replay (GstCurlMultiContextLeg * leg)
+{
+  GstCurlMultiContextSource *source = leg->source;
+  GString *line;
+  gboolean ok = TRUE;
+
+  while ((line = g_queue_pop_head (&leg->headers))) {
+    if (ok && source->header_func (line->str, 1, line->len,
+            source->func_data) != line->len)
+      ok = FALSE;
+    g_string_free (line, TRUE);
+  }
+
+  return ok;
+}
+
+static size_t
+gst_curl_multi_context_leg_header (char *data, size_t size, size_t nmemb,
+    void *user)
+{
+  GstCurlMultiContextLeg *leg = user;
+  GstCurlMultiContextSource *source = leg->source;
+  size_t len = size * nmemb;
+  const gchar *code;
+
+  /* Returning less than given aborts the request that lost */
+  if (source->winner)
+    return source->winner == leg ?
+        source->header_func (data, size, nmemb, source->func_data) : 0;
+
+  /*
+   * A request only wins with a successful response, a location failing fast
+   * must not take over from the ones that work. Until then its lines are kept.
+   */
+  if (len > 5 && strncmp (data, "HTTP/", 5) == 0) {
+    code = memchr (data, ' ', len);
+    leg->status = code ? strtol (code + 1, NULL, 10) : 0;
+  }
+  g_queue_push_tail (&leg->headers, g_string_new_len (data, len));
+
+  /* An empty line ends the headers of a response */
+  if (len > 2 || (data[0] != '\r' && data[0] != '\n'))
+    return len;
+
+  if (leg->status >= 200 && leg->status <= 299) {
+    gst_curl_multi_context_leg_wins (leg);
+    return gst_curl_multi_context_leg_replay (leg) ? len : 0;
+  }
+
+  /* Interim or redirect, the final response is still to come */
+  if (leg->status >= 100 && leg->status <= 399)
+    return len;
+
+  GST_DEBUG ("Request %u failed with response %ld, leaving the race",
+      leg->tag, leg->status);
+  gst_curl_multi_context_leg_clear (leg);
+  return 0;
+}
+
+static size_t
+gst_curl_multi_context_leg_write (char *data, size_t size, size_t nmemb,
+    void *user)
+{
+  GstCurlMultiContextLeg *leg = user;
+
+  /* A body with no successful response before, a redirect not followed */
+  if (leg->source->winner == NULL) {
+    gst_curl_multi_context_leg_wins (leg);
+    if (!gst_curl_multi_context_leg_replay (leg))
+      return 0;
+  }
+
+  if (!gst_curl_multi_context_leg_wins (leg))
+    return 0;
+
+  return leg->source->write_func (data, size, nmemb, leg->source->func_data);
+}
+
+#if LIBCURL_VERSION_NUM >= 0x072000
+/*
+ * The stall detection of the element only follows the request that won, the
+ * others have no body to be slow at.
+ */
+static int
+gst_curl_multi_context_leg_progress (void *user, curl_off_t dltotal,
+    curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+{
+  GstCurlMultiContextLeg *leg = user;
+  GstCurlMultiContextSource *source = leg->source;
+
+  if (source->winner != leg)
+    return 0;
+
+  return source->progress_func (source->func_data, dltotal, dlnow, ultotal,
+      ulnow);
+}
+#endif
+
+/* must be called from the worker */
+static void
+gst_curl_multi_context_drop_leg (GstCurlMultiContext * thiz,
+    GstCurlMultiContextLeg * leg)
+{
+  gst_curl_multi_context_leg_clear (leg);
+  if (leg->handle == NULL)
+    return;
+
+  curl_multi_remove_handle (thiz->multi_handle, leg->handle);
+  curl_easy_cleanup (leg->handle);
+  leg->handle = NULL;
+}
+
+/*
+ * Duplicate the primary request of a source on a new leg, to another URL
+ * reached through its own Unix socket if url is set.
+ *
+ * must be called from the worker
+ */
+static GstCurlMultiContextLeg *
+gst_curl_multi_context_add_leg (GstCurlMultiContext * thiz,
+    GstCurlMultiContextSource * source, const gchar * url,
+    const gchar * unix_socket, guint tag)
+{
+  GstCurlMultiContextLeg *leg;
+
+  if (source->n_legs >= GST_CURL_MULTI_CONTEXT_MAX_LEGS) {
+    if (url)
+      GST_WARNING ("Too many concurrent requests, not racing against %s", url);
+    return NULL;
+  }
+
+  leg = &source->legs[source->n_legs];
+  leg->handle = curl_easy_duphandle (source->legs[0].handle);
+  if (leg->handle == NULL)
+    return NULL;
+
+  leg->source = source;
+  leg->tag = tag;
+  leg->status = 0;
+  g_queue_init (&leg->headers);
+  source->n_legs++;
+
+  if (url) {
+    curl_easy_setopt (leg->handle, CURLOPT_URL, url);
+#if LIBCURL_VERSION_NUM >= 0x072800
+    /* The duplicate has the socket of the primary location */
+    curl_easy_setopt (leg->handle, CURLOPT_UNIX_SOCKET_PATH,
+        unix_socket && *unix_socket ? unix_socket : NULL);
+#endif
+  }
+  curl_easy_setopt (leg->handle, CURLOPT_HEADERDATA, leg);
+  curl_easy_setopt (leg->handle, CURLOPT_WRITEDATA, leg);
+  curl_easy_setopt (leg->handle, CURLOPT_PRIVATE, source);
+#if LIBCURL_VERSION_NUM >= 0x072000
+  if (source->progress_func)
+    curl_easy_setopt (leg->handle, CURLOPT_XFERINFODATA, leg);
+  else
+#endif
+    curl_easy_setopt (leg->handle, CURLOPT_NOPROGRESS, 1L);
+  curl_multi_add_handle (thiz->multi_handle, leg->handle);
+
+  return leg;
+}
+
+/*
+ * Issue the duplicate requests that are due and drop the requests that lost
+ * their race. Returns the time in ms until the next hedge is due, or -1.
+ *
+ * must be called from the worker
+ */
+static glong
+gst_curl_multi_context_hedge (GstCurlMultiContext * thiz)
+{
+  GList *walk, *next;
+  gint64 now, due;
+  glong timeout = -1;
+  guint i;
+
+  now = g_get_monotonic_time ();
+  for (walk = thiz->hedged_sources; walk; walk = next) {
+    GstCurlMultiContextSource *source = walk->data;
+    GstCurlMultiContextLeg *hedge;
+    gint64 threshold;
+    glong ms;
+
+    next = walk->next;
+
+    if (source->winner) {
+      for (i = 0; i < source->n_legs; i++) {
+        if (&source->legs[i] != source->winner)
+          gst_curl_multi_context_drop_leg (thiz, &source->legs[i]);
+      }
+      thiz->hedged_sources = g_list_delete_link (thiz->hedged_sources, walk);
+      continue;
+    }
+
+    /* Already racing */
+    if (source->n_legs > 1 || !source->hedge_percentile)
+      continue;
+
+    threshold = gst_curl_multi_context_ttfb_percentile (thiz,
+        source->hedge_percentile);
+    if (threshold < 0)
+      continue;
+
+    due = source->added_time + threshold;
+    if (now < due) {
+      ms = (glong) ((due - now) / 1000) + 1;
+      if (timeout < 0 || ms < timeout)
+        timeout = ms;
+      continue;
+    }
+
+    if (thiz->hedges_issued + 1 >
+        thiz->hedge_requests * source->hedge_max_rate) {
+      GST_TRACE ("Hedging rate exhausted");
+      continue;
+    }
+
+    hedge = gst_curl_multi_context_add_leg (thiz, source, NULL, NULL, 0);
+    if (hedge == NULL)
+      continue;
+
+    /* Race on another connection */
+    curl_easy_setopt (hedge->handle, CURLOPT_FRESH_CONNECT, 1L);
+    thiz->hedges_issued++;
+
+    GST_INFO ("No first byte after %" G_GINT64_FORMAT " us, hedging request",
+        now - source->added_time);
+  }
+
+  return timeout;
+}
+
+/*
+ * Returns TRUE if the finished handle is a leg that must not terminate the
+ * source, either because it lost or because it failed while another request
+ * is still running.
+ *
+ * must be called from the worker
+ */
+static gboolean
+gst_curl_multi_context_leg_done (GstCurlMultiContext * thiz,
+    GstCurlMultiContextSource * source, CURL * handle, CURLcode result)
+{
+  GstCurlMultiContextLeg *leg = NULL, *other = NULL;
+  guint i;
+
+  for (i = 0; i < source->n_legs; i++) {
+    if (source->legs[i].handle == handle)
+      leg = &source->legs[i];
+    else if (source->legs[i].handle != NULL && other == NULL)
+      other = &source->legs[i];
+  }
+
+  if (leg == NULL)
+    return FALSE;
+
+  if (source->winner ? source->winner != leg :
+      (result != CURLE_OK && other != NULL)) {
+    gst_curl_multi_context_drop_leg (thiz, leg);
+    if (!source->winner && source->easy_handle == handle)
+      gst_curl_multi_context_switch_leg (source, other);
+    return TRUE;
+  }
+
+  /* This request ends the source, the element owns its handle */
+  if (source->easy_handle != handle)
+    gst_curl_multi_context_switch_leg (source, leg);
+  for (i = 0; i < source->n_legs; i++) {
+    if (&source->legs[i] != leg)
+      gst_curl_multi_context_drop_leg (thiz, &source->legs[i]);
+  }
+  gst_curl_multi_context_leg_clear (leg);
+  leg->handle = NULL;
+  thiz->hedged_sources = g_list_remove (thiz->hedged_sources, source);
+  return FALSE;
+}
+
+/*
+ * Spilling: when the element falls behind, what it has not taken yet goes to
+ * an unlinked temporary file used as a ring, written with pwrite and read back
+ * through a map of it. The buffers read back wrap the map without a copy and
+ * hold the file until they are freed, their part of the ring is only written
+ * again once they and the ones before them are gone. The transfer is paused
+ * while the file is full, or could not be created. The disk is only touched
+ * by the worker, without the source lock.
+ */
+static GstCurlMultiContextSpill *
+gst_curl_multi_context_spill_new (gsize size)
+{
+  GstCurlMultiContextSpill *spill;
+  GError *err = NULL;
+  gchar *path;
+  gpointer map;
+  gint fd;
+
+  fd = g_file_open_tmp ("curlhttpsrc-XXXXXX", &path, &err);
+  if (fd < 0) {
+    GST_WARNING ("Couldn't create the spill file: %s", err->message);
+    g_error_free (err);
+    return NULL;
+  }
+  unlink (path);
+  g_free (path);
+
+  if (ftruncate (fd, size) < 0 ||
+      (map = mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    GST_WARNING ("Couldn't map a spill file of %" G_GSIZE_FORMAT " bytes: %s",
+        size, g_strerror (errno));
+    close (fd);
+    return NULL;
+  }
+
+  GST_DEBUG ("Spilling to a file of %" G_GSIZE_FORMAT " bytes", size);
+  spill = g_new0 (GstCurlMultiContextSpill, 1);
+  spill->refcount = 1;
+  spill->fd = fd;
+  spill->map = map;
+  spill->size = size;
+  g_mutex_init (&spill->lock);
+  g_queue_init (&spill->chunks);
+
+  return spill;
+}
+
+static void
+gst_curl_multi_context_spill_unref (GstCurlMultiContextSpill * spill)
+{
+  if (!g_atomic_int_dec_and_test (&spill->refcount))
+    return;
+
+  munmap (spill->map, spill->size);
+  close (spill->fd);
+  g_mutex_clear (&spill->lock);
+  g_free (spill);
+}
+
+/* A buffer read back is freed, release its part of the ring */
+static void
+gst_curl_multi_context_spill_release (gpointer data)
+{
+  GstCurlMultiContextSpillChunk *chunk = data, *head;
+  GstCurlMultiContextSpill *spill = chunk->spill;
+
+  g_mutex_lock (&spill->lock);
+  chunk->done = TRUE;
+  while ((head = g_queue_peek_head (&spill->chunks)) && head->done) {
+    spill->released = head->end;
+    g_slice_free (GstCurlMultiContextSpillChunk,
+        g_queue_pop_head (&spill->chunks));
+  }
+  g_mutex_unlock (&spill->lock);
+
+  gst_curl_multi_context_spill_unref (spill);
+}
+
+/*
+ * Bytes that can be written to the spill file without overwriting data not
+ * released yet.
+ *
+ * must be called from the worker
+ */
+static gsize
+gst_curl_multi_context_spill_room (GstCurlMultiContextSource * source)
+{
+  GstCurlMultiContextSpill *spill = source->spill;
+  guint64 released;
+
+  g_mutex_lock (&spill->lock);
+  released = spill->released;
+  g_mutex_unlock (&spill->lock);
+
+  return spill->size - (gsize) (source->spill_write - released);
+}
+
+/* must be called from the worker */
+static gboolean
+gst_curl_multi_context_spill_full (GstCurlMultiContextSource * source,
+    gsize bytes)
+{
+  if (!source->spill_threshold || !g_atomic_int_get (&source->spilling))
+    return FALSE;
+
+  /* No file, the data waits in memory and must not grow without bounds */
+  if (!source->spill)
+    return TRUE;
+
+  return gst_curl_multi_context_spill_room (source) < bytes;
+}
+
+/* must be called from the worker, without the source lock */
+static gboolean
+gst_curl_multi_context_spill_write (GstCurlMultiContextSource * source,
+    GstBuffer * buf, gsize size)
+{
+  GstCurlMultiContextSpill *spill = source->spill;
+#if GST_CHECK_VERSION(1,0,0)
+  GstMapInfo info;
+#endif
+  const guint8 *data;
+  gsize done = 0, offset, n;
+  gssize written;
+
+#if GST_CHECK_VERSION(1,0,0)
+  if (!gst_buffer_map (buf, &info, GST_MAP_READ))
+    return FALSE;
+  data = info.data;
+#else
+  data = GST_BUFFER_DATA (buf);
+#endif
+
+  while (done < size) {
+    offset = (source->spill_write + done) % spill->size;
+    n = MIN (size - done, spill->size - offset);
+    written = pwrite (spill->fd, data + done, n, offset);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0) {
+      GST_WARNING ("Couldn't write to the spill file: %s", g_strerror (errno));
+      break;
+    }
+    done += written;
+  }
+
+#if GST_CHECK_VERSION(1,0,0)
+  gst_buffer_unmap (buf, &info);
+#endif
+
+  return done == size;
+}
+
+/*
+ * Called from the worker, instead of queueing the buffer in memory.
+ */
+static void
+gst_curl_multi_context_spill (GstCurlMultiContextSource * source,
+    GstBuffer * buf)
+{
+  GstCurlMultiContextSpill *spill;
+  gsize size = GSTCURL_BUFFER_SIZE (buf);
+  gboolean pending, written = FALSE;
+
+  g_mutex_lock (&source->mutex);
+  g_atomic_int_set (&source->spilling, 1);
+  pending = !g_queue_is_empty (&source->spill_pending);
+  g_mutex_unlock (&source->mutex);
+
+  /* Behind what is pending, or it would be read back out of order */
+  if (!pending && !source->spill &&
+      (spill = gst_curl_multi_context_spill_new (source->spill_max))) {
+    g_mutex_lock (&source->mutex);
+    source->spill = spill;
+    g_mutex_unlock (&source->mutex);
+  }
+  if (!pending && source->spill &&
+      gst_curl_multi_context_spill_room (source) >= size)
+    written = gst_curl_multi_context_spill_write (source, buf, size);
+
+  g_mutex_lock (&source->mutex);
+  if (written) {
+    source->spill_write += size;
+    g_atomic_int_add (&source->spill_used, size);
+  } else {
+    /* Only what cannot be paused, the followers of a transfer */
+    g_queue_push_tail (&source->spill_pending, buf);
+    buf = NULL;
+  }
+  /* The element may have read everything back meanwhile */
+  g_atomic_int_set (&source->spilling, 1);
+  g_cond_signal (&source->signal);
+  g_mutex_unlock (&source->mutex);
+
+  if (buf)
+    gst_buffer_unref (buf);
+}
+
+/*
+ * Read back the oldest spilled data.
+ *
+ * must be called by the element with the source lock
+ */
+static GstBuffer *
+gst_curl_multi_context_unspill (GstCurlMultiContextSource * source)
+{
+  GstCurlMultiContextSpill *spill = source->spill;
+  GstCurlMultiContextSpillChunk *chunk;
+  GstBuffer *buf;
+  gsize offset, n;
+
+  if (source->spill_read < source->spill_write) {
+    offset = source->spill_read % spill->size;
+    n = MIN (source->spill_write - source->spill_read, spill->size - offset);
+    n = MIN (n, GST_CURL_MULTI_CONTEXT_SPILL_CHUNK);
+
+    chunk = g_slice_new (GstCurlMultiContextSpillChunk);
+    chunk->spill = spill;
+    chunk->end = source->spill_read + n;
+    chunk->done = FALSE;
+    g_atomic_int_inc (&spill->refcount);
+    g_mutex_lock (&spill->lock);
+    g_queue_push_tail (&spill->chunks, chunk);
+    g_mutex_unlock (&spill->lock);
+
+    buf = gst_buffer_new ();
+#if GST_CHECK_VERSION(1,0,0)
+    gst_buffer_append_memory (buf,
+        gst_memory_new_wrapped (GST_MEMORY_FLAG_READONLY, spill->map + offset,
+            n, 0, n, chunk, gst_curl_multi_context_spill_release));
+#else
+    GST_BUFFER_DATA (buf) = spill->map + offset;
+    GST_BUFFER_SIZE (buf) = n;
+    GST_BUFFER_MALLOCDATA (buf) = (guint8 *) chunk;
+    GST_BUFFER_FREE_FUNC (buf) = gst_curl_multi_context_spill_release;
+#endif
+    source->spill_read += n;
+    g_atomic_int_add (&source->spill_used, -(gint) n);
+  } else {
+    buf = g_queue_pop_head (&source->spill_pending);
+  }
+
+  if (source->spill_read == source->spill_write &&
+      g_queue_is_empty (&source->spill_pending))
+    g_atomic_int_set (&source->spilling, 0);
+
+  return buf;
+}
+
+/* must be called by the element with the source lock, once the worker is done */
+static void
+gst_curl_multi_context_spill_clear (GstCurlMultiContextSource * source)
+{
+  gpointer buf;
+
+  while ((buf = g_queue_pop_head (&source->spill_pending)))
+    gst_buffer_unref (GST_BUFFER_CAST (buf));
+
+  /* The buffers still out keep the file until they are freed */
+  if (source->spill) {
+    gst_curl_multi_context_spill_unref (source->spill);
+    source->spill = NULL;
+  }
+  source->spill_read = source->spill_write = 0;
+  g_atomic_int_set (&source->spill_used, 0);
+  g_atomic_int_set (&source->spilling, 0);
+}
+
+/*
+ * TRUE if the element is paused with enough data ahead of it. The transfer is
+ * then paused until it plays again, on the same connection if the server
+ * kept it.
+ */
+static gboolean
+gst_curl_multi_context_suspended (GstCurlMultiContextSource * source)
+{
+  return g_atomic_int_get (&source->suspend) &&
+      gst_curl_multi_context_source_level (source) >=
+      source->suspend_lookahead;
+}
+
+/*
+ * Bandwidth sharing: each running source has a token bucket refilled with its
+ * weighted share of max_rate, and a source out of tokens is paused. The
+ * context has a bucket refilled with the whole of max_rate, when it is more
+ * than half full the bandwidth left by the idle sources is spare and the
+ * sources out of tokens may borrow from it.
+ */
+static gint64
+gst_curl_multi_context_burst (GstCurlMultiContext * thiz)
+{
+  return thiz->max_rate * GST_CURL_MULTI_CONTEXT_BURST_MS / 1000;
+}
+
+static gint
+gst_curl_multi_context_compare_deadline (gconstpointer a, gconstpointer b)
+{
+  const GstCurlMultiContextSource *sa = a;
+  const GstCurlMultiContextSource *sb = b;
+
+  return (sa->deadline > sb->deadline) - (sa->deadline < sb->deadline);
+}
+
+/*
+ * Get the bytes left to receive and the average rate of a transfer. Returns
+ * FALSE until both are known.
+ */
+static gboolean
+gst_curl_multi_context_progress (CURL * handle, gdouble * remaining,
+    gdouble * speed)
+{
+#if LIBCURL_VERSION_NUM >= 0x073700
+  curl_off_t length = -1, size = 0, rate = 0;
+
+  curl_easy_getinfo (handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+  curl_easy_getinfo (handle, CURLINFO_SIZE_DOWNLOAD_T, &size);
+  curl_easy_getinfo (handle, CURLINFO_SPEED_DOWNLOAD_T, &rate);
+#else
+  gdouble length = -1, size = 0, rate = 0;
+
+  curl_easy_getinfo (handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &length);
+  curl_easy_getinfo (handle, CURLINFO_SIZE_DOWNLOAD, &size);
+  curl_easy_getinfo (handle, CURLINFO_SPEED_DOWNLOAD, &rate);
+#endif
+
+  *remaining = MAX ((gdouble) length - (gdouble) size, 0);
+  *speed = rate;
+
+  return length >= 0 && rate > 0;
+}
+
+/*
+ * Earliest deadline first. The sources with a deadline get, in deadline
+ * order, the rate they need to finish in time out of the bandwidth cap. With
+ * no cap, the sources without a deadline are held back while one with a
+ * deadline is predicted to miss it, for at most HOLD_MAX_MS in a row and
+ * not for a deadline already passed. A predicted miss is reported to the
+ * element once per request, as soon as the rate of the transfer is known.
+ * Returns the cap left for the sources to share by weight.
+ *
+ * must be called from the worker
+ */
+static gdouble
+gst_curl_multi_context_schedule (GstCurlMultiContext * thiz, gint64 now)
+{
+  GList *walk, *edf = NULL;
+  gdouble budget = thiz->max_rate;
+  gboolean at_risk = FALSE;
+
+  for (walk = thiz->active_sources; walk; walk = walk->next) {
+    GstCurlMultiContextSource *source = walk->data;
+
+    source->rate = 0;
+    if (source->deadline)
+      edf = g_list_insert_sorted (edf, source,
+          gst_curl_multi_context_compare_deadline);
+  }
+
+  for (walk = edf; walk; walk = walk->next) {
+    GstCurlMultiContextSource *source = walk->data;
+    gdouble remaining, speed;
+    gint64 left = source->deadline - now, predicted;
+    gboolean known;
+
+    known = gst_curl_multi_context_progress (source->easy_handle, &remaining,
+        &speed);
+
+    if (left <= 0) {
+      predicted = now;
+    } else if (!known) {
+      /* Nothing to predict from yet */
+      continue;
+    } else {
+      if (thiz->max_rate) {
+        source->rate = MIN (remaining * G_USEC_PER_SEC / left, budget);
+        budget -= source->rate;
+        speed = MIN (speed, source->rate);
+      }
+      if (speed <= 0)
+        predicted = G_MAXINT64;
+      else
+        predicted = now + (gint64) (remaining * G_USEC_PER_SEC / speed);
+    }
+
+    if (predicted <= source->deadline)
+      continue;
+
+    /* Holding the others back cannot save a request already late */
+    if (left > 0)
+      at_risk = TRUE;
+    if (!source->miss_reported) {
+      GST_INFO ("Transfer predicted to end %" G_GINT64_FORMAT " us after its "
+          "deadline", predicted == G_MAXINT64 ? -1 :
+          predicted - source->deadline);
+      source->miss_reported = TRUE;
+      g_mutex_lock (&source->mutex);
+      source->deadline_missed = TRUE;
+      source->predicted_end = predicted;
+      g_cond_signal (&source->signal);
+      g_mutex_unlock (&source->mutex);
+    }
+  }
+  g_list_free (edf);
+
+  /* The hold restarts only once no deadline is at risk anymore */
+  if (!at_risk || thiz->max_rate)
+    thiz->held_since = 0;
+  else if (!thiz->held_since)
+    thiz->held_since = now;
+  at_risk = thiz->held_since &&
+      now - thiz->held_since < GST_CURL_MULTI_CONTEXT_HOLD_MAX_MS * 1000;
+
+  for (walk = thiz->active_sources; walk; walk = walk->next) {
+    GstCurlMultiContextSource *source = walk->data;
+
+    source->held = at_risk && !source->deadline;
+  }
+
+  return budget;
+}
+
+/*
+ * Refill the buckets and resume the sources that can receive again. Returns
+ * the time in ms until the sources must be checked again, or -1.
+ *
+ * must be called from the worker
+ */
+static glong
+gst_curl_multi_context_refill (GstCurlMultiContext * thiz)
+{
+  GList *walk;
+  gint64 now, elapsed, burst;
+  guint64 weights = 0;
+  gdouble spare;
+  gboolean paused = FALSE, deadlines = FALSE;
+
+  now = g_get_monotonic_time ();
+  elapsed = MIN (now - thiz->last_refill, G_USEC_PER_SEC);
+  thiz->last_refill = now;
+  burst = gst_curl_multi_context_burst (thiz);
+  spare = gst_curl_multi_context_schedule (thiz, now);
+
+  if (thiz->max_rate) {
+    thiz->tokens = MIN (thiz->tokens +
+        (gint64) (thiz->max_rate * elapsed / G_USEC_PER_SEC), burst);
+    for (walk = thiz->active_sources; walk; walk = walk->next) {
+      GstCurlMultiContextSource *source = walk->data;
+      weights += source->weight;
+    }
+  }
+
+  for (walk = thiz->active_sources; walk; walk = walk->next) {
+    GstCurlMultiContextSource *source = walk->data;
+
+    if (source->deadline)
+      deadlines = TRUE;
+
+    if (thiz->max_rate && weights) {
+      gdouble rate = source->rate + spare * source->weight / weights;
+
+      source->tokens = MIN (source->tokens +
+          (gint64) (rate * elapsed / G_USEC_PER_SEC),
+          (gint64) (rate * GST_CURL_MULTI_CONTEXT_BURST_MS / 1000));
+    }
+
+    if (!source->paused)
+      continue;
+
+    /* A cancel is only seen by the element once the handle runs again */
+    if (((thiz->max_rate && source->tokens <= 0 && thiz->tokens <= burst / 2)
+            || source->held || gst_curl_multi_context_suspended (source)
+            || gst_curl_multi_context_spill_full (source,
+                GST_CURL_MULTI_CONTEXT_SPILL_CHUNK)) && !source->cancel) {
+      paused = TRUE;
+      continue;
+    }
+
+    source->paused = FALSE;
+    curl_easy_pause (source->easy_handle, CURLPAUSE_CONT);
+  }
+
+  if (paused)
+    return GST_CURL_MULTI_CONTEXT_REFILL_MS;
+  return deadlines ? GST_CURL_MULTI_CONTEXT_SCHEDULE_MS : -1;
+}
+
+/*
+ * Coalescing: a source added while an identical request is in flight becomes
+ * a follower of it instead of issuing its own. The leader hands each buffer
+ * it receives to its followers, and keeps what it got so far to be replayed
+ * to the followers that join late.
+ */
+
+/* must be called from the worker */
+static void
+gst_curl_multi_context_replay_clear (GstCurlMultiContextSource * source)
+{
+  gpointer data;
+
+  while ((data = g_queue_pop_head (&source->replay_headers)))
+    g_free (data);
+  while ((data = g_queue_pop_head (&source->replay_buffers)))
+    gst_buffer_unref (GST_BUFFER_CAST (data));
+  source->replay_size = 0;
+}
+
+/*
+ * TRUE if the transfer of a running source can still be joined by another
+ * one, with everything it received so far kept for the replay.
+ */
+static gboolean
+gst_curl_multi_context_can_lead (GstCurlMultiContextSource * leader,
+    GstCurlMultiContextSource * source)
+{
+  return leader->key && !leader->replay_full && !leader->cancel &&
+      strcmp (leader->key, source->key) == 0;
+}
+
+/* must be called from the worker */
+static GstCurlMultiContextSource *
+gst_curl_multi_context_find_leader (GstCurlMultiContext * thiz,
+    GstCurlMultiContextSource * source)
+{
+  GList *walk;
+
+  for (walk = thiz->active_sources; walk; walk = walk->next) {
+    GstCurlMultiContextSource *other = walk->data;
+
+    if (gst_curl_multi_context_can_lead (other, source))
+      return other;
+  }
+
+  return NULL;
+}
+
+/* must be called from the worker with the source lock, once done is set */
+static void
+gst_curl_multi_context_signal_done (GstCurlMultiContextSource * source)
+{
+  if (source->done_func)
+    source->done_func (source->func_data);
+  g_cond_signal (&source->signal);
+}
+
+/* must be called from the worker */
+static void
+gst_curl_multi_context_detach (GstCurlMultiContextSource * source)
+{
+  source->leader = NULL;
+
+  g_mutex_lock (&source->mutex);
+  source->done = TRUE;
+  source->status = GST_CURL_MULTI_CONTEXT_SOURCE_STATUS_OK;
+  source->curl_code = CURLE_OK;
+  source->response_code = 0;
+  gst_curl_multi_context_signal_done (source);
+  g_mutex_unlock (&source->mutex);
+}
+
+static void
+gst_curl_multi_context_source_terminate (GstCurlMultiContextSource * source,
+    CURL * handle, CURLcode result);
+
+#if LIBCURL_VERSION_NUM >= 0x072000
+/* Run the stall detection of a follower, TRUE if it gives up on its leader */
+static gboolean
+gst_curl_multi_context_follower_stalled (GstCurlMultiContextSource * leader,
+    GstCurlMultiContextSource * source)
+{
+  curl_off_t now = 0, total = -1;
+
+#if LIBCURL_VERSION_NUM >= 0x073700
+  curl_easy_getinfo (leader->easy_handle, CURLINFO_SIZE_DOWNLOAD_T, &now);
+  curl_easy_getinfo (leader->easy_handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+      &total);
+#else
+  gdouble dnow = 0, dtotal = -1;
+
+  curl_easy_getinfo (leader->easy_handle, CURLINFO_SIZE_DOWNLOAD, &dnow);
+  curl_easy_getinfo (leader->easy_handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD,
+      &dtotal);
+  now = (curl_off_t) dnow;
+  total = (curl_off_t) dtotal;
+#endif
+
+  return source->progress_func (source->func_data, total, now, 0, 0) != 0;
+}
+#endif
+
+/*
+ * Run the transfer of a source, with its hedge and race legs.
+ *
+ * must be called from the worker
+ */
+static void
+gst_curl_multi_context_start (GstCurlMultiContext * thiz,
+    GstCurlMultiContextSource * source, CURL * handle)
+{
+  if (source) {
+    if (!thiz->active_sources)
+      thiz->last_refill = g_get_monotonic_time ();
+    thiz->active_sources = g_list_prepend (thiz->active_sources, source);
+  }
+  if (source && (source->hedge_percentile || source->race_urls)) {
+    guint i;
+
+    source->added_time = g_get_monotonic_time ();
+    source->legs[0].source = source;
+    source->legs[0].handle = handle;
+    source->legs[0].tag = 0;
+    source->legs[0].status = 0;
+    g_queue_init (&source->legs[0].headers);
+    source->n_legs = 1;
+
+    curl_easy_setopt (handle, CURLOPT_HEADERFUNCTION,
+                      gst_curl_multi_context_leg_header);
+    curl_easy_setopt (handle, CURLOPT_HEADERDATA, &source->legs[0]);
+    curl_easy_setopt (handle, CURLOPT_WRITEFUNCTION,
+                      gst_curl_multi_context_leg_write);
+    curl_easy_setopt (handle, CURLOPT_WRITEDATA, &source->legs[0]);
+#if LIBCURL_VERSION_NUM >= 0x072000
+    if (source->progress_func) {
+      curl_easy_setopt (handle, CURLOPT_XFERINFOFUNCTION,
+                        gst_curl_multi_context_leg_progress);
+      curl_easy_setopt (handle, CURLOPT_XFERINFODATA, &source->legs[0]);
+    }
+#endif
+
+    for (i = 0; source->race_urls && source->race_urls[i]; i++) {
+      GST_DEBUG ("Racing against %s", source->race_urls[i]);
+      gst_curl_multi_context_add_leg (thiz, source, source->race_urls[i],
+          source->race_unix_sockets ? source->race_unix_sockets[i] : NULL,
+          i + 1);
+    }
+
+    thiz->hedged_sources = g_list_prepend (thiz->hedged_sources, source);
+    if (source->hedge_percentile)
+      thiz->hedge_requests++;
+  }
+  curl_multi_add_handle (thiz->multi_handle, handle);
+  thiz->sources++;
+}
+
+/*
+ * Replay to the joining followers what their leader received so far, and let
+ * go of the followers that were cancelled. A follower joining a leader that
+ * ended, or that cannot replay everything anymore, runs its own transfer
+ * instead of starting mid-stream. The followers have no progress callback of
+ * their own, their stall detection runs on what their leader received.
+ *
+ * must be called from the worker
+ */
+static void
+gst_curl_multi_context_coalesce (GstCurlMultiContext * thiz)
+{
+  GList *walk, *f, *next;
+
+  for (walk = thiz->joining; walk; walk = walk->next) {
+    GstCurlMultiContextSource *source = walk->data;
+    GstCurlMultiContextSource *leader = source->leader;
+
+    if (!g_list_find (thiz->active_sources, leader) ||
+        !gst_curl_multi_context_can_lead (leader, source)) {
+      GST_DEBUG ("Cannot join the transfer anymore, running it on its own");
+      source->leader = NULL;
+      gst_curl_multi_context_start (thiz, source, source->easy_handle);
+      continue;
+    }
+
+    for (f = leader->replay_headers.head; f; f = f->next)
+      source->header_func (f->data, 1, strlen (f->data), source->func_data);
+    for (f = leader->replay_buffers.head; f; f = f->next)
+      source->buffer_func (gst_buffer_ref (GST_BUFFER_CAST (f->data)),
+          GSTCURL_BUFFER_SIZE (GST_BUFFER_CAST (f->data)), source->func_data);
+    leader->followers = g_list_append (leader->followers, source);
+  }
+  g_list_free (thiz->joining);
+  thiz->joining = NULL;
+
+  for (walk = thiz->active_sources; walk; walk = walk->next) {
+    GstCurlMultiContextSource *leader = walk->data;
+
+    for (f = leader->followers; f; f = next) {
+      GstCurlMultiContextSource *source = f->data;
+
+      next = f->next;
+      if (source->cancel) {
+        leader->followers = g_list_delete_link (leader->followers, f);
+        gst_curl_multi_context_detach (source);
+      }
+#if LIBCURL_VERSION_NUM >= 0x072000
+      else if (source->progress_func && !leader->paused &&
+          gst_curl_multi_context_follower_stalled (leader, source)) {
+        leader->followers = g_list_delete_link (leader->followers, f);
+        source->leader = NULL;
+        gst_curl_multi_context_source_terminate (source, leader->easy_handle,
+            CURLE_ABORTED_BY_CALLBACK);
+      }
+#endif
+    }
+  }
+}
+
+/*
+ * The transfer of a leader ended, so did the one of its followers. If the
+ * leader was cancelled they got an interrupted transfer, to be resumed on
+ * their own.
+ *
+ * must be called from the worker
+ */
+static void
+gst_curl_multi_context_release_followers (GstCurlMultiContextSource * source,
+    CURL * handle, CURLcode result)
+{
+  GList *walk;
+
+  if (source->cancel && result != CURLE_OK)
+    result = CURLE_PARTIAL_FILE;
 
-#define GSTCURL_CLIENT_ERR_RESPONSE(x) ((x >= 400) && (x <= 499))
-#define GSTCURL_SERVER_ERR_RESPONSE(x) ((x >= 500) && (x <= 599))
+  for (walk = source->followers; walk; walk = walk->next) {
+    GstCurlMultiContextSource *follower = walk->data;
+
+    follower->leader = NULL;
+    gst_curl_multi_context_source_terminate (follower, handle, result);
+  }
+  g_list_free (source->followers);
+  source->followers = NULL;
+  gst_curl_multi_context_replay_clear (source);
+}
 
 static void
-gst_curl_multi_context_source_terminate (GstCurlMultiContextSource * source)
+gst_curl_multi_context_source_terminate (GstCurlMultiContextSource * source,
+    CURL * handle, CURLcode result)
 {
   glong curl_info_long;
   gdouble curl_info_dbl;
   gchar *url;
 
   g_mutex_lock (&source->mutex);
-  curl_easy_getinfo (source->easy_handle, CURLINFO_EFFECTIVE_URL, &url);
+  curl_easy_getinfo (handle, CURLINFO_EFFECTIVE_URL, &url);
   source->done = TRUE;
+  source->curl_code = result;
+  source->response_code = 0;
 
   /* Get back the return code for the session */
-  if (curl_easy_getinfo (source->easy_handle, CURLINFO_RESPONSE_CODE,
+  if (curl_easy_getinfo (handle, CURLINFO_RESPONSE_CODE,
           &curl_info_long) != CURLE_OK) {
     /* Curl cannot be relied on in this state, so return an error. */
     source->status = GST_CURL_MULTI_CONTEXT_SOURCE_STATUS_ERROR;
-  } else if (GSTCURL_CLIENT_ERR_RESPONSE (curl_info_long)) {
+    gst_curl_multi_context_signal_done (source);
+    g_mutex_unlock (&source->mutex);
+    return;
+  }
+
+  source->response_code = curl_info_long;
+  if (GSTCURL_CLIENT_ERR_RESPONSE (curl_info_long)) {
     GST_ERROR ("Get for URI %s received client error code %ld",
         url, curl_info_long);
     source->status = GST_CURL_MULTI_CONTEXT_SOURCE_STATUS_ERROR;
@@ -40,13 +1187,13 @@ gst_curl_multi_context_source_terminate (GstCurlMultiContextSource * source)
      * server took place. Check for timeouts so we can try again if retries are
      * > 0. Alternatively, this could be for an SSL-related error,
      */
-    if (curl_easy_getinfo (source->easy_handle, CURLINFO_TOTAL_TIME,
+    if (curl_easy_getinfo (handle, CURLINFO_TOTAL_TIME,
                            &curl_info_dbl) != CURLE_OK) {
       /* Curl cannot be relied on in this state, so return an error. */
       source->status = GST_CURL_MULTI_CONTEXT_SOURCE_STATUS_ERROR;
     }
 
-    if (curl_easy_getinfo (source->easy_handle, CURLINFO_OS_ERRNO,
+    if (curl_easy_getinfo (handle, CURLINFO_OS_ERRNO,
                            &curl_info_long) != CURLE_OK) {
       /* Curl cannot be relied on in this state, so return an error. */
       source->status = GST_CURL_MULTI_CONTEXT_SOURCE_STATUS_ERROR;
@@ -54,7 +1201,15 @@ gst_curl_multi_context_source_terminate (GstCurlMultiContextSource * source)
 
     source->status = GST_CURL_MULTI_CONTEXT_SOURCE_STATUS_OK;
   }
-  g_cond_signal (&source->signal);
+
+  /* A connection dropped mid-body still carries a 2xx response code */
+  if (result != CURLE_OK &&
+      source->status == GST_CURL_MULTI_CONTEXT_SOURCE_STATUS_OK) {
+    GST_WARNING ("Transfer for URI %s failed: %s", url,
+        curl_easy_strerror (result));
+    source->status = GST_CURL_MULTI_CONTEXT_SOURCE_STATUS_ERROR;
+  }
+  gst_curl_multi_context_signal_done (source);
   g_mutex_unlock (&source->mutex);
 }
 
@@ -64,6 +1219,9 @@ gst_curl_multi_context_process_msgs (GstCurlMultiContext * thiz)
   CURLMsg *curl_message;
   int nmsgs;
 
+  /* The followers that just joined must get the data before it ends */
+  gst_curl_multi_context_coalesce (thiz);
+
   /*
    * Check the CURL message buffer to find out if any transfers have
    * completed. If they have, call the signal_finished function which
@@ -80,9 +1238,219 @@ gst_curl_multi_context_process_msgs (GstCurlMultiContext * thiz)
     if (!source)
       continue;
 
+    if (source->n_legs && gst_curl_multi_context_leg_done (thiz,
+            source, easy_handle, curl_message->data.result))
+      continue;
+
     thiz->sources--;
+    thiz->active_sources = g_list_remove (thiz->active_sources, source);
     curl_multi_remove_handle (thiz->multi_handle, easy_handle);
-    gst_curl_multi_context_source_terminate (source);
+    gst_curl_multi_context_release_followers (source, easy_handle,
+        curl_message->data.result);
+    gst_curl_multi_context_source_terminate (source, easy_handle,
+        curl_message->data.result);
+  }
+}
+
+/* must be called with the context lock, right before releasing it */
+static void
+gst_curl_multi_context_held (GstCurlMultiContext * thiz, gint64 since)
+{
+  gint64 held = g_get_monotonic_time () - since;
+
+  thiz->hold_total += held;
+  thiz->holds++;
+  if (held > thiz->hold_max) {
+    thiz->hold_max = held;
+    GST_DEBUG ("Context lock held for %" G_GINT64_FORMAT " us", held);
+  }
+}
+
+/*
+ * Commands: the elements never touch the multi handle or the lists of the
+ * worker. They push their request on a lock-free stack and wake the worker
+ * up through the pipe it watches, in select or while idle. No lock is taken,
+ * the elements post with their source lock held.
+ */
+static void
+gst_curl_multi_context_wakeup (GstCurlMultiContext * thiz)
+{
+  if (thiz->wakeup[1] >= 0 && write (thiz->wakeup[1], "", 1) < 0)
+    GST_TRACE ("Wake up pipe full, the worker is awake anyway");
+}
+
+static void
+gst_curl_multi_context_drain_wakeup (GstCurlMultiContext * thiz)
+{
+  gchar buf[64];
+
+  while (read (thiz->wakeup[0], buf, sizeof (buf)) > 0);
+}
+
+static void
+gst_curl_multi_context_post (GstCurlMultiContext * thiz,
+    GstCurlMultiContextCommandType type, GstCurlMultiContextSource * source,
+    CURL * handle, gint64 value)
+{
+  GstCurlMultiContextCommand *command;
+
+  command = g_new0 (GstCurlMultiContextCommand, 1);
+  command->type = type;
+  command->source = source;
+  command->handle = handle;
+  command->value = value;
+
+  do {
+    command->next = g_atomic_pointer_get (&thiz->commands);
+  } while (!g_atomic_pointer_compare_and_exchange (&thiz->commands,
+          command->next, command));
+
+  gst_curl_multi_context_wakeup (thiz);
+}
+
+/* must be called from the worker with the context lock */
+static void
+gst_curl_multi_context_do_add (GstCurlMultiContext * thiz, CURL * handle,
+    gint64 posted)
+{
+  GstCurlMultiContextSource *source = NULL;
+  gchar *url;
+  gint64 wait;
+
+  curl_easy_getinfo (handle, CURLINFO_EFFECTIVE_URL, &url);
+  curl_easy_getinfo (handle, CURLINFO_PRIVATE, (char **) &source);
+
+  wait = g_get_monotonic_time () - posted;
+  if (wait > thiz->add_wait_max)
+    thiz->add_wait_max = wait;
+  if (source) {
+    source->context = thiz;
+    source->leader = NULL;
+    source->replay_full = FALSE;
+    gst_curl_multi_context_replay_clear (source);
+    source->winner = NULL;
+    source->n_legs = 0;
+    source->paused = FALSE;
+    source->tokens = 0;
+    source->rate = 0;
+    source->held = FALSE;
+    source->miss_reported = FALSE;
+    source->removed = FALSE;
+    g_atomic_int_set (&source->suspended, 0);
+
+    if (source->key && (source->leader =
+            gst_curl_multi_context_find_leader (thiz, source))) {
+      /* Replayed what the leader got so far on the next round */
+      GST_DEBUG ("Coalescing with the request in flight for URI %s", url);
+      thiz->joining = g_list_append (thiz->joining, source);
+      return;
+    }
+
+  }
+
+  gst_curl_multi_context_start (thiz, source, handle);
+}
+
+/* The last the worker does with a removed source */
+static void
+gst_curl_multi_context_release (GstCurlMultiContextSource * source)
+{
+  g_mutex_lock (&source->mutex);
+  source->removed = TRUE;
+  g_cond_signal (&source->signal);
+  g_mutex_unlock (&source->mutex);
+}
+
+/*
+ * Take a cancelled source out right away instead of waiting for its next
+ * callback, which may never come on a stalled connection. Its followers are
+ * interrupted and resume on their own.
+ *
+ * must be called from the worker with the context lock
+ */
+static void
+gst_curl_multi_context_do_remove (GstCurlMultiContext * thiz,
+    GstCurlMultiContextSource * source)
+{
+  CURL *handle;
+  guint i;
+
+  if (source->leader) {
+    if (g_list_find (thiz->joining, source))
+      thiz->joining = g_list_remove (thiz->joining, source);
+    else
+      source->leader->followers =
+          g_list_remove (source->leader->followers, source);
+    gst_curl_multi_context_detach (source);
+    gst_curl_multi_context_release (source);
+    return;
+  }
+
+  /* Already finished */
+  if (!g_list_find (thiz->active_sources, source)) {
+    gst_curl_multi_context_release (source);
+    return;
+  }
+
+  GST_DEBUG ("Removing cancelled source");
+  handle = source->easy_handle;
+  for (i = 0; i < source->n_legs; i++) {
+    if (source->legs[i].handle != handle) {
+      gst_curl_multi_context_drop_leg (thiz, &source->legs[i]);
+    } else {
+      gst_curl_multi_context_leg_clear (&source->legs[i]);
+      source->legs[i].handle = NULL;
+    }
+  }
+  thiz->hedged_sources = g_list_remove (thiz->hedged_sources, source);
+
+  curl_multi_remove_handle (thiz->multi_handle, handle);
+  thiz->active_sources = g_list_remove (thiz->active_sources, source);
+  thiz->sources--;
+  gst_curl_multi_context_release_followers (source, handle,
+      CURLE_ABORTED_BY_CALLBACK);
+  gst_curl_multi_context_detach (source);
+  gst_curl_multi_context_release (source);
+}
+
+/* must be called from the worker with the context lock */
+static void
+gst_curl_multi_context_run_commands (GstCurlMultiContext * thiz)
+{
+  GstCurlMultiContextCommand *command, *next, *list = NULL;
+
+  /* Take them all at once, they were pushed in reverse order */
+  do {
+    command = g_atomic_pointer_get (&thiz->commands);
+  } while (command && !g_atomic_pointer_compare_and_exchange (&thiz->commands,
+          command, NULL));
+
+  for (; command; command = next) {
+    next = command->next;
+    command->next = list;
+    list = command;
+  }
+
+  for (command = list; command; command = next) {
+    next = command->next;
+
+    switch (command->type) {
+      case GST_CURL_MULTI_CONTEXT_COMMAND_ADD:
+        gst_curl_multi_context_do_add (thiz, command->handle, command->value);
+        break;
+      case GST_CURL_MULTI_CONTEXT_COMMAND_REMOVE:
+        gst_curl_multi_context_do_remove (thiz, command->source);
+        break;
+      case GST_CURL_MULTI_CONTEXT_COMMAND_DEADLINE:
+        command->source->deadline = command->value;
+        command->source->miss_reported = FALSE;
+        break;
+      case GST_CURL_MULTI_CONTEXT_COMMAND_MAX_RATE:
+        thiz->max_rate = command->value;
+        thiz->tokens = gst_curl_multi_context_burst (thiz);
+        break;
+    }
+    g_free (command);
   }
 }
 
@@ -90,22 +1458,39 @@ static void
 gst_curl_multi_context_loop (gpointer thread_data)
 {
   GstCurlMultiContext* thiz;
+  gint64 locked;
   gint rc;
   struct timeval timeout;
   int maxfd = -1;
   long curl_timeo = -1;
+  glong hedge_timeo, refill_timeo;
   fd_set fdread, fdwrite, fdexcep;
 
   thiz = (GstCurlMultiContext *) thread_data;
 
   g_mutex_lock (&thiz->mutex);
   /* Someone is holding a reference to us, but isn't using us so to avoid
-   * unnecessary clock cycle wasting, sit in a conditional wait until woken.
+   * unnecessary clock cycle wasting, sleep on the wake up pipe until woken.
    */
-  while (thiz->sources == 0 && thiz->refcount > 0) {
+  while (thiz->sources == 0 && !g_atomic_pointer_get (&thiz->commands) &&
+      thiz->refcount > 0) {
+    GPollFD fd;
+
+    fd.fd = thiz->wakeup[0];
+    fd.events = G_IO_IN;
+    fd.revents = 0;
+
+    g_mutex_unlock (&thiz->mutex);
     GST_DEBUG ("Entering wait state...");
-    g_cond_wait (&thiz->signal, &thiz->mutex);
+    if (fd.fd >= 0) {
+      g_poll (&fd, 1, -1);
+      gst_curl_multi_context_drain_wakeup (thiz);
+    } else {
+      /* no pipe, look for commands from time to time */
+      g_usleep (GST_CURL_MULTI_CONTEXT_SCHEDULE_MS * 1000);
+    }
     GST_DEBUG ("Received wake up call!");
+    g_mutex_lock (&thiz->mutex);
   }
 
   /* check the exit condition */
@@ -114,6 +1499,18 @@ gst_curl_multi_context_loop (gpointer thread_data)
     g_mutex_unlock (&thiz->mutex);
     return;
   }
+  locked = g_get_monotonic_time ();
+
+  thiz->pushes += thiz->worker_pushes;
+  thiz->wakeups += thiz->worker_wakeups;
+  thiz->worker_pushes = thiz->worker_wakeups = 0;
+
+  gst_curl_multi_context_run_commands (thiz);
+
+  hedge_timeo = gst_curl_multi_context_hedge (thiz);
+  refill_timeo = gst_curl_multi_context_refill (thiz);
+  if (refill_timeo >= 0 && (hedge_timeo < 0 || refill_timeo < hedge_timeo))
+    hedge_timeo = refill_timeo;
 
   FD_ZERO (&fdread);
   FD_ZERO (&fdwrite);
@@ -123,6 +1520,9 @@ gst_curl_multi_context_loop (gpointer thread_data)
   timeout.tv_usec = 0;
 
   curl_multi_timeout (thiz->multi_handle, &curl_timeo);
+  /* wake up in time for the next hedge or refill */
+  if (hedge_timeo >= 0 && (curl_timeo < 0 || hedge_timeo < curl_timeo))
+    curl_timeo = hedge_timeo;
   if (curl_timeo >= 0) {
   timeout.tv_sec = curl_timeo / 1000;
     if (timeout.tv_sec > 1) {
@@ -135,15 +1535,25 @@ gst_curl_multi_context_loop (gpointer thread_data)
 
   /* get file descriptors from the transfers */
   curl_multi_fdset (thiz->multi_handle, &fdread, &fdwrite, &fdexcep, &maxfd);
+  /* and the one to be woken up by new commands */
+  if (thiz->wakeup[0] >= 0) {
+    FD_SET (thiz->wakeup[0], &fdread);
+    maxfd = MAX (maxfd, thiz->wakeup[0]);
+  }
 
-  /* Because curl can possibly take some time here, be nice and let go of the
-   * mutex so other threads can perform state/queue operations as we don't
-   * care about those until the end of this. */
+  /*
+   * Let go of the mutex from here on. curl_multi_perform calls the callbacks
+   * of every source, the other threads must not wait for that to add or
+   * remove theirs.
+   */
+  gst_curl_multi_context_held (thiz, locked);
   g_mutex_unlock (&thiz->mutex);
 
   rc = select (maxfd + 1, &fdread, &fdwrite, &fdexcep, &timeout);
 
-  g_mutex_lock (&thiz->mutex);
+  if (rc > 0 && thiz->wakeup[0] >= 0 && FD_ISSET (thiz->wakeup[0], &fdread))
+    gst_curl_multi_context_drain_wakeup (thiz);
+
   switch (rc) {
   case -1:
     /* select error */
@@ -156,8 +1566,6 @@ gst_curl_multi_context_loop (gpointer thread_data)
   }
 
   gst_curl_multi_context_process_msgs (thiz);
-
-  g_mutex_unlock(&thiz->mutex);
 }
 
 void
@@ -170,6 +1578,15 @@ gst_curl_multi_context_ref (GstCurlMultiContext * thiz)
     /* set up curl */
     thiz->multi_handle = curl_multi_init ();
 
+    /* Without the pipe, new commands wait for the select timeout */
+    if (pipe (thiz->wakeup) == 0) {
+      fcntl (thiz->wakeup[0], F_SETFL, O_NONBLOCK);
+      fcntl (thiz->wakeup[1], F_SETFL, O_NONBLOCK);
+    } else {
+      GST_WARNING ("Couldn't create the wake up pipe");
+      thiz->wakeup[0] = thiz->wakeup[1] = -1;
+    }
+
     curl_multi_setopt (thiz->multi_handle,
                        CURLMOPT_PIPELINING, 1);
 #ifdef CURLMOPT_MAX_HOST_CONNECTIONS
@@ -218,11 +1635,25 @@ gst_curl_multi_context_unref (GstCurlMultiContext * thiz)
   GST_INFO ("Worker thread refcount is now %u", thiz->refcount);
 
   if (thiz->refcount <= 0) {
+    GstCurlMultiContextCommand *command, *next;
+
     /* Everything's done! Clean up. */
     gst_task_pause (thiz->task);
-    g_cond_signal (&thiz->signal);
     g_mutex_unlock (&thiz->mutex);
+    gst_curl_multi_context_wakeup (thiz);
     gst_task_join (thiz->task);
+
+    command = g_atomic_pointer_get (&thiz->commands);
+    thiz->commands = NULL;
+    for (; command; command = next) {
+      next = command->next;
+      g_free (command);
+    }
+    if (thiz->wakeup[0] >= 0) {
+      close (thiz->wakeup[0]);
+      close (thiz->wakeup[1]);
+      thiz->wakeup[0] = thiz->wakeup[1] = -1;
+    }
   } else {
     g_mutex_unlock(&thiz->mutex);
   }
@@ -249,9 +1680,365 @@ gst_curl_multi_context_add_source (GstCurlMultiContext * thiz, CURL * handle)
   curl_easy_getinfo (handle, CURLINFO_EFFECTIVE_URL, &url);
   GST_DEBUG ("Adding easy handle for URI %s", url);
 
+  gst_curl_multi_context_post (thiz, GST_CURL_MULTI_CONTEXT_COMMAND_ADD, NULL,
+      handle, g_get_monotonic_time ());
+}
+
+/*
+ * Take out a source the element cancelled. The source is then done with a
+ * success status, the element owns its handle again once it sees it done.
+ */
+void
+gst_curl_multi_context_remove_source (GstCurlMultiContext * thiz,
+    GstCurlMultiContextSource * source)
+{
+  gst_curl_multi_context_post (thiz, GST_CURL_MULTI_CONTEXT_COMMAND_REMOVE,
+      source, NULL, 0);
+}
+
+GstStructure *
+gst_curl_multi_context_get_hedge_stats (GstCurlMultiContext * thiz)
+{
+  GstStructure *stats;
+
   g_mutex_lock (&thiz->mutex);
-  curl_multi_add_handle (thiz->multi_handle, handle);
-  thiz->sources++;
-  g_cond_signal (&thiz->signal);
+  stats = gst_structure_new ("hedge-stats",
+      "requests", G_TYPE_UINT64, thiz->hedge_requests,
+      "issued", G_TYPE_UINT64, thiz->hedges_issued,
+      "won", G_TYPE_UINT64, thiz->hedges_won,
+      "ttfb-median", G_TYPE_INT64,
+      gst_curl_multi_context_ttfb_percentile (thiz, 50), NULL);
+  g_mutex_unlock (&thiz->mutex);
+
+  return stats;
+}
+
+void
+gst_curl_multi_context_set_max_rate (GstCurlMultiContext * thiz, guint64 rate)
+{
+  gst_curl_multi_context_post (thiz, GST_CURL_MULTI_CONTEXT_COMMAND_MAX_RATE,
+      NULL, NULL, (gint64) rate);
+}
+
+guint64
+gst_curl_multi_context_get_max_rate (GstCurlMultiContext * thiz)
+{
+  guint64 rate;
+
+  g_mutex_lock (&thiz->mutex);
+  rate = thiz->max_rate;
+  g_mutex_unlock (&thiz->mutex);
+
+  return rate;
+}
+
+/*
+ * Take the received bytes from the buckets. Returns FALSE if the source is
+ * over its share and must be paused by returning CURL_WRITEFUNC_PAUSE, the
+ * bytes are then delivered again once it is resumed.
+ *
+ * Called from the curl callbacks, hence from the worker.
+ */
+gboolean
+gst_curl_multi_context_source_consume (GstCurlMultiContextSource * source,
+    gsize bytes)
+{
+  GstCurlMultiContext *thiz = source->context;
+
+  if (thiz == NULL)
+    return TRUE;
+
+  if (source->held || gst_curl_multi_context_spill_full (source, bytes)) {
+    source->paused = TRUE;
+    return FALSE;
+  }
+
+  if (gst_curl_multi_context_suspended (source)) {
+    GST_DEBUG ("Element paused, pausing its transfer");
+    g_atomic_int_set (&source->suspended, 1);
+    source->paused = TRUE;
+    return FALSE;
+  }
+
+  if (thiz->max_rate == 0)
+    return TRUE;
+
+  if (source->tokens <= 0 &&
+      thiz->tokens <= gst_curl_multi_context_burst (thiz) / 2) {
+    source->paused = TRUE;
+    return FALSE;
+  }
+
+  source->tokens -= bytes;
+  thiz->tokens -= bytes;
+  return TRUE;
+}
+
+/*
+ * Change the deadline of a running source, 0 removes it. A miss is reported
+ * again if the new deadline is predicted to be missed too.
+ */
+void
+gst_curl_multi_context_set_deadline (GstCurlMultiContext * thiz,
+    GstCurlMultiContextSource * source, gint64 deadline)
+{
+  gst_curl_multi_context_post (thiz, GST_CURL_MULTI_CONTEXT_COMMAND_DEADLINE,
+      source, NULL, deadline);
+}
+
+/*
+ * The handle receiving the data of a source, the one of its leader if it is
+ * coalesced. Only valid from the callbacks.
+ */
+CURL *
+gst_curl_multi_context_source_handle (GstCurlMultiContextSource * source)
+{
+  return source->leader ? source->leader->easy_handle : source->easy_handle;
+}
+
+/*
+ * Hand a header line to the followers of a source and keep it for the late
+ * joiners.
+ *
+ * Called from the curl callbacks, hence from the worker.
+ */
+void
+gst_curl_multi_context_source_fanout_header (GstCurlMultiContextSource * source,
+    const gchar * header, gsize len)
+{
+  GList *walk;
+
+  if (source->key == NULL || source->leader)
+    return;
+
+  for (walk = source->followers; walk; walk = walk->next) {
+    GstCurlMultiContextSource *follower = walk->data;
+
+    follower->header_func ((char *) header, 1, len, follower->func_data);
+  }
+
+  if (source->replay_full)
+    return;
+
+  /* Only the headers of the final response matter to a late joiner */
+  if (len <= 2 && (header[0] == '\r' || header[0] == '\n')) {
+    glong code = 0;
+
+    curl_easy_getinfo (source->easy_handle, CURLINFO_RESPONSE_CODE, &code);
+    if (code < 200 || (code >= 300 && code <= 399)) {
+      gst_curl_multi_context_replay_clear (source);
+      return;
+    }
+  }
+
+  g_queue_push_tail (&source->replay_headers, g_strndup (header, len));
+}
+
+/*
+ * Hand a buffer of received data to the followers of a source and keep it
+ * for the late joiners, up to GST_CURL_MULTI_CONTEXT_REPLAY_MAX after which
+ * no one can join anymore.
+ *
+ * Called from the curl callbacks, hence from the worker.
+ */
+void
+gst_curl_multi_context_source_fanout (GstCurlMultiContextSource * source,
+    GstBuffer * buf, gsize size)
+{
+  GList *walk;
+
+  if (source->key == NULL || source->leader)
+    return;
+
+  for (walk = source->followers; walk; walk = walk->next) {
+    GstCurlMultiContextSource *follower = walk->data;
+
+    follower->buffer_func (gst_buffer_ref (buf), size, follower->func_data);
+  }
+
+  if (source->replay_full)
+    return;
+
+  if (source->replay_size + size > GST_CURL_MULTI_CONTEXT_REPLAY_MAX) {
+    GST_DEBUG ("Too much data to replay, not coalescing anymore");
+    source->replay_full = TRUE;
+    gst_curl_multi_context_replay_clear (source);
+    return;
+  }
+
+  g_queue_push_tail (&source->replay_buffers, gst_buffer_ref (buf));
+  source->replay_size += size;
+}
+
+/*
+ * Hand a buffer of received data to the element. Only the worker pushes, so
+ * the head of the ring is only written here and the lock is only taken when
+ * the ring is full or to wake up the element.
+ *
+ * Called from the curl callbacks, hence from the worker.
+ */
+void
+gst_curl_multi_context_source_push (GstCurlMultiContextSource * source,
+    GstBuffer * buf)
+{
+  gint head, next;
+
+  if (source->context)
+    source->context->worker_pushes++;
+
+  if (source->spill_threshold && (g_atomic_int_get (&source->spilling) ||
+          g_atomic_int_get (&source->queued) >= source->spill_threshold)) {
+    gst_curl_multi_context_spill (source, buf);
+    return;
+  }
+  g_atomic_int_add (&source->queued, GSTCURL_BUFFER_SIZE (buf));
+
+  head = g_atomic_int_get (&source->ring_head);
+  next = (head + 1) & (GST_CURL_MULTI_CONTEXT_RING_SIZE - 1);
+
+  if (g_atomic_int_get (&source->overflowing) ||
+      next == g_atomic_int_get (&source->ring_tail)) {
+    g_mutex_lock (&source->mutex);
+    g_queue_push_tail (&source->overflow, buf);
+    g_atomic_int_set (&source->overflowing, 1);
+    g_cond_signal (&source->signal);
+    g_mutex_unlock (&source->mutex);
+    return;
+  }
+
+  source->ring[head] = buf;
+  g_atomic_int_set (&source->ring_head, next);
+
+  if (g_atomic_int_get (&source->parked)) {
+    if (source->context)
+      source->context->worker_wakeups++;
+    g_mutex_lock (&source->mutex);
+    g_cond_signal (&source->signal);
+    g_mutex_unlock (&source->mutex);
+  }
+}
+
+/*
+ * Take the oldest buffer received, or NULL if there is none. The ring is
+ * emptied before the overflow queue, as it only holds older buffers.
+ *
+ * must be called by the element with the source lock
+ */
+GstBuffer *
+gst_curl_multi_context_source_pop (GstCurlMultiContextSource * source,
+    gsize * size)
+{
+  GstBuffer *buf = NULL;
+  gint tail;
+
+  tail = g_atomic_int_get (&source->ring_tail);
+  if (tail != g_atomic_int_get (&source->ring_head)) {
+    buf = source->ring[tail];
+    source->ring[tail] = NULL;
+    g_atomic_int_set (&source->ring_tail,
+        (tail + 1) & (GST_CURL_MULTI_CONTEXT_RING_SIZE - 1));
+  } else if (g_atomic_int_get (&source->overflowing)) {
+    buf = g_queue_pop_head (&source->overflow);
+    if (g_queue_is_empty (&source->overflow))
+      g_atomic_int_set (&source->overflowing, 0);
+  } else if (g_atomic_int_get (&source->spilling)) {
+    /* The spilled data comes after everything in memory */
+    buf = gst_curl_multi_context_unspill (source);
+    if (buf)
+      *size = GSTCURL_BUFFER_SIZE (buf);
+    return buf;
+  }
+
+  if (buf) {
+    *size = GSTCURL_BUFFER_SIZE (buf);
+    g_atomic_int_add (&source->queued, -(gint) *size);
+  }
+
+  return buf;
+}
+
+/*
+ * Wait until the worker signals the source. The ring is checked again once
+ * parked so a push that did not see the element parked is not missed.
+ *
+ * must be called by the element with the source lock
+ */
+void
+gst_curl_multi_context_source_wait (GstCurlMultiContextSource * source)
+{
+  gst_curl_multi_context_source_wait_until (source, -1);
+}
+
+/*
+ * Same as gst_curl_multi_context_source_wait, but gives up at end_time on the
+ * monotonic clock unless it is -1. Returns FALSE if it gave up.
+ *
+ * must be called by the element with the source lock
+ */
+gboolean
+gst_curl_multi_context_source_wait_until (GstCurlMultiContextSource * source,
+    gint64 end_time)
+{
+  gboolean signalled = TRUE;
+
+  g_atomic_int_set (&source->parked, 1);
+  if (g_atomic_int_get (&source->ring_tail) ==
+      g_atomic_int_get (&source->ring_head) &&
+      !g_atomic_int_get (&source->overflowing) &&
+      !g_atomic_int_get (&source->spilling)) {
+    if (end_time < 0)
+      g_cond_wait (&source->signal, &source->mutex);
+    else
+      signalled = g_cond_wait_until (&source->signal, &source->mutex,
+          end_time);
+  }
+  g_atomic_int_set (&source->parked, 0);
+
+  return signalled;
+}
+
+/*
+ * Bytes received and not popped yet, in memory or spilled. Can be called from
+ * any thread.
+ */
+gsize
+gst_curl_multi_context_source_level (GstCurlMultiContextSource * source)
+{
+  return MAX (g_atomic_int_get (&source->queued), 0) +
+      MAX (g_atomic_int_get (&source->spill_used), 0);
+}
+
+/*
+ * Drop everything received, once the worker is done with the source.
+ *
+ * must be called by the element with the source lock
+ */
+void
+gst_curl_multi_context_source_flush (GstCurlMultiContextSource * source)
+{
+  GstBuffer *buf;
+  gsize size;
+
+  gst_curl_multi_context_spill_clear (source);
+  while ((buf = gst_curl_multi_context_source_pop (source, &size)))
+    gst_buffer_unref (buf);
+  g_atomic_int_set (&source->queued, 0);
+}
+
+GstStructure *
+gst_curl_multi_context_get_lock_stats (GstCurlMultiContext * thiz)
+{
+  GstStructure *stats;
+
+  g_mutex_lock (&thiz->mutex);
+  stats = gst_structure_new ("lock-stats",
+      "hold-max", G_TYPE_INT64, thiz->hold_max,
+      "hold-mean", G_TYPE_INT64,
+      thiz->holds ? thiz->hold_total / (gint64) thiz->holds : (gint64) 0,
+      "add-wait-max", G_TYPE_INT64, thiz->add_wait_max,
+      "pushes", G_TYPE_UINT64, thiz->pushes,
+      "wakeups", G_TYPE_UINT64, thiz->wakeups, NULL);
   g_mutex_unlock (&thiz->mutex);
+
+  return stats;
 }
@@ -12,6 +12,40 @@
 typedef enum _GstCurlMultiContextSourceStatus GstCurlMultiContextSourceStatus;
 typedef struct _GstCurlMultiContextSource GstCurlMultiContextSource;
 typedef struct _GstCurlMultiContext GstCurlMultiContext;
+typedef struct _GstCurlMultiContextLeg GstCurlMultiContextLeg;
+typedef struct _GstCurlMultiContextSpill GstCurlMultiContextSpill;
+typedef struct _GstCurlMultiContextSpillChunk GstCurlMultiContextSpillChunk;
+
+/* Takes a buffer of received data, owns it */
+typedef void (*GstCurlMultiContextBufferFunc) (GstBuffer * buf, gsize size,
+    gpointer data);
+typedef void (*GstCurlMultiContextDoneFunc) (gpointer data);
+
+/* Number of time-to-first-byte samples kept to decide when to hedge */
+#define GST_CURL_MULTI_CONTEXT_TTFB_SAMPLES 64
+#define GST_CURL_MULTI_CONTEXT_TTFB_MIN_SAMPLES 8
+/* Maximum number of concurrent requests for one source */
+#define GST_CURL_MULTI_CONTEXT_MAX_LEGS 8
+/* Bandwidth that can be saved up by the token buckets, in ms of the cap */
+#define GST_CURL_MULTI_CONTEXT_BURST_MS 100
+/* How often paused sources are checked for new tokens */
+#define GST_CURL_MULTI_CONTEXT_REFILL_MS 10
+/* How often the transfers with a deadline are checked */
+#define GST_CURL_MULTI_CONTEXT_SCHEDULE_MS 100
+/* Longest the sources without a deadline are held back in a row */
+#define GST_CURL_MULTI_CONTEXT_HOLD_MAX_MS 2000
+/* Data kept for the requests joining a coalesced transfer late */
+#define GST_CURL_MULTI_CONTEXT_REPLAY_MAX (16 * 1024 * 1024)
+/* Buffers in flight between the worker and an element, a power of 2 */
+#define GST_CURL_MULTI_CONTEXT_RING_SIZE 256
+/* Size of the buffers read back from a spill file, and room it must have */
+#define GST_CURL_MULTI_CONTEXT_SPILL_CHUNK (64 * 1024)
+
+#if GST_CHECK_VERSION(1,0,0)
+#define GSTCURL_BUFFER_SIZE(b) gst_buffer_get_size (b)
+#else
+#define GSTCURL_BUFFER_SIZE(b) GST_BUFFER_SIZE (b)
+#endif
 
 enum _GstCurlMultiContextSourceStatus
 {
@@ -19,19 +53,141 @@ enum _GstCurlMultiContextSourceStatus
   GST_CURL_MULTI_CONTEXT_SOURCE_STATUS_ERROR,
 };
 
+/* One of the concurrent requests of a hedged source */
+struct _GstCurlMultiContextLeg
+{
+  GstCurlMultiContextSource *source;
+  CURL *handle;
+  /* 0 for the primary and hedged requests, n for race_urls[n - 1] */
+  guint tag;
+  /* the status of its last response, and its header lines held back until
+   * it wins with a successful one */
+  glong status;
+  GQueue headers;
+};
+
+/* A mapped spill file, shared by a source and the buffers read back from it */
+struct _GstCurlMultiContextSpill
+{
+  gint refcount;
+  gint fd;
+  guint8 *map;
+  gsize size;
+  /* the buffers read back and not freed yet in read order, with the lock.
+   * The ring is free up to released once they are. */
+  GMutex lock;
+  GQueue chunks;
+  guint64 released;
+};
+
+/* A buffer read back from a spill file */
+struct _GstCurlMultiContextSpillChunk
+{
+  GstCurlMultiContextSpill *spill;
+  guint64 end;
+  gboolean done;
+};
+
 struct _GstCurlMultiContextSource
 {
   GMutex mutex;
   GCond signal;
   CURL *easy_handle;
-  /* where to store the bytes */
+  /* where to store the bytes, only used by the element */
   GstAdapter *adapter;
   /* the element request a cancel on the handle */
   gboolean cancel;
   /* the done message has been received */
   gboolean done;
+  /* the worker let go of it after a remove, it can be freed */
+  gboolean removed;
   /* the status once the source has ended */
   GstCurlMultiContextSourceStatus status;
+  /* the transfer result and last response code, to decide on a retry */
+  CURLcode curl_code;
+  glong response_code;
+
+  /* hedging, a percentile of 0 disables it */
+  guint hedge_percentile;
+  gdouble hedge_max_rate;
+  /* alternate URLs to race the request against, NULL terminated */
+  gchar **race_urls;
+  /* the Unix socket of each of them, empty to connect over the network */
+  gchar **race_unix_sockets;
+  /* the element callbacks, called from the ones of the winning request */
+  curl_write_callback header_func;
+  curl_write_callback write_func;
+  gpointer func_data;
+#if LIBCURL_VERSION_NUM >= 0x072000
+  /* the stall detection of the element, NULL for none */
+  curl_xferinfo_callback progress_func;
+#endif
+  /* share of the shared bandwidth cap, relative to the other sources */
+  guint weight;
+  /* monotonic time the transfer must be done by, 0 for none */
+  gint64 deadline;
+  /* set when the deadline is predicted to be missed, with the expected end */
+  gboolean deadline_missed;
+  gint64 predicted_end;
+  /* identical requests in flight share one transfer, NULL to not share */
+  gchar *key;
+  GstCurlMultiContextBufferFunc buffer_func;
+  /* called by the worker with the lock once done is set, NULL for none */
+  GstCurlMultiContextDoneFunc done_func;
+  /* past spill_threshold bytes waiting for the element, the data goes to a
+   * temporary file of spill_max bytes, 0 to keep everything in memory */
+  gsize spill_threshold;
+  gsize spill_max;
+  /* set while the element is paused, the transfer is then paused too once
+   * suspend_lookahead bytes are waiting for it */
+  gint suspend;
+  gsize suspend_lookahead;
+  /* the transfer was paused for it, its connection may be gone */
+  gint suspended;
+
+  /* < private > */
+  GstCurlMultiContext *context;
+  gint64 added_time;
+  gint64 tokens;
+  gboolean paused;
+  gdouble rate;
+  gboolean held;
+  gboolean miss_reported;
+  /* coalescing, a follower gets the data of the transfer of its leader */
+  GstCurlMultiContextSource *leader;
+  GList *followers;
+  GQueue replay_headers;
+  GQueue replay_buffers;
+  gsize replay_size;
+  gboolean replay_full;
+
+  /*
+   * The received buffers, pushed by the worker without the lock and popped by
+   * the element. The signal is only sent when the element is parked waiting
+   * for them. Once the ring is full they go through the overflow queue, with
+   * the lock, until the element catches up.
+   */
+  GstBuffer *ring[GST_CURL_MULTI_CONTEXT_RING_SIZE];
+  gint ring_head;
+  gint ring_tail;
+  gint parked;
+  gint overflowing;
+  GQueue overflow;
+  gint queued;
+  /*
+   * Once spilling, everything goes to the file until the element read it all
+   * back, and to the pending queue behind it when it is full. The file is
+   * written by the worker without the lock, the positions change with it.
+   */
+  gint spilling;
+  gint spill_used;
+  GstCurlMultiContextSpill *spill;
+  guint64 spill_read;
+  guint64 spill_write;
+  GQueue spill_pending;
+  GstCurlMultiContextLeg legs[GST_CURL_MULTI_CONTEXT_MAX_LEGS];
+  guint n_legs;
+  GstCurlMultiContextLeg *winner;
 };
 
 struct _GstCurlMultiContext
@@ -49,11 +205,67 @@ struct _GstCurlMultiContext
   /* < private > */
   CURLM *multi_handle;
   int sources;
+
+  /*
+   * Requests from the elements, pushed without any lock and run by the worker
+   * which owns everything below. The worker only holds the mutex for its
+   * bookkeeping, never while the transfers run.
+   */
+  gpointer commands;
+  gint wakeup[2];
+
+  /* hedged sources still waiting for their first byte */
+  GList *hedged_sources;
+  gint64 ttfb[GST_CURL_MULTI_CONTEXT_TTFB_SAMPLES];
+  guint ttfb_count;
+  guint ttfb_next;
+  guint64 hedge_requests;
+  guint64 hedges_issued;
+  guint64 hedges_won;
+
+  /* all the running sources */
+  GList *active_sources;
+  /* bandwidth cap shared by all the sources in bytes/sec, 0 is unlimited */
+  guint64 max_rate;
+  gint64 tokens;
+  gint64 last_refill;
+  /* since when the sources without a deadline are held back, 0 if not */
+  gint64 held_since;
+
+  /* followers waiting for the replay of what their leader received */
+  GList *joining;
+
+  /* lock instrumentation, in us */
+  gint64 hold_max;
+  gint64 hold_total;
+  guint64 holds;
+  gint64 add_wait_max;
+  guint64 pushes;
+  guint64 wakeups;
+  /* counted by the callbacks without the lock, added to the above with it */
+  guint64 worker_pushes;
+  guint64 worker_wakeups;
 };
 
 void gst_curl_multi_context_ref (GstCurlMultiContext * thiz);
 void gst_curl_multi_context_unref (GstCurlMultiContext * thiz);
 void gst_curl_multi_context_stop (GstCurlMultiContext * thiz);
 void gst_curl_multi_context_add_source (GstCurlMultiContext * thiz, CURL * handle);
+void gst_curl_multi_context_remove_source (GstCurlMultiContext * thiz, GstCurlMultiContextSource * source);
+GstStructure * gst_curl_multi_context_get_hedge_stats (GstCurlMultiContext * thiz);
+void gst_curl_multi_context_set_max_rate (GstCurlMultiContext * thiz, guint64 rate);
+guint64 gst_curl_multi_context_get_max_rate (GstCurlMultiContext * thiz);
+gboolean gst_curl_multi_context_source_consume (GstCurlMultiContextSource * source, gsize bytes);
+void gst_curl_multi_context_set_deadline (GstCurlMultiContext * thiz, GstCurlMultiContextSource * source, gint64 deadline);
+CURL * gst_curl_multi_context_source_handle (GstCurlMultiContextSource * source);
+void gst_curl_multi_context_source_push (GstCurlMultiContextSource * source, GstBuffer * buf);
+GstBuffer * gst_curl_multi_context_source_pop (GstCurlMultiContextSource * source, gsize * size);
+void gst_curl_multi_context_source_wait (GstCurlMultiContextSource * source);
+gboolean gst_curl_multi_context_source_wait_until (GstCurlMultiContextSource * source, gint64 end_time);
+gsize gst_curl_multi_context_source_level (GstCurlMultiContextSource * source);
+void gst_curl_multi_context_source_flush (GstCurlMultiContextSource * source);
+GstStructure * gst_curl_multi_context_get_lock_stats (GstCurlMultiContext * thiz);
+void gst_curl_multi_context_source_fanout_header (GstCurlMultiContextSource * source, const gchar * header, gsize len);
+void gst_curl_multi_context_source_fanout (GstCurlMultiContextSource * source, GstBuffer * buf, gsize size);
 
 #endif